@@ -1,5 +1,15 @@
 #!/usr/bin/env bash
 
+case "$(uname -s)" in
+	Darwin) SHLIB=libbmfs.dylib ;;
+	MINGW*|MSYS*|CYGWIN*) SHLIB=bmfs.dll ;;
+	*) SHLIB=libbmfs.so ;;
+esac
+
 mkdir -p bin
-gcc -o bin/bmfs src/bmfs.c -Wall -W -pedantic -std=c99
-gcc -o bin/bmfslite src/bmfslite.c -Wall -W -pedantic -std=c99
+gcc -c -fPIC -o bin/libbmfs.o src/libbmfs.c -Wall -W -pedantic -std=c99 -pthread
+ar rcs bin/libbmfs.a bin/libbmfs.o
+gcc -shared -o bin/$SHLIB bin/libbmfs.o -pthread
+gcc -o bin/bmfs src/bmfs.c bin/libbmfs.a -Wall -W -pedantic -std=c99 -pthread
+gcc -o bin/bmfslite src/bmfslite.c bin/libbmfs.a -Wall -W -pedantic -std=c99 -pthread
+gcc -o bin/bmfsd src/bmfsd.c bin/libbmfs.a -Wall -W -pedantic -std=c99 -pthread
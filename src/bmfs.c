@@ -2,6 +2,12 @@
 /* Written by Ian Seyler of Return Infinity */
 /* v1.3 (2023 10 30) */
 
+/* Feature test macros */
+#if defined(__linux__)
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+#endif
+
 /* Global includes */
 #include <stdio.h>
 #include <stdint.h>
@@ -10,6 +16,54 @@
 #include <strings.h>
 #include <ctype.h>
 #include <math.h>
+#include "libbmfs.h"
+#include "bmfsd.h"
+
+/* Platform includes */
+#if defined(__unix__) || defined(__APPLE__)
+#define BMFS_POSIX
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <dirent.h>
+#if defined(__linux__)
+#include <linux/fs.h>
+#elif defined(__APPLE__)
+#include <sys/disk.h>
+#endif
+#if defined(O_DIRECT) || defined(F_NOCACHE)
+#define BMFS_DIRECT
+#endif
+#define BMFS_THREADS
+#include <pthread.h>
+#include <termios.h>
+#include <signal.h>
+#include <poll.h>
+#include <limits.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#endif
+#if defined(_WIN32)
+#include <io.h>
+#include <fcntl.h>
+#include <direct.h>
+#endif
+#if defined(__linux__)
+#define BMFS_COPYRANGE
+#include <sys/sendfile.h>
+#endif
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define BMFS_URING
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+#endif
+#endif
 
 /* Typedefs */
 typedef uint8_t u8;
@@ -18,13 +72,91 @@ typedef uint32_t u32;
 typedef uint64_t u64;
 
 /* Global defines */
-struct BMFSEntry
+struct BMFSDisk;
+
+// Disk I/O backend. read and write transfer exactly len bytes at an absolute
+// byte offset and return 0 on success, so no file position is shared between
+// callers. resize sets the disk size and zeros it without writing the data
+// (0 on success, 1 if the caller has to write zeros itself, -1 if the disk
+// can not be that size). discard releases a range whose contents are no
+// longer needed. map is optional and returns a pointer to the disk contents
+// at offset, or NULL if that range can not be addressed directly.
+struct BMFSDiskOps
 {
-	char FileName[32];
-	u64 StartingBlock;
-	u64 ReservedBlocks;
-	u64 FileSize;
-	u64 Unused;
+	const char *name;
+	int (*open)(struct BMFSDisk *d, const char *path, int create);
+	int (*read)(struct BMFSDisk *d, void *buf, size_t len, u64 offset);
+	int (*write)(struct BMFSDisk *d, const void *buf, size_t len, u64 offset);
+	u64 (*size)(struct BMFSDisk *d);
+	int (*resize)(struct BMFSDisk *d, u64 size, int preallocate);
+	int (*discard)(struct BMFSDisk *d, u64 offset, u64 len);
+	void (*close)(struct BMFSDisk *d);
+	char *(*map)(struct BMFSDisk *d, u64 offset, size_t len);
+};
+
+struct BMFSDisk
+{
+	const struct BMFSDiskOps *ops;
+	FILE *fp;	// stdio backend
+	int fd;		// pread/pwrite and mmap backends
+	char *map;	// mmap backend
+	u64 mapsize;
+	unsigned int align;	// Offset and length alignment for I/O (O_DIRECT, physical sector)
+	int blockdev;		// Raw block device rather than an image file
+	u64 devsize;		// Block device geometry
+	unsigned int sectorsize, physsectorsize;
+	char *xferbuf;		// Transfer buffer, see bmfs_disk_buffer
+};
+
+// bmfs_uring_copy flags
+#define COPY_PAD	1	// Zero fill the final block to blockSize when writing it
+#define COPY_FULLREAD	2	// Read the final block whole
+
+#ifdef BMFS_URING
+// Submission and completion rings shared with the kernel
+struct BMFSRing
+{
+	int fd;
+	unsigned entries;
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void *sq_ptr, *cq_ptr;
+	size_t sq_len, cq_len, sqes_len;
+	unsigned pending;	// Queued but not yet submitted
+};
+#endif
+
+#ifdef BMFS_THREADS
+// Ring of block buffers between a producer thread reading the source and the
+// calling thread writing the destination
+struct BMFSPipeline
+{
+	pthread_mutex_t lock;
+	pthread_cond_t filled, drained;
+	char *buffers;		// depth blocks
+	size_t *lengths;	// Bytes of data in each filled block
+	unsigned depth, head, count;	// Next block to drain, blocks filled
+	int todisk;		// Source is the local file, destination the disk
+	int finished, error, stop;
+	FILE *tfile;
+	u64 offset, len;
+};
+#endif
+
+// Shared state of the extract-all and import-dir workers
+struct BMFSBulk
+{
+	struct BMFSEntry *entries;	// Sorted by starting block
+	char **localnames;		// Local file of each entry, or NULL for dir/FileName
+	const char *dir;
+	int count, next, failed;
+	int todisk;			// Import the local files rather than extract
+
+#ifdef BMFS_THREADS
+	pthread_mutex_t lock;
+#endif
 };
 
 /* Global constants */
@@ -33,9 +165,63 @@ const unsigned int minimumDiskSize = (6 * 1024 * 1024);
 // Block size is 2MiB
 const unsigned int blockSize = 2 * 1024 * 1024;
 
+/* Disk I/O backends */
+static int stdio_open(struct BMFSDisk *d, const char *path, int create);
+static int stdio_read(struct BMFSDisk *d, void *buf, size_t len, u64 offset);
+static int stdio_write(struct BMFSDisk *d, const void *buf, size_t len, u64 offset);
+static u64 stdio_size(struct BMFSDisk *d);
+static int stdio_resize(struct BMFSDisk *d, u64 size, int preallocate);
+static int stdio_discard(struct BMFSDisk *d, u64 offset, u64 len);
+static void stdio_close(struct BMFSDisk *d);
+const struct BMFSDiskOps bmfs_stdio_ops = { "stdio", stdio_open, stdio_read, stdio_write, stdio_size, stdio_resize, stdio_discard, stdio_close, NULL };
+#ifdef BMFS_POSIX
+static int pio_open(struct BMFSDisk *d, const char *path, int create);
+static int pio_read(struct BMFSDisk *d, void *buf, size_t len, u64 offset);
+static int pio_write(struct BMFSDisk *d, const void *buf, size_t len, u64 offset);
+static u64 pio_size(struct BMFSDisk *d);
+static int pio_resize(struct BMFSDisk *d, u64 size, int preallocate);
+static int pio_discard(struct BMFSDisk *d, u64 offset, u64 len);
+static void pio_close(struct BMFSDisk *d);
+static void pio_probe(struct BMFSDisk *d);
+const struct BMFSDiskOps bmfs_pio_ops = { "pio", pio_open, pio_read, pio_write, pio_size, pio_resize, pio_discard, pio_close, NULL };
+static int mmap_open(struct BMFSDisk *d, const char *path, int create);
+static int mmap_read(struct BMFSDisk *d, void *buf, size_t len, u64 offset);
+static int mmap_write(struct BMFSDisk *d, const void *buf, size_t len, u64 offset);
+static void mmap_close(struct BMFSDisk *d);
+static char *mmap_map(struct BMFSDisk *d, u64 offset, size_t len);
+const struct BMFSDiskOps bmfs_mmap_ops = { "mmap", mmap_open, mmap_read, mmap_write, pio_size, pio_resize, pio_discard, mmap_close, mmap_map };
+#endif
+#ifdef BMFS_DIRECT
+static int direct_open(struct BMFSDisk *d, const char *path, int create);
+const struct BMFSDiskOps bmfs_direct_ops = { "direct", direct_open, pio_read, pio_write, pio_size, pio_resize, pio_discard, pio_close, NULL };
+#endif
+
 /* Global variables */
-FILE *file, *disk;
-unsigned int filesize, disksize, retval;
+FILE *file;
+struct BMFSDisk diskdev, *disk;
+static int disk_io_read(void *ctx, void *buf, size_t len, u64 offset);
+static int disk_io_write(void *ctx, const void *buf, size_t len, u64 offset);
+static u64 disk_io_size(void *ctx);
+static int disk_io_lock(void *ctx, int type, u64 offset, u64 len);
+const struct BMFSVolumeIO bmfs_disk_io = { disk_io_read, disk_io_write, disk_io_size, NULL, disk_io_lock };
+#ifdef BMFS_POSIX
+const struct BMFSDiskOps *diskops = &bmfs_pio_ops;	// Positional I/O where available
+#else
+const struct BMFSDiskOps *diskops = &bmfs_stdio_ops;
+#endif
+int preallocate = 0;				// Allocate the whole image on initialize
+int useuring = 0;				// Transfer file data with io_uring
+unsigned int queuedepth = 4;			// Blocks kept in flight by io_uring
+unsigned int pipelinedepth = 0;			// Blocks buffered between reader and writer threads, 0 for none
+unsigned int jobs = 4;				// Worker threads for extract-all, import-dir and multi-file write
+int diskshared = 0;				// Several threads are writing the disk
+u64 rangeoffset = 0;				// read and patch start this far into the file
+u64 rangelength = (u64)-1;			// read at most this much
+char *serverpath = NULL;			// Send the commands to bmfsd on this socket
+int serversock = -1;				// and the disk it calls this
+u32 servervolume;
+unsigned int filesize, retval;
+unsigned long long disksize;
 char tempfilename[32], tempstring[32];
 char *filename, *diskname, *command;
 char fs_tag[] = "BMFS";
@@ -46,35 +232,209 @@ char s_create[] = "create";
 char s_read[] = "read";
 char s_write[] = "write";
 char s_delete[] = "delete";
-struct BMFSEntry entry;
-void *pentry = &entry;
-char *BlockMap;
-char *FileBlocks;
-char Directory[4096];
-char DiskInfo[512];
+char s_batch[] = "batch";
+char s_shell[] = "shell";
+char s_extractall[] = "extract-all";
+char s_importdir[] = "import-dir";
+char s_build[] = "build";
+char s_copy[] = "copy";
+char s_patch[] = "patch";
+char s_append[] = "append";
+BMFSVolume *volume;			// The open disk, see bmfs_mount
+char *Directory;			// Its directory, kept by libbmfs
 
 /* Built-in functions */
+int bmfs_disk_open(const char *path, int create);
+int bmfs_disk_read(void *buf, size_t len, u64 offset);
+int bmfs_disk_write(const void *buf, size_t len, u64 offset);
+u64 bmfs_disk_size(void);
+int bmfs_disk_resize(u64 size, int preallocate);
+int bmfs_disk_discard(u64 offset, u64 len);
+void bmfs_disk_close(void);
+char *bmfs_disk_map(u64 offset, size_t len);
+int bmfs_disk_fd(void);
+unsigned int bmfs_disk_align(void);
+int bmfs_host_fd(FILE *f);
+int bmfs_fd_ispipe(int fd);
+int bmfs_fd_isdirect(int fd);
+FILE *bmfs_binary_stream(FILE *f);
+char *bmfs_buffer_alloc(size_t len);
+void bmfs_buffer_free(char *buf, size_t len);
+char *bmfs_disk_buffer(void);
+int bmfs_uring_copy(int infd, u64 inoff, int outfd, u64 outoff, u64 len, int flags);
+int bmfs_kernel_copy(int infd, u64 inoff, int outfd, u64 outoff, u64 len);
+int bmfs_pipeline_copy(FILE *tfile, u64 offset, u64 len, int todisk);
+int bmfs_disk_zero(u64 offset, u64 len);
+int bmfs_mount(int flags);
+int bmfs_open(const char *path, int flags);
+void bmfs_open_failed(const char *path, int error);
 int bmfs_find(char *filename, struct BMFSEntry *fileentry, int *entrynumber);
 void bmfs_list(void);
-void bmfs_format(void);
+int bmfs_format(void);
+void bmfs_discard_data(void);
+int bmfs_parse_size(const char *size, unsigned long long *bytes);
 int bmfs_initialize(char *diskname, char *size, char *mbr, char *boot, char *kernel);
+int bmfs_build(char *diskname, char *manifest);
 void bmfs_create(char *filename, unsigned long long maxsize);
-void bmfs_read(char *filename);
-void bmfs_write(char *filename);
+void bmfs_create_for(char *filename, unsigned long long size);
+void bmfs_read(char *filename, char *localname);
+void bmfs_write(char *filename, char *localname);
+void bmfs_patch(char *filename, char *localname, int append);
+u64 bmfs_option_value(int argc, char *argv[], int *i, int len);
+int bmfs_stream_in(FILE *tfile, u64 offset, u64 limit, unsigned long long *written, int *carry);
+int bmfs_stream_write(FILE *tfile, char *filename);
+int bmfs_grow(int slot, u64 used);
+int bmfs_regrow(char *filename, struct BMFSEntry *entry, u64 used);
+int bmfs_record(char *filename, const struct BMFSEntry *entry, u64 size, u64 reserved);
+int bmfs_copy(char *source, char *dest);
+int bmfs_extract(struct BMFSEntry *entry, const char *localname, char **buffer);
+int bmfs_extract_all(char *dirname);
+int bmfs_import(struct BMFSEntry *entry, const char *localname, char **buffer);
+int bmfs_import_dir(char *source);
+int bmfs_match(const char *pattern, const char *name);
+int bmfs_multi(char *command, int nargs, char *args[]);
 void bmfs_delete(char *filename);
+void bmfs_flush_directory(void);
+int bmfs_split(char *line, char *args[], int max);
+int bmfs_command(int nargs, char *args[], const char *where, int stdinbusy);
+int bmfs_batch(char *scriptname);
+int bmfs_shell(void);
+int bmfs_client(int argc, char *argv[]);
+int bmfs_client_call(struct BMFSDRequest *req, int fd, const void *data, struct BMFSDReply *reply);
+int bmfs_client_full(void *buf, size_t len, int out);
+int bmfs_client_spool(int fd);
+int bmfs_client_command(int nargs, char *args[], const char *where);
 
 /* Program code */
 int main(int argc, char *argv[])
 {
+	int i, j, multi, status = 0;
+
+	/* Parse options, leaving the positional arguments in argv */
+	for (i = 1, j = 1; i < argc; i++)
+	{
+		if (strcasecmp(argv[i], "--mmap") == 0)
+		{
+#ifdef BMFS_POSIX
+			diskops = &bmfs_mmap_ops;
+#else
+			printf("bmfs error: --mmap is not supported on this platform\n");
+			exit(EXIT_FAILURE);
+#endif
+		}
+		else if (strcasecmp(argv[i], "--direct") == 0)
+		{
+#ifdef BMFS_DIRECT
+			diskops = &bmfs_direct_ops;
+#else
+			printf("bmfs error: --direct is not supported on this platform\n");
+			exit(EXIT_FAILURE);
+#endif
+		}
+		else if (strcasecmp(argv[i], "--preallocate") == 0)
+		{
+			preallocate = 1;
+		}
+		else if (strcasecmp(argv[i], "--uring") == 0)
+		{
+			useuring = 1;
+		}
+		else if (strncasecmp(argv[i], "--queue-depth=", 14) == 0)
+		{
+			queuedepth = atoi(argv[i] + 14);
+			if (queuedepth < 1 || queuedepth > 256)
+			{
+				printf("bmfs error: Queue depth must be between 1 and 256\n");
+				exit(EXIT_FAILURE);
+			}
+			useuring = 1;
+		}
+		else if (strcasecmp(argv[i], "--pipeline") == 0 || strncasecmp(argv[i], "--pipeline=", 11) == 0)
+		{
+#ifdef BMFS_THREADS
+			pipelinedepth = (argv[i][10] == '=') ? atoi(argv[i] + 11) : 4;
+			if (pipelinedepth < 2 || pipelinedepth > 256)
+			{
+				printf("bmfs error: Pipeline depth must be between 2 and 256\n");
+				exit(EXIT_FAILURE);
+			}
+#else
+			printf("bmfs error: --pipeline is not supported on this platform\n");
+			exit(EXIT_FAILURE);
+#endif
+		}
+		else if (strncasecmp(argv[i], "--server=", 9) == 0)
+		{
+#ifdef BMFS_POSIX
+			serverpath = argv[i] + 9;
+#else
+			printf("bmfs error: --server is not supported on this platform\n");
+			exit(EXIT_FAILURE);
+#endif
+		}
+		else if (strncasecmp(argv[i], "--jobs=", 7) == 0)
+		{
+			jobs = atoi(argv[i] + 7);
+			if (jobs < 1 || jobs > 64)
+			{
+				printf("bmfs error: Jobs must be between 1 and 64\n");
+				exit(EXIT_FAILURE);
+			}
+		}
+		else if (strncasecmp(argv[i], "--offset", 8) == 0 && (argv[i][8] == '=' || argv[i][8] == 0))
+		{
+			rangeoffset = bmfs_option_value(argc, argv, &i, 8);
+		}
+		else if (strncasecmp(argv[i], "--length", 8) == 0 && (argv[i][8] == '=' || argv[i][8] == 0))
+		{
+			rangelength = bmfs_option_value(argc, argv, &i, 8);
+		}
+		else if (strncmp(argv[i], "--", 2) == 0)
+		{
+			printf("bmfs error: Unknown option '%s'\n", argv[i]);
+			exit(EXIT_FAILURE);
+		}
+		else
+		{
+			argv[j++] = argv[i];
+		}
+	}
+	argc = j;
+
 	/* Parse arguments */
 	if (argc == 1) // No arguments provided
 	{
 		printf("BareMetal File System Utility v1.3 (2023 10 30)\n");
 		printf("Written by Ian Seyler @ Return Infinity (ian.seyler@returninfinity.com)\n\n");
-		printf("Usage: bmfs disk function file\n\n");
+		printf("Usage: bmfs [options] disk function file\n");
+		printf("       bmfs [options] copy src_disk:file dst_disk[:file]\n\n");
 		printf("Disk:     the name of the disk file\n");
-		printf("Function: list, read, write, create, delete, format, initialize\n");
-		printf("File:     (if applicable)\n");
+		printf("Function: list, read, write, patch, append, create, delete, format,\n");
+		printf("          initialize, batch, shell, extract-all, import-dir, build\n");
+		printf("File:     (if applicable) read and write take an optional local\n");
+		printf("          file name, '-' for standard output/input\n");
+		printf("          read, write and delete also take several file names or\n");
+		printf("          patterns such as '*.app', handled in disk order\n");
+		printf("          patch and append take a local file to write at --offset or\n");
+		printf("          the end of the file ('-' or none for standard input)\n");
+		printf("          batch takes a script of commands, '-' or none for standard input\n");
+		printf("          extract-all takes the directory to extract to (default current)\n");
+		printf("          import-dir takes a local directory, or a list of files ('-' for\n");
+		printf("          standard input)\n");
+		printf("          build takes a manifest describing the whole disk\n");
+		printf("Options:  --mmap  access the disk through a memory mapping\n");
+		printf("          --direct  bypass the page cache for disk I/O (O_DIRECT)\n");
+		printf("          --preallocate  allocate all space on initialize (default sparse)\n");
+		printf("          --uring  transfer file data with io_uring, if available\n");
+		printf("          --queue-depth=N  blocks kept in flight by --uring (default 4)\n");
+		printf("          --pipeline[=N]  overlap disk and local file I/O on two threads\n");
+		printf("                          with N blocks buffered (default 4)\n");
+		printf("          --jobs=N  files copied at once by extract-all, import-dir and write\n");
+		printf("                    (default 4)\n");
+		printf("          --offset=N  read or patch from N bytes into the file\n");
+		printf("          --length=N  read at most N bytes\n");
+		printf("          --server=SOCKET  send list, create, read, write, delete and\n");
+		printf("                           batch to the bmfsd server on SOCKET\n");
 		exit(EXIT_SUCCESS);
 	}
 	else if (argc == 2)
@@ -83,6 +443,24 @@ int main(int argc, char *argv[])
 		exit(EXIT_FAILURE);
 	}
 
+	if (serverpath != NULL)
+	{
+		exit(bmfs_client(argc, argv));
+	}
+
+	if (strcasecmp(s_copy, argv[1]) == 0 && argc >= 3 && strchr(argv[2], ':') != NULL)
+	{
+		if (argc == 4)
+		{
+			exit(bmfs_copy(argv[2], argv[3]));
+		}
+		else
+		{
+			printf("Usage: bmfs %s src_disk:file dst_disk[:file]\n", argv[1]);
+			exit(EXIT_FAILURE);
+		}
+	}
+
 	if (argc >= 3)
 	{
 		diskname = (argc > 1 ? argv[1] : NULL);
@@ -110,40 +488,52 @@ int main(int argc, char *argv[])
 		}
 	}
 
-	if ((disk = fopen(diskname, "r+b")) == NULL)			// Open for read/write in binary mode
+	if (argc > 2 && strcasecmp(s_build, command) == 0)
 	{
-		printf("bmfs error: Unable to open disk '%s'\n", diskname);
-		exit(EXIT_FAILURE);
+		if (argc >= 4)
+		{
+			exit(bmfs_build(diskname, argv[3]));
+		}
+		else
+		{
+			printf("Usage: bmfs disk %s manifest_file\n", command);
+			exit(EXIT_FAILURE);
+		}
 	}
-	else								// Opened ok, is it a valid BMFS disk?
-	{
-		fseek(disk, 0, SEEK_END);
-		disksize = ftell(disk) / 1048576;			// Disk size in MiB
-		fseek(disk, 1024, SEEK_SET);				// Seek 1KiB in for disk information
-		retval = fread(DiskInfo, 512, 1, disk);			// Read 512 bytes to the DiskInfo buffer
-		fseek(disk, 4096, SEEK_SET);				// Seek 4KiB in for directory
-		retval = fread(Directory, 4096, 1, disk);		// Read 4096 bytes to the Directory buffer
-		rewind(disk);
 
-		if (strcasecmp(DiskInfo, fs_tag) != 0)			// Is it a BMFS formatted disk?
+	if ((i = bmfs_open(diskname, 0)) == BMFS_EFORMAT)		// Opened ok, but is it a BMFS formatted disk?
+	{
+		if (strcasecmp(s_format, command) == 0 && bmfs_open(diskname, BMFS_NOCHECK) == 0)
 		{
-			if (strcasecmp(s_format, command) == 0)
-			{
-				bmfs_format();
-			}
-			else
-			{
-				printf("bmfs error: Not a valid BMFS drive (Disk is not BMFS formatted).\n");
-			}
-			fclose(disk);
-			return 0;
+			bmfs_format();				// Data blocks are only discarded with /FORCE
+			bmfs_disk_close();
+		}
+		else
+		{
+			bmfs_open_failed(diskname, BMFS_EFORMAT);
 		}
+		return 0;
+	}
+	else if (i != 0)
+	{
+		bmfs_open_failed(diskname, i);
+		exit(EXIT_FAILURE);
 	}
 
+	// Several names, or patterns, for read, write and delete
+	multi = (argc > (strcasecmp(s_delete, command) == 0 ? 4 : 5));
+	for (i = 3; i < argc; i++)
+		if (strpbrk(argv[i], "*?[") != NULL)
+			multi = 1;
+
 	if (strcasecmp(s_list, command) == 0)
 	{
 		bmfs_list();
 	}
+	else if (multi && (strcasecmp(s_read, command) == 0 || strcasecmp(s_write, command) == 0 || strcasecmp(s_delete, command) == 0))
+	{
+		status = bmfs_multi(command, argc - 3, argv + 3);
+	}
 	else if (strcasecmp(s_format, command) == 0)
 	{
 		if (argc > 3)
@@ -151,6 +541,7 @@ int main(int argc, char *argv[])
 			if (strcasecmp(argv[3], "/FORCE") == 0)
 			{
 				bmfs_format();
+				bmfs_discard_data();
 			}
 			else
 			{
@@ -196,163 +587,1257 @@ int main(int argc, char *argv[])
 	}
 	else if (strcasecmp(s_read, command) == 0)
 	{
-		bmfs_read(filename);
+		bmfs_read(filename, (argc > 4 ? argv[4] : NULL));
 	}
 	else if (strcasecmp(s_write, command) == 0)
 	{
-		bmfs_write(filename);
+		bmfs_write(filename, (argc > 4 ? argv[4] : NULL));
+	}
+	else if (strcasecmp(s_patch, command) == 0)
+	{
+		if (filename == NULL)
+			printf("bmfs error: File name not specified.\n");
+		else
+			bmfs_patch(filename, (argc > 4 ? argv[4] : NULL), 0);
+	}
+	else if (strcasecmp(s_append, command) == 0)
+	{
+		if (filename == NULL)
+			printf("bmfs error: File name not specified.\n");
+		else
+			bmfs_patch(filename, (argc > 4 ? argv[4] : NULL), 1);
 	}
 	else if (strcasecmp(s_delete, command) == 0)
 	{
 		bmfs_delete(filename);
 	}
+	else if (strcasecmp(s_batch, command) == 0)
+	{
+		status = bmfs_batch(filename);
+	}
+	else if (strcasecmp(s_shell, command) == 0)
+	{
+		status = bmfs_shell();
+	}
+	else if (strcasecmp(s_extractall, command) == 0)
+	{
+		status = bmfs_extract_all(filename);
+	}
+	else if (strcasecmp(s_importdir, command) == 0)
+	{
+		status = bmfs_import_dir(filename);
+	}
 	else
 	{
 		printf("bmfs error: Unknown command\n");
 	}
 
+	bmfs_disk_close();
+
+	return status;
+}
+
+
+int bmfs_disk_open(const char *path, int create)
+{
+	memset(&diskdev, 0, sizeof(diskdev));
+	diskdev.ops = diskops;
+	diskdev.fd = -1;
+	diskdev.align = 1;
+	diskdev.sectorsize = 512;
+	if (diskdev.ops->open(&diskdev, path, create) != 0)
+		return 1;
+	disk = &diskdev;
+	return 0;
+}
+
+
+int bmfs_disk_read(void *buf, size_t len, u64 offset)
+{
+	if (len == 0)
+		return 0;
+	return disk->ops->read(disk, buf, len, offset);
+}
+
+
+int bmfs_disk_write(const void *buf, size_t len, u64 offset)
+{
+	if (len == 0)
+		return 0;
+	return disk->ops->write(disk, buf, len, offset);
+}
+
+
+u64 bmfs_disk_size(void)
+{
+	return disk->ops->size(disk);
+}
+
+
+int bmfs_disk_resize(u64 size, int preallocate)
+{
+	return disk->ops->resize(disk, size, preallocate);
+}
+
+
+int bmfs_disk_discard(u64 offset, u64 len)
+{
+	if (len == 0)
+		return 0;
+	return disk->ops->discard(disk, offset, len);
+}
+
+
+void bmfs_disk_close(void)
+{
+	if (volume != NULL)
+	{
+		bmfs_volume_close(volume);
+		volume = NULL;
+		Directory = NULL;
+	}
 	if (disk != NULL)
 	{
-		fclose( disk );
+		disk->ops->close(disk);
+		if (disk->xferbuf != NULL)
+			bmfs_buffer_free(disk->xferbuf, blockSize);
+		disk->xferbuf = NULL;
 		disk = NULL;
 	}
+}
 
-	return 0;
+
+// libbmfs access to the disk through its backend
+static int disk_io_read(void *ctx, void *buf, size_t len, u64 offset)
+{
+	struct BMFSDisk *d = ctx;
+
+	return (len == 0) ? 0 : d->ops->read(d, buf, len, offset);
 }
 
+static int disk_io_write(void *ctx, const void *buf, size_t len, u64 offset)
+{
+	struct BMFSDisk *d = ctx;
 
-int bmfs_find(char *filename, struct BMFSEntry *fileentry, int *entrynumber)
+	return (len == 0) ? 0 : d->ops->write(d, buf, len, offset);
+}
+
+static u64 disk_io_size(void *ctx)
 {
-	int tint;
+	struct BMFSDisk *d = ctx;
 
-	for (tint = 0; tint < 64; tint++)
-	{
-		memcpy(pentry, Directory+(tint*64), 64);
-		if (entry.FileName[0] == 0x00)				// End of directory
-		{
-			tint = 64;
-		}
-		else if (entry.FileName[0] == 0x01)			// Empty entry
-		{
-			// Ignore
-		}
-		else							// Valid entry
-		{
-			if (strcmp(filename, entry.FileName) == 0)
-			{
-				memcpy(fileentry, pentry, 64);
-				*entrynumber = tint;
-				return 1;
-			}
-		}
-	}
-	return 0;
+	return d->ops->size(d);
 }
 
+static int disk_io_lock(void *ctx, int type, u64 offset, u64 len)
+{
+	struct BMFSDisk *d = ctx;
+	int fd = (d->fp != NULL) ? bmfs_host_fd(d->fp) : d->fd;
 
-void bmfs_list(void)
+	return (fd < 0) ? 0 : bmfs_fd_lock(fd, type, offset, len);
+}
+
+
+char *bmfs_disk_map(u64 offset, size_t len)
 {
-	int tint;
+	if (disk->ops->map == NULL)
+		return NULL;
+	return disk->ops->map(disk, offset, len);
+}
 
-	printf("Disk Size: %d MiB\n", disksize);
-	printf("Name                            |            Size (B)|      Reserved (MiB)\n");
-	printf("==========================================================================\n");
-	for (tint = 0; tint < 64; tint++)				// Max 64 entries
+
+// File descriptor of the disk, or -1 if the backend does not use one
+int bmfs_disk_fd(void)
+{
+	return disk->fd;
+}
+
+
+// Write len zero bytes to the disk at offset
+int bmfs_disk_zero(u64 offset, u64 len)
+{
+	size_t size = (len < blockSize) ? (size_t)len : blockSize;
+	size_t chunk = size;
+	char *zeros;
+	int ret = 0;
+
+	if (len == 0)
+		return 0;
+	if ((zeros = bmfs_buffer_alloc(size)) == NULL)
+		return 1;
+	memset(zeros, 0, size);
+	while (len != 0 && ret == 0)
 	{
-		memcpy(pentry, Directory+(tint*64), 64);
-		if (entry.FileName[0] == 0x00)				// End of directory, bail out
-		{
-			tint = 64;
-		}
-		else if (entry.FileName[0] == 0x01)			// Empty entry
-		{
-			// Ignore
-		}
-		else							// Valid entry
-		{
-			printf("%-32s %20lld %20lld\n", entry.FileName, (long long int)entry.FileSize, (long long int)(entry.ReservedBlocks*2));
-		}
+		if (chunk > len)
+			chunk = len;
+		ret = bmfs_disk_write(zeros, chunk, offset);
+		offset += chunk;
+		len -= chunk;
 	}
+	bmfs_buffer_free(zeros, size);		// The size it was allocated with
+	return ret;
 }
 
 
-void bmfs_format(void)
+// Alignment of offsets, lengths and buffers the disk backend requires
+unsigned int bmfs_disk_align(void)
 {
-	memset(DiskInfo, 0, 512);
-	memset(Directory, 0, 4096);
-	memcpy(DiskInfo, fs_tag, 4);					// Add the 'BMFS' tag
-	fseek(disk, 1024, SEEK_SET);					// Seek 1KiB in for disk information
-	fwrite(DiskInfo, 512, 1, disk);					// Write 512 bytes for the DiskInfo
-	fseek(disk, 4096, SEEK_SET);					// Seek 4KiB in for directory
-	fwrite(Directory, 4096, 1, disk);				// Write 4096 bytes for the Directory
+	return disk->align;
 }
 
 
-int bmfs_initialize(char *diskname, char *size, char *mbr, char *boot, char *kernel)
+// Allocate a buffer aligned to blockSize, suitable for O_DIRECT. Whole blocks
+// are backed by 2MiB huge pages when the system has them reserved, else by
+// a 2MiB aligned mapping the kernel may back with transparent huge pages.
+// Smaller buffers (bounce and zero buffers) come from the heap.
+char *bmfs_buffer_alloc(size_t len)
 {
-	unsigned long long diskSize = 0;
-	unsigned long long writeSize = 0;
-	const char *bootFileType = NULL;
-	size_t bufferSize = 50 * 1024;
-	char * buffer = NULL;
-	FILE *mbrFile = NULL;
-	FILE *bootFile = NULL;
-	FILE *kernelFile = NULL;
-	int diskSizeFactor = 0;
-	size_t chunkSize = 0;
-	int ret = 0;
-	size_t i;
+#ifdef BMFS_POSIX
+	void *buf;
+	char *map;
+	size_t head;
 
-	// Determine how the second file will be described in output messages.
-	// If a kernel file is specified too, then assume the second file is the
-	// boot loader.  If no kernel file is specified, assume the boot loader
-	// and kernel are combined into one system file.
-	if (boot != NULL)
+	if (len % blockSize != 0)
+		return (posix_memalign(&buf, blockSize, len) == 0) ? buf : NULL;
+#ifdef MAP_HUGETLB
+	buf = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+	if (buf != MAP_FAILED)
+		return buf;
+#endif
+	// Over-map by one block and trim both ends to get blockSize alignment
+	map = mmap(NULL, len + blockSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (map == MAP_FAILED)
+		return NULL;
+	head = (blockSize - (unsigned long)map % blockSize) % blockSize;
+	if (head != 0)
+		munmap(map, head);
+	munmap(map + head + len, blockSize - head);
+#ifdef MADV_HUGEPAGE
+	madvise(map + head, len, MADV_HUGEPAGE);
+#endif
+	return map + head;
+#else
+	return malloc(len);
+#endif
+}
+
+
+// Free a buffer from bmfs_buffer_alloc. len must be the length it was
+// allocated with, which tells a mapping from a heap buffer.
+void bmfs_buffer_free(char *buf, size_t len)
+{
+#ifdef BMFS_POSIX
+	if (len % blockSize == 0)
 	{
-		bootFileType = "boot loader";
-		if (kernel == NULL)
-		{
-			bootFileType = "system";
-		}
+		munmap(buf, len);
+		return;
 	}
+#endif
+	(void)len;
+	free(buf);
+}
 
-	// Validate the disk size string and convert it to an integer value.
-	for (i = 0; size[i] != '\0' && ret == 0; ++i)
-	{
-		char ch = size[i];
-		if (isdigit(ch))
-		{
-			unsigned int n = ch - '0';
-			if (diskSize * 10 > diskSize ) // Make sure we don't overflow
-			{
-				diskSize *= 10;
-				diskSize += n;
-			}
-			else if (diskSize == 0) // First loop iteration
-			{
-				diskSize += n;
-			}
-			else
-			{
-				printf("bmfs error: Disk size is too large\n");
-				ret = 1;
-			}
-		}
-		else if (i == 0) // No digits specified
-		{
-			printf("bmfs error: A numeric disk size must be specified\n");
-			ret = 1;
-		}
-		else
-		{
-			switch (toupper(ch))
-			{
-				case 'K':
-					diskSizeFactor = 1;
-					break;
-				case 'M':
-					diskSizeFactor = 2;
-					break;
+
+// Block sized transfer buffer of the open disk, allocated on first use and
+// reused until the disk is closed
+char *bmfs_disk_buffer(void)
+{
+	if (disk->xferbuf == NULL)
+		disk->xferbuf = bmfs_buffer_alloc(blockSize);
+	return disk->xferbuf;
+}
+
+
+// File descriptor behind a local file, or -1 if the platform has none to use
+int bmfs_host_fd(FILE *f)
+{
+#ifdef BMFS_POSIX
+	return fileno(f);
+#else
+	(void)f;
+	return -1;
+#endif
+}
+
+
+// Is the descriptor a pipe (or FIFO), which can not be seeked or mapped
+int bmfs_fd_ispipe(int fd)
+{
+#ifdef BMFS_POSIX
+	struct stat st;
+
+	return (fd >= 0 && fstat(fd, &st) == 0 && S_ISFIFO(st.st_mode));
+#else
+	(void)fd;
+	return 0;
+#endif
+}
+
+
+// Was the descriptor opened with O_DIRECT
+int bmfs_fd_isdirect(int fd)
+{
+#if defined(BMFS_POSIX) && defined(O_DIRECT)
+	int flags = fcntl(fd, F_GETFL);
+
+	return (flags != -1 && (flags & O_DIRECT));
+#else
+	(void)fd;
+	return 0;
+#endif
+}
+
+
+// Standard streams carry file data, make sure no newline translation happens
+FILE *bmfs_binary_stream(FILE *f)
+{
+#ifdef _WIN32
+	_setmode(_fileno(f), _O_BINARY);
+#endif
+	return f;
+}
+
+
+// stdio backend, used where positional I/O is not available
+static int stdio_open(struct BMFSDisk *d, const char *path, int create)
+{
+	d->fp = fopen(path, create ? "w+b" : "r+b");
+	return (d->fp == NULL) ? 1 : 0;
+}
+
+static int stdio_read(struct BMFSDisk *d, void *buf, size_t len, u64 offset)
+{
+	if (fseek(d->fp, (long)offset, SEEK_SET) != 0)
+		return 1;
+	return (fread(buf, len, 1, d->fp) == 1) ? 0 : 1;
+}
+
+static int stdio_write(struct BMFSDisk *d, const void *buf, size_t len, u64 offset)
+{
+	if (fseek(d->fp, (long)offset, SEEK_SET) != 0)
+		return 1;
+	return (fwrite(buf, len, 1, d->fp) == 1) ? 0 : 1;
+}
+
+static u64 stdio_size(struct BMFSDisk *d)
+{
+	fseek(d->fp, 0, SEEK_END);
+	return ftell(d->fp);
+}
+
+static int stdio_resize(struct BMFSDisk *d, u64 size, int preallocate)
+{
+	(void)d; (void)size; (void)preallocate;
+	return 1;						// No portable way, zero fill instead
+}
+
+static int stdio_discard(struct BMFSDisk *d, u64 offset, u64 len)
+{
+	(void)d; (void)offset; (void)len;
+	return 1;
+}
+
+static void stdio_close(struct BMFSDisk *d)
+{
+	fclose(d->fp);
+	d->fp = NULL;
+}
+
+
+#ifdef BMFS_POSIX
+// pread/pwrite backend, bypasses stdio buffering and keeps no file position
+static int pio_open(struct BMFSDisk *d, const char *path, int create)
+{
+	d->fd = open(path, create ? (O_RDWR | O_CREAT | O_TRUNC) : O_RDWR, 0666);
+	if (d->fd < 0)
+		return 1;
+	pio_probe(d);
+	return 0;
+}
+
+// Pick up the geometry of a raw block device so I/O can be aligned to its
+// physical sectors and zeroing can be left to the hardware
+static void pio_probe(struct BMFSDisk *d)
+{
+	struct stat st;
+#if defined(BLKGETSIZE64)
+	u64 size;
+	int logical;
+	unsigned int physical;
+#elif defined(DKIOCGETBLOCKCOUNT)
+	u64 count;
+	u32 logical, physical;
+#endif
+
+	if (fstat(d->fd, &st) != 0 || !S_ISBLK(st.st_mode))
+		return;
+	d->blockdev = 1;
+	d->sectorsize = 512;
+#if defined(BLKGETSIZE64)
+	if (ioctl(d->fd, BLKGETSIZE64, &size) == 0)
+		d->devsize = size;
+	if (ioctl(d->fd, BLKSSZGET, &logical) == 0)
+		d->sectorsize = logical;
+	if (ioctl(d->fd, BLKPBSZGET, &physical) == 0)
+		d->physsectorsize = physical;
+#elif defined(DKIOCGETBLOCKCOUNT)
+	if (ioctl(d->fd, DKIOCGETBLOCKSIZE, &logical) == 0)
+		d->sectorsize = logical;
+	if (ioctl(d->fd, DKIOCGETBLOCKCOUNT, &count) == 0)
+		d->devsize = count * d->sectorsize;
+	if (ioctl(d->fd, DKIOCGETPHYSICALBLOCKSIZE, &physical) == 0)
+		d->physsectorsize = physical;
+#endif
+	d->align = (d->physsectorsize > d->sectorsize) ? d->physsectorsize : d->sectorsize;
+}
+
+static int pio_aligned(struct BMFSDisk *d, const void *buf, size_t len, u64 offset)
+{
+	return ((unsigned long)buf % d->align == 0 && len % d->align == 0 && offset % d->align == 0);
+}
+
+// Read the sectors covering [start, start+len) into an aligned buffer. Sectors
+// past the end of the disk read as zeros so a new image can be written.
+static char *pio_stage(struct BMFSDisk *d, u64 start, size_t len)
+{
+	char *bounce = bmfs_buffer_alloc(len);
+	size_t done = 0;
+	ssize_t n;
+
+	if (bounce == NULL)
+		return NULL;
+	while (done < len)
+	{
+		n = pread(d->fd, bounce + done, len - done, (off_t)(start + done));
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+		{
+			bmfs_buffer_free(bounce, len);
+			return NULL;
+		}
+		if (n == 0)
+		{
+			memset(bounce + done, 0, len - done);
+			break;
+		}
+		done += n;
+	}
+	return bounce;
+}
+
+static int pio_read(struct BMFSDisk *d, void *buf, size_t len, u64 offset)
+{
+	char *p = buf;
+	ssize_t n;
+
+	if (d->align > 1 && !pio_aligned(d, buf, len, offset))
+	{
+		u64 start = offset - offset % d->align;
+		size_t span = (offset + len - start + d->align - 1) / d->align * d->align;
+		char *bounce = pio_stage(d, start, span);
+
+		if (bounce == NULL)
+			return 1;
+		memcpy(buf, bounce + (offset - start), len);
+		bmfs_buffer_free(bounce, span);
+		return 0;
+	}
+	while (len != 0)
+	{
+		n = pread(d->fd, p, len, (off_t)offset);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)					// Error or unexpected end of disk
+			return 1;
+		p += n;
+		len -= n;
+		offset += n;
+	}
+	return 0;
+}
+
+static int pio_write(struct BMFSDisk *d, const void *buf, size_t len, u64 offset)
+{
+	const char *p = buf;
+	ssize_t n;
+
+	if (d->align > 1 && !pio_aligned(d, buf, len, offset))
+	{
+		u64 start = offset - offset % d->align;
+		size_t span = (offset + len - start + d->align - 1) / d->align * d->align;
+		char *bounce = pio_stage(d, start, span);	// Read-modify-write the partial sectors
+		int ret;
+
+		if (bounce == NULL)
+			return 1;
+		memcpy(bounce + (offset - start), buf, len);
+		ret = pio_write(d, bounce, span, start);
+		bmfs_buffer_free(bounce, span);
+		return ret;
+	}
+	while (len != 0)
+	{
+		n = pwrite(d->fd, p, len, (off_t)offset);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return 1;
+		p += n;
+		len -= n;
+		offset += n;
+	}
+	return 0;
+}
+
+static u64 pio_size(struct BMFSDisk *d)
+{
+	off_t end;
+
+	if (d->devsize != 0)
+		return d->devsize;
+	end = lseek(d->fd, 0, SEEK_END);
+	return (end < 0) ? 0 : (u64)end;
+}
+
+// Set the file size, leaving it sparse unless preallocation is asked for. A
+// block device keeps its size and is zeroed by the device where possible.
+static int pio_resize(struct BMFSDisk *d, u64 size, int preallocate)
+{
+	if (d->blockdev)
+	{
+		if (d->devsize != 0 && size > d->devsize)
+			return -1;
+#if defined(BLKZEROOUT)
+		{
+			u64 range[2];
+
+			range[0] = 0;
+			range[1] = size - size % d->sectorsize;
+			if (ioctl(d->fd, BLKZEROOUT, range) != 0)
+				return 1;
+			if (size % d->sectorsize != 0)		// Partial last sector
+				return bmfs_disk_zero(range[1], size % d->sectorsize);
+			return 0;
+		}
+#else
+		return 1;
+#endif
+	}
+	if (ftruncate(d->fd, (off_t)size) != 0)
+		return 1;
+	if (preallocate)
+	{
+#if defined(__linux__)
+		if (fallocate(d->fd, FALLOC_FL_ZERO_RANGE, 0, (off_t)size) != 0 && fallocate(d->fd, 0, 0, (off_t)size) != 0)
+			return 1;
+#else
+		return 1;
+#endif
+	}
+	return 0;
+}
+
+// Release a range: discard (TRIM) on a block device, punch a hole in an image
+static int pio_discard(struct BMFSDisk *d, u64 offset, u64 len)
+{
+#if defined(__linux__)
+	if (d->blockdev)
+	{
+		u64 range[2];
+
+		range[0] = (offset + d->align - 1) / d->align * d->align;	// Whole sectors only
+		range[1] = (offset + len) / d->align * d->align;
+		if (range[1] <= range[0])
+			return 0;
+		range[1] -= range[0];
+		return (ioctl(d->fd, BLKDISCARD, range) == 0) ? 0 : 1;
+	}
+	return (fallocate(d->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, (off_t)offset, (off_t)len) == 0) ? 0 : 1;
+#else
+	(void)d; (void)offset; (void)len;
+	return 1;
+#endif
+}
+
+static void pio_close(struct BMFSDisk *d)
+{
+	close(d->fd);
+	d->fd = -1;
+}
+
+
+// mmap backend, maps the whole disk shared so data moves straight between
+// the page cache and the host file. Ranges outside the mapping (or a disk
+// that could not be mapped, e.g. a freshly created empty image) fall back
+// to pread/pwrite.
+static int mmap_open(struct BMFSDisk *d, const char *path, int create)
+{
+	void *map;
+
+	if (pio_open(d, path, create) != 0)
+		return 1;
+	d->mapsize = pio_size(d);
+	if (d->mapsize == 0 || d->mapsize != (size_t)d->mapsize)
+		return 0;
+	map = mmap(NULL, d->mapsize, PROT_READ | PROT_WRITE, MAP_SHARED, d->fd, 0);
+	if (map != MAP_FAILED)
+		d->map = map;
+	return 0;
+}
+
+static int mmap_read(struct BMFSDisk *d, void *buf, size_t len, u64 offset)
+{
+	if (d->map == NULL || offset + len > d->mapsize)
+		return pio_read(d, buf, len, offset);
+	if (buf != d->map + offset)
+		memcpy(buf, d->map + offset, len);
+	return 0;
+}
+
+static int mmap_write(struct BMFSDisk *d, const void *buf, size_t len, u64 offset)
+{
+	if (d->map == NULL || offset + len > d->mapsize)
+		return pio_write(d, buf, len, offset);
+	if (buf != d->map + offset)				// Data written in place needs no copy
+		memcpy(d->map + offset, buf, len);
+	return 0;
+}
+
+static void mmap_close(struct BMFSDisk *d)
+{
+	if (d->map != NULL)
+	{
+		munmap(d->map, d->mapsize);
+		d->map = NULL;
+	}
+	pio_close(d);
+}
+
+static char *mmap_map(struct BMFSDisk *d, u64 offset, size_t len)
+{
+	long pagesize = sysconf(_SC_PAGESIZE);
+	u64 start;
+
+	if (d->map == NULL || offset + len > d->mapsize)
+		return NULL;
+	// Callers walk the range front to back, let the kernel read ahead
+	start = offset - (pagesize > 0 ? offset % pagesize : 0);
+	posix_madvise(d->map + start, len + (offset - start), POSIX_MADV_SEQUENTIAL);
+	return d->map + offset;
+}
+#endif
+
+
+#ifdef BMFS_DIRECT
+// O_DIRECT backend, transfers bypass the page cache. Reads and writes are the
+// pread/pwrite ones, which stage anything unaligned (DiskInfo, a file tail)
+// through an aligned bounce buffer.
+static int direct_open(struct BMFSDisk *d, const char *path, int create)
+{
+#ifdef O_DIRECT
+	d->fd = open(path, (create ? (O_RDWR | O_CREAT | O_TRUNC) : O_RDWR) | O_DIRECT, 0666);
+	if (d->fd < 0)
+		return 1;
+	pio_probe(d);
+#else
+	if (pio_open(d, path, create) != 0)
+		return 1;
+	fcntl(d->fd, F_NOCACHE, 1);
+#endif
+	if (d->align < 4096)					// Covers 512 byte and Advanced Format sectors
+		d->align = 4096;
+	return 0;
+}
+#endif
+
+
+#ifdef BMFS_URING
+// io_uring transfer engine, talks to the kernel directly so no liburing is needed
+static void uring_exit(struct BMFSRing *r)
+{
+	if (r->sqes != NULL && r->sqes != MAP_FAILED)
+		munmap(r->sqes, r->sqes_len);
+	if (r->cq_ptr != NULL && r->cq_ptr != MAP_FAILED && r->cq_ptr != r->sq_ptr)
+		munmap(r->cq_ptr, r->cq_len);
+	if (r->sq_ptr != NULL && r->sq_ptr != MAP_FAILED)
+		munmap(r->sq_ptr, r->sq_len);
+	if (r->fd >= 0)
+		close(r->fd);
+	r->fd = -1;
+}
+
+static int uring_setup(struct BMFSRing *r, unsigned entries)
+{
+	struct io_uring_params p;
+	char *sq, *cq;
+
+	memset(r, 0, sizeof(*r));
+	memset(&p, 0, sizeof(p));
+	r->fd = syscall(__NR_io_uring_setup, entries, &p);
+	if (r->fd < 0)
+		return 1;
+	r->entries = p.sq_entries;
+	r->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	r->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	r->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+	{
+		if (r->cq_len > r->sq_len)
+			r->sq_len = r->cq_len;
+		r->cq_len = r->sq_len;
+	}
+	r->sq_ptr = mmap(NULL, r->sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+	if (r->sq_ptr == MAP_FAILED)
+	{
+		uring_exit(r);
+		return 1;
+	}
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		r->cq_ptr = r->sq_ptr;
+	else
+		r->cq_ptr = mmap(NULL, r->cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+	r->sqes = mmap(NULL, r->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+	if (r->cq_ptr == MAP_FAILED || r->sqes == MAP_FAILED)
+	{
+		uring_exit(r);
+		return 1;
+	}
+	sq = r->sq_ptr;
+	cq = r->cq_ptr;
+	r->sq_head = (unsigned *)(sq + p.sq_off.head);
+	r->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+	r->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+	r->sq_array = (unsigned *)(sq + p.sq_off.array);
+	r->cq_head = (unsigned *)(cq + p.cq_off.head);
+	r->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+	r->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+	r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+	return 0;
+}
+
+// Queue one read or write. Each slot has at most one request in flight and
+// the ring has an entry per slot, so the submission queue never overflows.
+static void uring_queue(struct BMFSRing *r, int op, int fixed, int fileindex, char *buf, unsigned len, u64 offset, unsigned slot)
+{
+	unsigned tail = *r->sq_tail;
+	unsigned index = tail & *r->sq_mask;
+	struct io_uring_sqe *sqe = &r->sqes[index];
+
+	memset(sqe, 0, sizeof(*sqe));
+	if (fixed)
+	{
+		sqe->opcode = (op == IORING_OP_READ) ? IORING_OP_READ_FIXED : IORING_OP_WRITE_FIXED;
+		sqe->buf_index = slot;
+	}
+	else
+	{
+		sqe->opcode = op;
+	}
+	sqe->flags = IOSQE_FIXED_FILE;
+	sqe->fd = fileindex;
+	sqe->addr = (unsigned long)buf;
+	sqe->len = len;
+	sqe->off = offset;
+	sqe->user_data = slot;
+	r->sq_array[index] = index;
+	__atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	r->pending++;
+}
+
+// Submit queued requests and wait for at least one completion
+static int uring_submit_wait(struct BMFSRing *r)
+{
+	int ret;
+
+	do
+	{
+		ret = syscall(__NR_io_uring_enter, r->fd, r->pending, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+	} while (ret < 0 && errno == EINTR);
+	if (ret < 0)
+		return 1;
+	r->pending -= ret;
+	return 0;
+}
+
+
+// Copy len bytes from infd at inoff to outfd at outoff, keeping up to
+// queuedepth blocks in flight so both files are busy at the same time. With
+// COPY_PAD the final partial block is zero filled to blockSize, with
+// COPY_FULLREAD it is read whole (for O_DIRECT input). Returns 0 on success,
+// 1 on an I/O error, or -1 if io_uring is not available and the caller
+// should fall back to the synchronous path.
+int bmfs_uring_copy(int infd, u64 inoff, int outfd, u64 outoff, u64 len, int flags)
+{
+	struct BMFSRing ring;
+	struct iovec *iov = NULL;
+	struct
+	{
+		u64 pos;	// Offset of the block within the transfer
+		unsigned len;	// Bytes of data in this block
+		unsigned rlen;	// Bytes to read
+		unsigned wlen;	// Bytes to write
+		unsigned done;	// Bytes completed by the current request
+		int writing;
+	} *slot = NULL;
+	char *buffers = NULL;
+	int files[2];
+	int fixed, ret = 0;
+	unsigned i, inflight = 0;
+	u64 next = 0;
+
+	if (len == 0)
+		return 0;
+	// Blocks complete out of order, so both ends must be seekable
+	if (infd < 0 || outfd < 0 || bmfs_fd_ispipe(infd) || bmfs_fd_ispipe(outfd) || uring_setup(&ring, queuedepth) != 0)
+		return -1;
+	files[0] = infd;
+	files[1] = outfd;
+	buffers = bmfs_buffer_alloc((size_t)queuedepth * blockSize);
+	iov = calloc(queuedepth, sizeof(*iov));
+	slot = calloc(queuedepth, sizeof(*slot));
+	if (buffers == NULL || iov == NULL || slot == NULL || syscall(__NR_io_uring_register, ring.fd, IORING_REGISTER_FILES, files, 2) < 0)
+	{
+		ret = -1;
+		goto done;
+	}
+	for (i = 0; i < queuedepth; i++)
+	{
+		iov[i].iov_base = buffers + (size_t)i * blockSize;
+		iov[i].iov_len = blockSize;
+	}
+	// Registered buffers count against RLIMIT_MEMLOCK, plain reads still overlap
+	fixed = (syscall(__NR_io_uring_register, ring.fd, IORING_REGISTER_BUFFERS, iov, queuedepth) == 0);
+
+	for (i = 0; i < queuedepth && next < len; i++, inflight++)
+	{
+		slot[i].pos = next;
+		slot[i].len = (len - next < blockSize) ? (unsigned)(len - next) : blockSize;
+		slot[i].rlen = (flags & COPY_FULLREAD) ? blockSize : slot[i].len;
+		slot[i].wlen = (flags & COPY_PAD) ? blockSize : slot[i].len;
+		slot[i].done = 0;
+		slot[i].writing = 0;
+		uring_queue(&ring, IORING_OP_READ, fixed, 0, iov[i].iov_base, slot[i].rlen, inoff + next, i);
+		next += slot[i].len;
+	}
+
+	while (inflight != 0)
+	{
+		unsigned head, tail;
+
+		if (uring_submit_wait(&ring) != 0)
+		{
+			ret = 1;
+			break;
+		}
+		head = *ring.cq_head;
+		tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+		for (; head != tail; head++)
+		{
+			struct io_uring_cqe *cqe = &ring.cqes[head & *ring.cq_mask];
+			unsigned s = (unsigned)cqe->user_data;
+			char *buf = iov[s].iov_base;
+			int res = cqe->res;
+			unsigned want;
+
+			if (res == -EINTR || res == -EAGAIN)
+				res = 0;
+			else if (res <= 0)				// I/O error or unexpected end of file
+				ret = 1;
+			slot[s].done += (res > 0) ? res : 0;
+			want = slot[s].writing ? slot[s].wlen : slot[s].rlen;
+			if (ret != 0)					// Drain the rest, start nothing new
+			{
+				inflight--;
+			}
+			else if (slot[s].done < want)			// Short transfer, queue the remainder
+			{
+				uring_queue(&ring, slot[s].writing ? IORING_OP_WRITE : IORING_OP_READ, fixed, slot[s].writing ? 1 : 0, buf + slot[s].done, want - slot[s].done, (slot[s].writing ? outoff : inoff) + slot[s].pos + slot[s].done, s);
+			}
+			else if (!slot[s].writing)			// Block is in, write it out
+			{
+				if (slot[s].wlen > slot[s].len)
+				{
+					memset(buf + slot[s].len, 0, slot[s].wlen - slot[s].len); // 0 the rest of the block
+				}
+				slot[s].writing = 1;
+				slot[s].done = 0;
+				uring_queue(&ring, IORING_OP_WRITE, fixed, 1, buf, slot[s].wlen, outoff + slot[s].pos, s);
+			}
+			else if (next < len)				// Block is out, reuse the slot
+			{
+				slot[s].pos = next;
+				slot[s].len = (len - next < blockSize) ? (unsigned)(len - next) : blockSize;
+				slot[s].rlen = (flags & COPY_FULLREAD) ? blockSize : slot[s].len;
+				slot[s].wlen = (flags & COPY_PAD) ? blockSize : slot[s].len;
+				slot[s].done = 0;
+				slot[s].writing = 0;
+				uring_queue(&ring, IORING_OP_READ, fixed, 0, buf, slot[s].rlen, inoff + next, s);
+				next += slot[s].len;
+			}
+			else
+			{
+				inflight--;
+			}
+		}
+		__atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+	}
+
+done:
+	uring_exit(&ring);					// Also drops the registrations
+	if (buffers != NULL)
+		bmfs_buffer_free(buffers, (size_t)queuedepth * blockSize);
+	free(iov);
+	free(slot);
+	return ret;
+}
+#else
+int bmfs_uring_copy(int infd, u64 inoff, int outfd, u64 outoff, u64 len, int flags)
+{
+	(void)infd; (void)inoff; (void)outfd; (void)outoff; (void)len; (void)flags;
+	return -1;
+}
+#endif
+
+
+#ifdef BMFS_COPYRANGE
+// Copy len bytes between two files without a trip through user space.
+// copy_file_range lets the filesystem share or clone extents where it can;
+// sendfile is used when the files are on different filesystems or the
+// kernel lacks it, and splice when either end is a pipe (offsets are ignored
+// for the pipe end). Returns 0 on success, 1 on an I/O error, or -1 if none
+// of these work for the files and nothing was copied.
+int bmfs_kernel_copy(int infd, u64 inoff, int outfd, u64 outoff, u64 len)
+{
+	loff_t in = inoff, out = outoff;
+	int inpipe = bmfs_fd_ispipe(infd);
+	int outpipe = bmfs_fd_ispipe(outfd);
+	int userange = 1;
+	ssize_t n;
+	size_t chunk;
+	u64 done = 0;
+
+	// O_DIRECT files need aligned transfers a kernel copy does not promise
+	if (infd < 0 || outfd < 0 || bmfs_fd_isdirect(infd) || bmfs_fd_isdirect(outfd))
+		return -1;
+	while (done < len)
+	{
+		chunk = (len - done > 0x40000000) ? 0x40000000 : (size_t)(len - done);	// 1GiB per call
+		if (inpipe || outpipe)
+		{
+			n = splice(infd, inpipe ? NULL : &in, outfd, outpipe ? NULL : &out, chunk, SPLICE_F_MOVE | SPLICE_F_MORE);
+			if (n < 0 && done == 0 && errno == EINVAL)
+				return -1;
+		}
+		else if (userange)
+		{
+			n = copy_file_range(infd, &in, outfd, &out, chunk, 0);
+			if (n < 0 && (errno == EXDEV || errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP || errno == EBADF))
+			{
+				if (diskshared && outfd == bmfs_disk_fd())	// Other threads rely on the disk file position
+					return (done == 0) ? -1 : 1;
+				userange = 0;				// sendfile writes at the file position
+				if (lseek(outfd, out, SEEK_SET) < 0)
+					return (done == 0) ? -1 : 1;
+				continue;
+			}
+		}
+		else
+		{
+			off_t pos = in;
+			n = sendfile(outfd, infd, &pos, chunk);
+			if (n < 0 && done == 0 && (errno == EINVAL || errno == ENOSYS))
+				return -1;
+			in = pos;
+			if (n > 0)
+				out += n;
+		}
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)						// Error or unexpected end of file
+			return 1;
+		done += n;
+	}
+	return 0;
+}
+#else
+int bmfs_kernel_copy(int infd, u64 inoff, int outfd, u64 outoff, u64 len)
+{
+	(void)infd; (void)inoff; (void)outfd; (void)outoff; (void)len;
+	return -1;
+}
+#endif
+
+
+#ifdef BMFS_THREADS
+// Fill blocks from the source until len bytes are read, an error occurs or
+// the consumer stops
+static void *pipeline_produce(void *arg)
+{
+	struct BMFSPipeline *p = arg;
+	unsigned tail = 0;
+	u64 done = 0;
+	size_t chunk;
+	char *buf;
+	int err = 0;
+
+	while (done < p->len && !err)
+	{
+		pthread_mutex_lock(&p->lock);
+		while (p->count == p->depth && !p->stop)
+			pthread_cond_wait(&p->drained, &p->lock);
+		err = p->stop;
+		pthread_mutex_unlock(&p->lock);
+		if (err)
+			break;
+		buf = p->buffers + (size_t)tail * blockSize;
+		chunk = (p->len - done < blockSize) ? (size_t)(p->len - done) : blockSize;
+		if (p->todisk)
+		{
+			err = (fread(buf, chunk, 1, p->tfile) != 1);
+			memset(buf+chunk, 0, blockSize-chunk);		// 0 the rest of the block
+		}
+		else
+		{
+			// Read whole sectors if the backend needs aligned I/O
+			err = bmfs_disk_read(buf, (chunk + bmfs_disk_align() - 1) / bmfs_disk_align() * bmfs_disk_align(), p->offset + done);
+		}
+		pthread_mutex_lock(&p->lock);
+		if (err)
+		{
+			p->error = 1;
+		}
+		else
+		{
+			p->lengths[tail] = chunk;
+			p->count++;
+		}
+		pthread_cond_signal(&p->filled);
+		pthread_mutex_unlock(&p->lock);
+		tail = (tail + 1) % p->depth;
+		done += chunk;
+	}
+	pthread_mutex_lock(&p->lock);
+	p->finished = 1;
+	pthread_cond_signal(&p->filled);
+	pthread_mutex_unlock(&p->lock);
+	return NULL;
+}
+
+
+// Copy len bytes between the local file and the disk at offset with a reader
+// thread filling a ring of pipelinedepth blocks while the calling thread
+// drains it, so source and destination I/O overlap. todisk copies the local
+// file to the disk and zero fills the last block. Returns 0 on success, 1 on
+// an I/O error, or -1 if the caller should copy the data itself.
+int bmfs_pipeline_copy(FILE *tfile, u64 offset, u64 len, int todisk)
+{
+	struct BMFSPipeline p;
+	pthread_t producer;
+	size_t chunk;
+	u64 done = 0;
+	int err = 0;
+
+	if (len == 0)
+		return -1;
+	memset(&p, 0, sizeof(p));
+	p.depth = pipelinedepth;
+	p.todisk = todisk;
+	p.tfile = tfile;
+	p.offset = offset;
+	p.len = len;
+	p.buffers = bmfs_buffer_alloc((size_t)p.depth * blockSize);
+	p.lengths = calloc(p.depth, sizeof(*p.lengths));
+	if (p.buffers == NULL || p.lengths == NULL)
+	{
+		if (p.buffers != NULL)
+			bmfs_buffer_free(p.buffers, (size_t)p.depth * blockSize);
+		free(p.lengths);
+		return -1;
+	}
+	pthread_mutex_init(&p.lock, NULL);
+	pthread_cond_init(&p.filled, NULL);
+	pthread_cond_init(&p.drained, NULL);
+	if (pthread_create(&producer, NULL, pipeline_produce, &p) != 0)
+	{
+		err = -1;
+	}
+	else
+	{
+		for (;;)
+		{
+			pthread_mutex_lock(&p.lock);
+			while (p.count == 0 && !p.finished && !p.error)
+				pthread_cond_wait(&p.filled, &p.lock);
+			chunk = (p.count != 0) ? p.lengths[p.head] : 0;
+			pthread_mutex_unlock(&p.lock);
+			if (chunk == 0)					// Everything drained, or the source failed
+				break;
+			if (todisk)
+				err = bmfs_disk_write(p.buffers + (size_t)p.head * blockSize, blockSize, offset + done);
+			else
+				err = (fwrite(p.buffers + (size_t)p.head * blockSize, chunk, 1, tfile) != 1);
+			pthread_mutex_lock(&p.lock);
+			if (err)
+			{
+				p.stop = 1;
+			}
+			else
+			{
+				p.head = (p.head + 1) % p.depth;
+				p.count--;
+			}
+			pthread_cond_signal(&p.drained);
+			pthread_mutex_unlock(&p.lock);
+			if (err)
+				break;
+			done += chunk;
+		}
+		pthread_join(producer, NULL);
+		if (p.error)
+			err = 1;
+	}
+	pthread_cond_destroy(&p.drained);
+	pthread_cond_destroy(&p.filled);
+	pthread_mutex_destroy(&p.lock);
+	bmfs_buffer_free(p.buffers, (size_t)p.depth * blockSize);
+	free(p.lengths);
+	return err;
+}
+#else
+int bmfs_pipeline_copy(FILE *tfile, u64 offset, u64 len, int todisk)
+{
+	(void)tfile; (void)offset; (void)len; (void)todisk;
+	return -1;
+}
+#endif
+
+
+// Load the open disk as the current volume. Returns 0 or a libbmfs error.
+int bmfs_mount(int flags)
+{
+	int error;
+
+	if ((volume = bmfs_volume_attach(&bmfs_disk_io, disk, flags, &error)) == NULL)
+		return error;
+	disksize = bmfs_disk_size() / 1048576;				// Disk size in MiB
+	Directory = bmfs_volume_directory(volume);
+	return 0;
+}
+
+
+// Open a disk and load its disk info and directory. Returns 0, or a libbmfs
+// error with the disk closed again.
+int bmfs_open(const char *path, int flags)
+{
+	int ret;
+
+	if (bmfs_disk_open(path, 0) != 0)				// Open for read/write in binary mode
+		return BMFS_EIO;
+	if ((ret = bmfs_mount(flags)) != 0)
+		bmfs_disk_close();
+	return ret;
+}
+
+
+void bmfs_open_failed(const char *path, int error)
+{
+	if (error == BMFS_EFORMAT)
+		printf("bmfs error: Not a valid BMFS drive (Disk is not BMFS formatted).\n");
+	else
+		printf("bmfs error: Unable to open disk '%s'\n", path);
+}
+
+
+int bmfs_find(char *filename, struct BMFSEntry *fileentry, int *entrynumber)
+{
+	return (bmfs_volume_find(volume, filename, fileentry, entrynumber) == BMFS_OK);
+}
+
+
+void bmfs_list(void)
+{
+	struct BMFSEntry entries[64];
+	int count, tint;
+
+	bmfs_volume_list(volume, entries, 64, &count);
+	printf("Disk Size: %llu MiB\n", disksize);
+	printf("Name                            |            Size (B)|      Reserved (MiB)\n");
+	printf("==========================================================================\n");
+	for (tint = 0; tint < count; tint++)
+	{
+		printf("%-32s %20lld %20lld\n", entries[tint].FileName, (long long int)entries[tint].FileSize, (long long int)(entries[tint].ReservedBlocks*2));
+	}
+}
+
+
+int bmfs_format(void)
+{
+	if (bmfs_volume_format(volume) != BMFS_OK)
+	{
+		printf("bmfs error: Failed to write disk\n");
+		return 1;
+	}
+	return 0;
+}
+
+
+// Let the device (or the filesystem holding the image) reclaim the data
+// blocks after a format. Block 0 keeps the boot loader and is left alone.
+void bmfs_discard_data(void)
+{
+	u64 blocks = bmfs_disk_size() / blockSize;
+
+	if (blocks > 2)
+		bmfs_disk_discard(blockSize, (blocks - 2) * blockSize);
+}
+
+
+// Convert a disk size string such as "64M" to bytes, checking it against the
+// minimum disk size. Returns 0 on success.
+int bmfs_parse_size(const char *size, unsigned long long *bytes)
+{
+	int diskSizeFactor = 0;
+	int ret = 0;
+	size_t i;
+
+	*bytes = 0;
+	for (i = 0; size[i] != '\0' && ret == 0; ++i)
+	{
+		char ch = size[i];
+		if (isdigit(ch))
+		{
+			unsigned int n = ch - '0';
+			if (*bytes * 10 > *bytes) // Make sure we don't overflow
+			{
+				*bytes *= 10;
+				*bytes += n;
+			}
+			else if (*bytes == 0) // First loop iteration
+			{
+				*bytes += n;
+			}
+			else
+			{
+				printf("bmfs error: Disk size is too large\n");
+				ret = 1;
+			}
+		}
+		else if (i == 0) // No digits specified
+		{
+			printf("bmfs error: A numeric disk size must be specified\n");
+			ret = 1;
+		}
+		else
+		{
+			switch (toupper(ch))
+			{
+				case 'K':
+					diskSizeFactor = 1;
+					break;
+				case 'M':
+					diskSizeFactor = 2;
+					break;
 				case 'G':
 					diskSizeFactor = 3;
 					break;
@@ -365,546 +1850,2901 @@ int bmfs_initialize(char *diskname, char *size, char *mbr, char *boot, char *ker
 				default:
 					printf("bmfs error: Invalid disk size string: '%s'\n", size);
 					ret = 1;
-					break;
+					break;
+			}
+
+			// If this character is a valid unit indicator, but is not at the
+			// end of the string, then the string is invalid.
+			if (ret == 0 && size[i+1] != '\0')
+			{
+				printf("bmfs error: Invalid disk size string: '%s'\n", size);
+				ret = 1;
+			}
+		}
+	}
+
+	// Adjust the disk size if a unit indicator was given.  Note that an
+	// input of something like "0" or "0K" will get past the checks above.
+	if (ret == 0 && *bytes > 0 && diskSizeFactor > 0)
+	{
+		while (diskSizeFactor--)
+		{
+			if (*bytes * 1024 > *bytes) // Make sure we don't overflow
+			{
+				*bytes *= 1024;
+			}
+			else
+			{
+				printf("bmfs error: Disk size is too large\n");
+				ret = 1;
+			}
+		}
+	}
+
+	// Make sure the disk size is large enough.
+	if (ret == 0)
+	{
+		if (*bytes < minimumDiskSize)
+		{
+			printf("bmfs error: Disk size must be at least %d bytes (%dMiB)\n", minimumDiskSize, minimumDiskSize / (1024*1024));
+			ret = 1;
+		}
+	}
+
+	return ret;
+}
+
+
+// Return the byte count given to the option argv[*i], either as --option=N
+// or as --option N, in which case the value argument is consumed as well.
+// N may be decimal, octal or hex.
+u64 bmfs_option_value(int argc, char *argv[], int *i, int len)
+{
+	char *option = argv[*i], *value = option + len, *end;
+	u64 n;
+
+	if (*value == '=')
+		value++;
+	else if (*i + 1 < argc)
+		value = argv[++*i];
+	n = strtoull(value, &end, 0);
+	if (*value == 0 || *end != 0 || *value == '-')
+	{
+		printf("bmfs error: Invalid value for %.*s\n", len, option);
+		exit(EXIT_FAILURE);
+	}
+
+	return n;
+}
+
+
+int bmfs_initialize(char *diskname, char *size, char *mbr, char *boot, char *kernel)
+{
+	unsigned long long diskSize = 0;
+	unsigned long long writeSize = 0;
+	const char *bootFileType = NULL;
+	size_t bufferSize = 50 * 1024;
+	char * buffer = NULL;
+	FILE *mbrFile = NULL;
+	FILE *bootFile = NULL;
+	FILE *kernelFile = NULL;
+	size_t chunkSize = 0;
+	int ret = 0;
+	int resized = 0;
+	u64 offset;
+
+	// Determine how the second file will be described in output messages.
+	// If a kernel file is specified too, then assume the second file is the
+	// boot loader.  If no kernel file is specified, assume the boot loader
+	// and kernel are combined into one system file.
+	if (boot != NULL)
+	{
+		bootFileType = "boot loader";
+		if (kernel == NULL)
+		{
+			bootFileType = "system";
+		}
+	}
+
+	// Validate the disk size string and convert it to an integer value.
+	ret = bmfs_parse_size(size, &diskSize);
+
+	// Open the Master boot Record file for reading.
+	if (ret == 0 && mbr != NULL)
+	{
+		mbrFile = fopen(mbr, "rb");
+		if (mbrFile == NULL )
+		{
+			printf("bmfs error: Unable to open MBR file '%s'\n", mbr);
+			ret = 1;
+		}
+	}
+
+	// Open the boot loader file for reading.
+	if (ret == 0 && boot != NULL)
+	{
+		bootFile = fopen(boot, "rb");
+		if (bootFile == NULL )
+		{
+			printf("bmfs error: Unable to open %s file '%s'\n", bootFileType, boot);
+			ret = 1;
+		}
+	}
+
+	// Open the kernel file for reading.
+	if (ret == 0 && kernel != NULL)
+	{
+		kernelFile = fopen(kernel, "rb");
+		if (kernelFile == NULL )
+		{
+			printf("bmfs error: Unable to open kernel file '%s'\n", kernel);
+			ret = 1;
+		}
+	}
+
+	// Allocate buffer to use for filling the disk image with zeros.
+	if (ret == 0)
+	{
+		buffer = (char *) malloc(bufferSize);
+		if (buffer == NULL)
+		{
+			printf("bmfs error: Failed to allocate buffer\n");
+			ret = 1;
+		}
+	}
+
+	// Open the disk image file for writing.  This will truncate the disk file
+	// if it already exists, so we should do this only after we're ready to
+	// actually write to the file.
+	if (ret == 0)
+	{
+		if (bmfs_disk_open(diskname, 1) != 0)
+		{
+			printf("bmfs error: Unable to open disk '%s'\n", diskname);
+			ret = 1;
+		}
+	}
+
+	// Size the disk image. Where the backend can do this directly the image
+	// is left sparse (or preallocated) and a block device is zeroed by the
+	// hardware, otherwise it is filled with zeros.
+	if (ret == 0 && (resized = bmfs_disk_resize(diskSize, preallocate)) < 0)
+	{
+		printf("bmfs error: Disk size is larger than the device '%s'\n", diskname);
+		ret = 1;
+	}
+	if (ret == 0 && resized != 0)
+	{
+		double percent;
+		memset(buffer, 0, bufferSize);
+		writeSize = 0;
+		while (writeSize < diskSize)
+		{
+			percent = writeSize;
+			percent /= diskSize;
+			percent *= 100;
+			printf("Formatting disk: %llu of %llu bytes (%.0f%%)...\r", writeSize, diskSize, percent);
+			chunkSize = bufferSize;
+			if (chunkSize > diskSize - writeSize)
+			{
+				chunkSize = diskSize - writeSize;
+			}
+			if (bmfs_disk_write(buffer, chunkSize, writeSize) != 0)
+			{
+				printf("bmfs error: Failed to write disk '%s'\n", diskname);
+				ret = 1;
+				break;
+			}
+			writeSize += chunkSize;
+		}
+		if (ret == 0)
+		{
+			printf("Formatting disk: %llu of %llu bytes (100%%)%9s\n", writeSize, diskSize, "");
+		}
+	}
+
+	// Format the disk.
+	if (ret == 0 && (bmfs_mount(BMFS_NOCHECK) != 0 || bmfs_format() != 0))
+	{
+		ret = 1;
+	}
+
+	// Write the master boot record if it was specified by the caller.
+	if (ret == 0 && mbrFile != NULL)
+	{
+		if (fread(buffer, 512, 1, mbrFile) == 1)
+		{
+			if (bmfs_disk_write(buffer, 512, 0) != 0)
+			{
+				printf("bmfs error: Failed to write disk '%s'\n", diskname);
+				ret = 1;
+			}
+		}
+		else
+		{
+			printf("bmfs error: Failed to read file '%s'\n", mbr);
+			ret = 1;
+		}
+	}
+
+	// Write the boot loader if it was specified by the caller.
+	offset = 8192;
+	if (ret == 0 && bootFile != NULL)
+	{
+		for (;;)
+		{
+			chunkSize = fread( buffer, 1, bufferSize, bootFile);
+			if (chunkSize > 0)
+			{
+				if (bmfs_disk_write(buffer, chunkSize, offset) != 0)
+				{
+					printf("bmfs error: Failed to write disk '%s'\n", diskname);
+					ret = 1;
+				}
+				offset += chunkSize;
+			}
+			else
+			{
+				if (ferror(bootFile))
+				{
+					printf("bmfs error: Failed to read file '%s'\n", boot);
+					ret = 1;
+				}
+				break;
+			}
+		}
+	}
+
+	// Write the kernel if it was specified by the caller. The kernel must
+	// immediately follow the boot loader on disk.
+	if (ret == 0 && kernelFile != NULL)
+	{
+		for (;;)
+		{
+			chunkSize = fread( buffer, 1, bufferSize, kernelFile);
+			if (chunkSize > 0)
+			{
+				if (bmfs_disk_write(buffer, chunkSize, offset) != 0)
+				{
+					printf("bmfs error: Failed to write disk '%s'\n", diskname);
+					ret = 1;
+				}
+				offset += chunkSize;
+			}
+			else
+			{
+				if (ferror(kernelFile))
+				{
+					printf("bmfs error: Failed to read file '%s'\n", kernel);
+					ret = 1;
+				}
+				break;
+			}
+		}
+	}
+
+	// Close any files that were opened.
+	if (mbrFile != NULL)
+	{
+		fclose(mbrFile);
+	}
+	if (bootFile != NULL)
+	{
+		fclose(bootFile);
+	}
+	if (kernelFile != NULL)
+	{
+		fclose(kernelFile);
+	}
+	bmfs_disk_close();
+
+	// Free the buffer if it was allocated.
+	if (buffer != NULL)
+	{
+		free(buffer);
+	}
+
+	if (ret == 0)
+	{
+		printf("Disk initialization complete.\n");
+	}
+
+	return ret;
+}
+
+
+// Read a build manifest value into dst, complaining about duplicates
+static int build_value(char *dst, size_t max, char *args[], int nargs, int lineno)
+{
+	if (nargs != 2 || strlen(args[1]) >= max || dst[0] != 0)
+	{
+		printf("bmfs error: Invalid '%s' on manifest line %d\n", args[0], lineno);
+		return 1;
+	}
+	strcpy(dst, args[1]);
+	return 0;
+}
+
+
+// Size of a local file in bytes, or -1 if it can not be opened
+static long build_filesize(const char *localname)
+{
+	FILE *f = fopen(localname, "rb");
+	long len = -1;
+
+	if (f != NULL)
+	{
+		if (fseek(f, 0, SEEK_END) == 0)
+			len = ftell(f);
+		fclose(f);
+	}
+	if (len < 0)
+		printf("bmfs error: Unable to open file '%s'\n", localname);
+	return len;
+}
+
+
+// Read the first len bytes of a local file into dst. Returns 0 on success.
+static int build_read(const char *localname, char *dst, size_t len)
+{
+	FILE *f = fopen(localname, "rb");
+	int ret = (f == NULL || (len != 0 && fread(dst, len, 1, f) != 1));
+
+	if (f != NULL)
+		fclose(f);
+	if (ret != 0)
+		printf("bmfs error: Failed to read file '%s'\n", localname);
+	return ret;
+}
+
+
+// Build a complete disk from a manifest in one forward pass. The manifest
+// has one setting per line, blank lines and lines starting with '#' are
+// skipped:
+//	size 64M
+//	mbr bmfs_mbr.sys
+//	boot pure64.sys
+//	kernel kernel.sys
+//	file local_file [bmfs_name [reserved_MiB]]
+// Only size is required. The layout is worked out first: block 0 holds the
+// MBR, disk info, directory, boot loader and kernel, and the files follow
+// from block 1 in manifest order. The disk is then written front to back
+// without zeroing it first, only the bytes the layout needs.
+int bmfs_build(char *diskname, char *manifest)
+{
+	char line[4096], size[32] = "", mbr[4096] = "", boot[4096] = "", kernel[4096] = "";
+	char *localnames[64], *args[4], *buffer = NULL, *xfer = NULL, *name;
+	struct BMFSEntry files[64];
+	unsigned long long diskSize = 0;
+	u64 next = 1, blocks, headerlen = 8192;
+	long len, bootlen = 0, kernellen = 0;
+	FILE *list;
+	int lineno = 0, nfiles = 0, nargs, resized = 0, ret = 0, i;
+
+	memset(files, 0, sizeof(files));
+	if ((list = fopen(manifest, "r")) == NULL)
+	{
+		printf("bmfs error: Unable to open manifest '%s'\n", manifest);
+		return 1;
+	}
+	while (ret == 0 && fgets(line, sizeof(line), list) != NULL)
+	{
+		lineno++;
+		nargs = bmfs_split(line, args, 4);
+		if (nargs == 0 || args[0][0] == '#')
+			continue;
+		if (strcasecmp(args[0], "size") == 0)
+			ret = build_value(size, sizeof(size), args, nargs, lineno);
+		else if (strcasecmp(args[0], "mbr") == 0)
+			ret = build_value(mbr, sizeof(mbr), args, nargs, lineno);
+		else if (strcasecmp(args[0], "boot") == 0)
+			ret = build_value(boot, sizeof(boot), args, nargs, lineno);
+		else if (strcasecmp(args[0], "kernel") == 0)
+			ret = build_value(kernel, sizeof(kernel), args, nargs, lineno);
+		else if (strcasecmp(args[0], "file") == 0 && nfiles == 64)
+		{
+			printf("bmfs error: More than 64 files in the manifest\n");
+			ret = 1;
+		}
+		else if (strcasecmp(args[0], "file") == 0 && nargs >= 2)
+		{
+			if ((localnames[nfiles] = malloc(strlen(args[1]) + 1)) == NULL)
+			{
+				ret = 1;
+				break;
+			}
+			strcpy(localnames[nfiles], args[1]);
+			if (nargs > 2)
+			{
+				name = args[2];
+			}
+			else
+			{
+				name = args[1] + strlen(args[1]);
+				while (name > args[1] && name[-1] != '/' && name[-1] != '\\')
+					name--;
+			}
+			for (i = 0; i < nfiles && strcmp(files[i].FileName, name) != 0; i++)
+				;
+			if (!bmfs_name_valid(name) || i < nfiles)
+			{
+				printf("bmfs error: Invalid or duplicate BMFS file name on manifest line %d\n", lineno);
+				ret = 1;
+			}
+			strncpy(files[nfiles].FileName, name, 31);
+			files[nfiles++].ReservedBlocks = (nargs > 3) ? (strtoull(args[3], NULL, 10) + 1) / 2 : 0;
+		}
+		else
+		{
+			printf("bmfs error: Invalid '%s' on manifest line %d\n", args[0], lineno);
+			ret = 1;
+		}
+	}
+	fclose(list);
+
+	// Work out the layout
+	if (ret == 0 && size[0] == 0)
+	{
+		printf("bmfs error: The manifest does not give a disk size\n");
+		ret = 1;
+	}
+	if (ret == 0)
+		ret = bmfs_parse_size(size, &diskSize);
+	if (ret == 0 && boot[0] != 0 && (bootlen = build_filesize(boot)) < 0)
+		ret = 1;
+	if (ret == 0 && kernel[0] != 0 && (kernellen = build_filesize(kernel)) < 0)
+		ret = 1;
+	if (ret == 0 && (headerlen += bootlen + kernellen) > blockSize)
+	{
+		printf("bmfs error: Boot loader and kernel do not fit in the first block\n");
+		ret = 1;
+	}
+	for (i = 0; i < nfiles && ret == 0; i++)
+	{
+		if ((len = build_filesize(localnames[i])) < 0)
+		{
+			ret = 1;
+			break;
+		}
+		// Reserve the same space bmfs_write would, unless told otherwise
+		blocks = ((u64)len < blockSize) ? 1 : ((u64)len / 1048576 + 2) / 2;
+		if (files[i].ReservedBlocks == 0)
+			files[i].ReservedBlocks = blocks;
+		else if (files[i].ReservedBlocks * blockSize < (u64)len)
+		{
+			printf("bmfs error: Reserved space is too small for '%s'\n", localnames[i]);
+			ret = 1;
+		}
+		files[i].StartingBlock = next;
+		files[i].FileSize = len;
+		next += files[i].ReservedBlocks;
+	}
+	if (ret == 0 && next > diskSize / blockSize - 1)	// The last block is not used
+	{
+		printf("bmfs error: The files do not fit in a %s disk\n", size);
+		ret = 1;
+	}
+
+	// Create the disk. Only image files are sized, a block device is used
+	// as it is since everything that is read back is written below.
+	if (ret == 0 && bmfs_disk_open(diskname, 1) != 0)
+	{
+		printf("bmfs error: Unable to open disk '%s'\n", diskname);
+		ret = 1;
+	}
+	else if (ret == 0)
+	{
+		if (disk->blockdev)
+			resized = (bmfs_disk_size() < diskSize) ? -1 : 0;
+		else
+			resized = bmfs_disk_resize(diskSize, preallocate);
+		if (resized < 0)
+		{
+			printf("bmfs error: Disk size is larger than the device '%s'\n", diskname);
+			ret = 1;
+		}
+		else if ((buffer = bmfs_disk_buffer()) == NULL)
+		{
+			printf("bmfs error: Unable to allocate enough memory for buffer.\n");
+			ret = 1;
+		}
+	}
+
+	// Block 0: MBR, disk info, directory, boot loader and kernel
+	if (ret == 0)
+	{
+		memset(buffer, 0, headerlen);
+		if (mbr[0] != 0)
+			ret = build_read(mbr, buffer, 512);
+		memcpy(buffer + 1024, fs_tag, 4);			// Add the 'BMFS' tag
+		memcpy(buffer + 4096, files, nfiles * 64);		// The directory
+		if (ret == 0 && boot[0] != 0)
+			ret = build_read(boot, buffer + 8192, bootlen);
+		if (ret == 0 && kernel[0] != 0)				// The kernel immediately follows the boot loader
+			ret = build_read(kernel, buffer + 8192 + bootlen, kernellen);
+		if (resized != 0)					// Nothing zeroed the disk, write the whole block
+		{
+			memset(buffer + headerlen, 0, blockSize - headerlen);
+			headerlen = blockSize;
+		}
+		if (ret == 0 && bmfs_disk_write(buffer, headerlen, 0) != 0)
+		{
+			printf("bmfs error: Failed to write disk '%s'\n", diskname);
+			ret = 1;
+		}
+	}
+
+	// The files, in disk order
+	for (i = 0; i < nfiles && ret == 0; i++)
+	{
+		ret = bmfs_import(&files[i], localnames[i], &xfer);
+		blocks = (files[i].FileSize + blockSize - 1) / blockSize;	// Written by bmfs_import
+		if (ret == 0 && resized != 0)
+			ret = bmfs_disk_zero((files[i].StartingBlock + blocks) * blockSize, (files[i].ReservedBlocks - blocks) * blockSize);
+	}
+	if (ret == 0 && resized != 0)
+		ret = bmfs_disk_zero(next * blockSize, diskSize - next * blockSize);
+	if (xfer != NULL)
+		bmfs_buffer_free(xfer, blockSize);
+
+	for (i = 0; i < nfiles; i++)
+		free(localnames[i]);
+	if (disk != NULL)
+		bmfs_disk_close();
+	if (ret == 0)
+		printf("Disk build complete.\n");
+	return ret;
+}
+
+
+void bmfs_create(char *filename, unsigned long long maxsize)
+{
+	if (maxsize % 2 != 0)
+		maxsize++;
+
+	switch (bmfs_volume_create(volume, filename, maxsize / 2))
+	{
+		case BMFS_OK:
+			break;
+		case BMFS_EEXIST:
+			printf("bmfs error: File already exists.\n");
+			break;
+		case BMFS_EDIRFULL:
+			printf("bmfs error: Cannot create file. No free directory entries.\n");
+			break;
+		case BMFS_ENOSPC:
+			printf("bmfs error: Cannot create file of size %lld MiB.\n", maxsize);
+			break;
+		case BMFS_ENAME:
+			printf("bmfs error: Invalid file name.\n");
+			break;
+		default:
+			printf("bmfs error: Failed to write disk\n");
+			break;
+	}
+}
+
+
+// Create filename with room for size bytes of data, the way write does.
+// Streams of unknown length (size 0) start with one block.
+void bmfs_create_for(char *filename, unsigned long long size)
+{
+	if (size < blockSize)
+	{
+		bmfs_create(filename, (size+blockSize)/blockSize);
+	}
+	else
+	{
+		bmfs_create(filename, ceil((size+1048576)/1048576));
+	}
+}
+
+// Read a file from a BMFS volume
+void bmfs_read(char *filename, char *localname)
+{
+	struct BMFSEntry tempentry;
+	FILE *tfile;
+	int retval;
+	unsigned long long bytestoread;
+	long hoststart;
+	u64 offset;
+	char *buffer;
+	FILE *errs = stdout;
+
+	if (localname != NULL && strcmp(localname, "-") == 0)
+		errs = stderr;					// Keep errors out of the data on stdout
+
+	// Keep the blocks from being reused while they are read
+	if (bmfs_volume_lockfile(volume, filename, BMFS_SHARED, &tempentry) != BMFS_OK)
+	{
+		fprintf(errs, "bmfs error: File not found in BMFS.\n");
+		return;
+	}
+	if (rangeoffset > tempentry.FileSize)
+	{
+		fprintf(errs, "bmfs error: Offset is past the end of the file.\n");
+	}
+	else
+	{
+		if (localname == NULL)
+			localname = tempentry.FileName;
+		if (strcmp(localname, "-") == 0)			// Stream to standard output
+			tfile = bmfs_binary_stream(stdout);
+		else
+			tfile = fopen(localname, "wb");
+		if (tfile == NULL)
+		{
+			fprintf(errs, "bmfs error: Could not open local file '%s'\n", localname);
+		}
+		else
+		{
+			fflush(tfile);
+			if ((hoststart = ftell(tfile)) < 0)		// Not seekable, e.g. a pipe
+				hoststart = 0;
+			bytestoread = tempentry.FileSize - rangeoffset;
+			if (bytestoread > rangelength)
+				bytestoread = rangelength;
+			offset = tempentry.StartingBlock*blockSize + rangeoffset;	// Starting byte in the disk
+			// io_uring reads whole blocks on an aligned disk, so it needs
+			// an aligned start to stay inside the reservation
+			if (useuring && (bmfs_disk_align() == 1 || offset % blockSize == 0) && (retval = bmfs_uring_copy(bmfs_disk_fd(), offset, bmfs_host_fd(tfile), hoststart, bytestoread, (bmfs_disk_align() > 1) ? COPY_FULLREAD : 0)) >= 0)
+			{
+				if (retval != 0)
+				{
+					fprintf(errs, "bmfs error: Unexpected read length detected.\n");
+				}
+				fseek(tfile, hoststart + bytestoread, SEEK_SET);	// Account for the data moved past stdio
+			}
+			else if (bytestoread != 0 && (buffer = bmfs_disk_map(offset, bytestoread)) != NULL)
+			{
+				// Mapped disk, copy straight from the mapping
+				if (fwrite(buffer, bytestoread, 1, tfile) != 1)
+				{
+					fprintf(errs, "bmfs error: Could not write local file '%s'\n", localname);
+				}
+			}
+			else if (pipelinedepth != 0 && (retval = bmfs_pipeline_copy(tfile, offset, bytestoread, 0)) >= 0)
+			{
+				if (retval != 0)
+				{
+					fprintf(errs, "bmfs error: Unexpected read length detected.\n");
+				}
+			}
+			else if ((retval = bmfs_kernel_copy(bmfs_disk_fd(), offset, bmfs_host_fd(tfile), hoststart, bytestoread)) >= 0)
+			{
+				if (retval != 0)
+				{
+					fprintf(errs, "bmfs error: Unexpected read length detected.\n");
+				}
+				fseek(tfile, hoststart + bytestoread, SEEK_SET);	// Account for the data moved past stdio
+			}
+			else if ((buffer = bmfs_disk_buffer()) == NULL)
+			{
+				fprintf(errs, "bmfs error: Unable to allocate enough memory for buffer.\n");
+			}
+			else
+			{
+				while (bytestoread != 0)
+				{
+					if (bytestoread >= blockSize)
+					{
+						retval = bmfs_disk_read(buffer, blockSize, offset);
+						if (retval == 0)
+						{
+							fwrite(buffer, blockSize, 1, tfile);
+							bytestoread -= blockSize;
+							offset += blockSize;
+						}
+						else
+						{
+							fprintf(errs, "bmfs error: Unexpected read length detected.\n");
+							bytestoread = 0;
+						}
+					}
+					else
+					{
+						// Read whole sectors if the backend needs aligned I/O,
+						// an unaligned range is staged by the backend anyway
+						if (offset % bmfs_disk_align() == 0)
+							retval = bmfs_disk_read(buffer, (bytestoread + bmfs_disk_align() - 1) / bmfs_disk_align() * bmfs_disk_align(), offset);
+						else
+							retval = bmfs_disk_read(buffer, bytestoread, offset);
+						if (retval == 0)
+						{
+							fwrite(buffer, bytestoread, 1, tfile);
+							bytestoread = 0;
+						}
+						else
+						{
+							fprintf(errs, "bmfs error: Unexpected read length detected.\n");
+							bytestoread = 0;
+						}
+					}
+				}
+			}
+			if (tfile == stdout)
+				fflush(tfile);
+			else
+				fclose(tfile);
+		}
+	}
+	bmfs_volume_lockextent(volume, &tempentry, BMFS_UNLOCK);
+}
+
+
+// Write a file to a BMFS volume
+void bmfs_write(char *filename, char *localname)
+{
+	struct BMFSEntry tempentry;
+	FILE *tfile;
+	int slot, retval, seekable;
+	unsigned long long tempfilesize = 0;
+	long hoststart;
+	u64 offset, blocks;
+	char *buffer;
+
+	if (localname == NULL)
+		localname = filename;
+	if (strcmp(localname, "-") == 0)				// Stream from standard input
+		tfile = bmfs_binary_stream(stdin);
+	else
+		tfile = fopen(localname, "rb");
+	if (tfile == NULL)
+	{
+		printf("bmfs error: Could not open local file '%s'\n", localname);
+	}
+	else
+	{
+		// Is there enough room in BMFS?
+		hoststart = ftell(tfile);
+		seekable = (hoststart >= 0 && fseek(tfile, 0, SEEK_END) == 0);
+		if (seekable)
+		{
+			tempfilesize = ftell(tfile) - hoststart;
+			fseek(tfile, hoststart, SEEK_SET);
+		}
+		// Create the file in one locked step, after that only its blocks are
+		// locked while the data is copied
+		bmfs_volume_lock(volume);
+		if (0 == bmfs_find(filename, &tempentry, &slot))
+			bmfs_create_for(filename, tempfilesize);
+		bmfs_volume_unlock(volume);
+		if (!seekable)
+		{
+			// Length is unknown, grow the reservation as the data arrives
+			bmfs_stream_write(tfile, filename);
+		}
+		else if (bmfs_volume_lockfile(volume, filename, BMFS_EXCLUSIVE, &tempentry) != BMFS_OK)
+		{
+			// bmfs_create said why
+		}
+		else if ((tempentry.ReservedBlocks*blockSize) < tempfilesize)
+		{
+			printf("bmfs error: Not enough reserved space in BMFS.\n");
+			bmfs_volume_lockextent(volume, &tempentry, BMFS_UNLOCK);
+		}
+		else
+		{
+			offset = tempentry.StartingBlock*blockSize;	// Starting block in the disk
+			blocks = (tempfilesize + blockSize - 1) / blockSize;
+			if (useuring && (retval = bmfs_uring_copy(bmfs_host_fd(tfile), hoststart, bmfs_disk_fd(), offset, tempfilesize, COPY_PAD)) >= 0)
+			{
+				if (retval == 0)
+				{
+					fseek(tfile, hoststart + tempfilesize, SEEK_SET);	// Account for the data moved past stdio
+				}
+				else
+				{
+					printf("bmfs error: Unexpected read length detected.\n");
+				}
+			}
+			else if (blocks != 0 && (buffer = bmfs_disk_map(offset, blocks*blockSize)) != NULL)
+			{
+				// Mapped disk, copy straight into the mapping
+				if (fread(buffer, tempfilesize, 1, tfile) == 1)
+				{
+					memset(buffer+tempfilesize, 0, blocks*blockSize-tempfilesize); // 0 the rest of the last block
+				}
+				else
+				{
+					printf("bmfs error: Unexpected read length detected.\n");
+				}
+			}
+			else if (pipelinedepth != 0 && (retval = bmfs_pipeline_copy(tfile, offset, tempfilesize, 1)) >= 0)
+			{
+				if (retval != 0)
+				{
+					printf("bmfs error: Unexpected read length detected.\n");
+				}
+			}
+			else if ((retval = bmfs_kernel_copy(bmfs_host_fd(tfile), hoststart, bmfs_disk_fd(), offset, tempfilesize)) >= 0)
+			{
+				if (retval == 0)
+				{
+					bmfs_disk_zero(offset+tempfilesize, blocks*blockSize-tempfilesize); // 0 the rest of the last block
+					fseek(tfile, hoststart + tempfilesize, SEEK_SET);	// Account for the data moved past stdio
+				}
+				else
+				{
+					printf("bmfs error: Unexpected read length detected.\n");
+				}
+			}
+			else if ((buffer = bmfs_disk_buffer()) == NULL)
+			{
+				printf("bmfs error: Unable to allocate enough memory for buffer.\n");
+			}
+			else
+			{
+				while (tempfilesize != 0)
+				{
+					if (tempfilesize >= blockSize)
+					{
+						retval = fread(buffer, blockSize, 1, tfile);
+						if (retval == 1)
+						{
+							bmfs_disk_write(buffer, blockSize, offset);
+							tempfilesize -= blockSize;
+							offset += blockSize;
+						}
+						else
+						{
+							printf("bmfs error: Unexpected read length detected.\n");
+							tempfilesize = 0;
+						}
+					}
+					else
+					{
+						retval = fread(buffer, tempfilesize, 1, tfile);
+						if (retval == 1)
+						{
+							memset(buffer+(tempfilesize), 0, (blockSize-tempfilesize)); // 0 the rest of the buffer
+							bmfs_disk_write(buffer, blockSize, offset);
+							tempfilesize = 0;
+						}
+						else
+						{
+							printf("bmfs error: Unexpected read length detected.\n");
+							tempfilesize = 0;
+						}
+					}
+				}
+			}
+			// Update directory, then let others at the file
+			tempfilesize = ftell(tfile) - hoststart;
+			bmfs_volume_setsize(volume, filename, tempfilesize);
+			bmfs_volume_lockextent(volume, &tempentry, BMFS_UNLOCK);
+		}
+		if (tfile != stdin)
+			fclose(tfile);
+	}
+}
+
+
+// Overwrite part of a file on a BMFS volume with the contents of a local file
+// ('-' or none for standard input), starting --offset bytes into it, or at
+// the end of the file to append. Only the bytes given are written, the rest
+// of the file is left as it is. Data past the end makes the file longer,
+// growing the reservation if need be.
+void bmfs_patch(char *filename, char *localname, int append)
+{
+	struct BMFSEntry tempentry;
+	FILE *tfile = NULL;
+	int changed = 0, grown = 0;
+	u64 pos, size, reserved;
+	size_t n;
+	char *buffer;
+
+	if (localname == NULL)
+		localname = "-";
+	// Only the blocks of the file are locked while the data is written, the
+	// directory just to grow the reservation and to record the length
+	if (bmfs_volume_lockfile(volume, filename, BMFS_EXCLUSIVE, &tempentry) != BMFS_OK)
+	{
+		printf("bmfs error: File not found in BMFS.\n");
+		return;
+	}
+	size = tempentry.FileSize;
+	reserved = tempentry.ReservedBlocks;
+	if ((pos = append ? size : rangeoffset) > size)
+	{
+		printf("bmfs error: Offset is past the end of the file.\n");
+	}
+	else if ((tfile = (strcmp(localname, "-") == 0) ? bmfs_binary_stream(stdin) : fopen(localname, "rb")) == NULL)
+	{
+		printf("bmfs error: Could not open local file '%s'\n", localname);
+	}
+	// Not the per-disk buffer, bmfs_grow uses that to move the file
+	else if ((buffer = bmfs_buffer_alloc(blockSize)) == NULL)
+	{
+		printf("bmfs error: Unable to allocate enough memory for buffer.\n");
+	}
+	else
+	{
+		while ((n = fread(buffer, 1, blockSize, tfile)) != 0)
+		{
+			while (pos + n > tempentry.ReservedBlocks*blockSize && bmfs_regrow(filename, &tempentry, size) == 0)
+				grown = 1;
+			if (pos + n > tempentry.ReservedBlocks*blockSize)
+				break;					// bmfs_regrow said why
+			if (bmfs_disk_write(buffer, n, tempentry.StartingBlock*blockSize + pos) != 0)
+			{
+				printf("bmfs error: Unexpected write length detected.\n");
+				break;
+			}
+			pos += n;
+			if (pos > size)
+			{
+				size = pos;
+				changed = 1;
+			}
+		}
+		if (ferror(tfile))
+			printf("bmfs error: Could not read local file '%s'\n", localname);
+		bmfs_buffer_free(buffer, blockSize);
+	}
+	if (tfile != NULL && tfile != stdin)
+		fclose(tfile);
+	if (changed || grown)
+		bmfs_record(filename, &tempentry, size, grown ? reserved : 0);
+	bmfs_volume_lockextent(volume, &tempentry, BMFS_UNLOCK);
+}
+
+
+// Copy a local stream of unknown length (a pipe) to the disk at offset, taking
+// at most limit bytes. The last block is zero filled. Pipes are spliced
+// straight into the disk where the kernel supports it. *carry is a byte
+// already taken from the stream to store first, or -1. On return it holds the
+// next byte of the stream if limit was reached before the end, else -1.
+// Returns 0 on success with the number of bytes stored in *written.
+int bmfs_stream_in(FILE *tfile, u64 offset, u64 limit, unsigned long long *written, int *carry)
+{
+	unsigned long long done = 0;
+	char *buffer;
+	size_t chunk, n;
+	int ret = 0, next;
+
+#ifdef BMFS_COPYRANGE
+	if (bmfs_disk_fd() >= 0 && !bmfs_fd_isdirect(bmfs_disk_fd()) && bmfs_fd_ispipe(bmfs_host_fd(tfile)))
+	{
+		loff_t out = offset;
+		unsigned char c;
+		ssize_t s;
+
+		if (*carry >= 0 && limit != 0)
+		{
+			c = *carry;
+			ret = bmfs_disk_write(&c, 1, offset);
+			done = 1;
+			out++;
+		}
+		while (done < limit && ret == 0)
+		{
+			chunk = (limit - done > 0x40000000) ? 0x40000000 : (size_t)(limit - done);
+			s = splice(bmfs_host_fd(tfile), NULL, bmfs_disk_fd(), &out, chunk, SPLICE_F_MOVE);
+			if (s < 0 && errno == EINTR)
+				continue;
+			if (s < 0)
+			{
+				printf("bmfs error: Unexpected read length detected.\n");
+				ret = 1;
+				break;
+			}
+			if (s == 0)					// End of stream
+				break;
+			done += s;
+		}
+		*carry = -1;
+		if (ret == 0 && done == limit)				// Look for more without losing it
+		{
+			while ((s = read(bmfs_host_fd(tfile), &c, 1)) < 0 && errno == EINTR)
+				;
+			if (s == 1)
+				*carry = c;
+		}
+		if (ret == 0)
+			ret = bmfs_disk_zero(offset + done, (blockSize - (offset + done) % blockSize) % blockSize);
+	}
+	else
+#endif
+	if ((buffer = bmfs_disk_buffer()) == NULL)
+	{
+		printf("bmfs error: Unable to allocate enough memory for buffer.\n");
+		ret = 1;
+	}
+	else
+	{
+		while (done < limit && ret == 0)
+		{
+			chunk = (limit - done < blockSize) ? (size_t)(limit - done) : blockSize;
+			n = 0;
+			if (*carry >= 0)
+			{
+				buffer[n++] = *carry;
+				*carry = -1;
+			}
+			n += fread(buffer+n, 1, chunk-n, tfile);	// Only short at the end of the stream
+			if (n == 0)
+				break;
+			memset(buffer+n, 0, blockSize-n);		// 0 the rest of the buffer
+			if (bmfs_disk_write(buffer, blockSize, offset + done) != 0)
+			{
+				printf("bmfs error: Unexpected write length detected.\n");
+				ret = 1;
+			}
+			done += n;
+		}
+		*carry = -1;
+		if (ret == 0 && done == limit && (next = fgetc(tfile)) != EOF)	// Look for more
+			*carry = next;
+	}
+	*written = done;
+	return ret;
+}
+
+
+// Stream a local file of unknown length into filename, with its blocks
+// locked. When the reservation fills up it is grown with bmfs_regrow, and at
+// the end it is trimmed back to what is used and the length is recorded.
+// Returns 0 on success.
+int bmfs_stream_write(FILE *tfile, char *filename)
+{
+	struct BMFSEntry entry;
+	unsigned long long done = 0, n;
+	u64 reserved;
+	int carry = -1, grown = 0, ret;
+
+	if (bmfs_volume_lockfile(volume, filename, BMFS_EXCLUSIVE, &entry) != BMFS_OK)
+		return 1;					// bmfs_create said why
+	reserved = entry.ReservedBlocks;
+	for (;;)
+	{
+		ret = bmfs_stream_in(tfile, entry.StartingBlock*blockSize + done, entry.ReservedBlocks*blockSize - done, &n, &carry);
+		done += n;
+		if (ret != 0 || carry < 0)
+			break;
+		if ((ret = bmfs_regrow(filename, &entry, done)) != 0)
+			break;
+		grown = 1;
+	}
+	if (bmfs_record(filename, &entry, done, grown ? reserved : 0) != 0)
+		ret = 1;
+	bmfs_volume_lockextent(volume, &entry, BMFS_UNLOCK);
+	return ret;
+}
+
+
+// Grow the reservation of filename with bmfs_grow while its blocks, as in
+// *entry, are locked and hold used bytes of data. The length so far is
+// recorded with the new reservation, and the blocks the file has now are
+// locked in place of the old ones. Returns 0 with *entry updated.
+int bmfs_regrow(char *filename, struct BMFSEntry *entry, u64 used)
+{
+	struct BMFSEntry current, old = *entry, *pEntry;
+	int slot, ret = 1;
+
+	bmfs_volume_lock(volume);
+	if (!bmfs_find(filename, &current, &slot) || current.StartingBlock != entry->StartingBlock)
+	{
+		printf("bmfs error: File '%s' was changed by another process.\n", filename);
+	}
+	else if (bmfs_grow(slot, used) != 0)
+	{
+		printf("bmfs error: Not enough free space in BMFS.\n");
+	}
+	else
+	{
+		pEntry = (struct BMFSEntry *)(Directory + slot * 64);
+		if (used > pEntry->FileSize)
+			pEntry->FileSize = used;
+		*entry = *pEntry;
+		ret = (bmfs_volume_commit(volume, slot) != BMFS_OK);
+	}
+	bmfs_volume_unlock(volume);
+	if (ret == 0)
+	{
+		bmfs_volume_lockextent(volume, entry, BMFS_EXCLUSIVE);
+		if (entry->StartingBlock != old.StartingBlock)	// Moved
+			bmfs_volume_lockextent(volume, &old, BMFS_UNLOCK);
+	}
+	return ret;
+}
+
+
+// Record size as the length of filename while its blocks are still locked,
+// unless the file was replaced in the meantime. A grown reservation
+// (reserved is the number of blocks before, 0 if not grown) is trimmed back
+// to what is used. Returns 0 on success.
+int bmfs_record(char *filename, const struct BMFSEntry *entry, u64 size, u64 reserved)
+{
+	struct BMFSEntry current, *pEntry;
+	u64 used;
+	int slot, ret = 1;
+
+	bmfs_volume_lock(volume);
+	if (!bmfs_find(filename, &current, &slot) || current.StartingBlock != entry->StartingBlock)
+	{
+		printf("bmfs error: File '%s' was changed by another process.\n", filename);
+	}
+	else
+	{
+		pEntry = (struct BMFSEntry *)(Directory + slot * 64);
+		pEntry->FileSize = size;
+		used = (size + blockSize - 1) / blockSize;
+		if (reserved != 0 && pEntry->ReservedBlocks > reserved)
+			pEntry->ReservedBlocks = (used > reserved) ? used : reserved;
+		ret = (bmfs_volume_commit(volume, slot) != BMFS_OK);
+	}
+	bmfs_volume_unlock(volume);
+	return ret;
+}
+
+
+// Enlarge the reservation of the file in directory entry slot, the first
+// used bytes of which hold data. The reservation is doubled in place if the
+// blocks after it are free (or grown by as many as are free). Otherwise the
+// data is moved to the start of the largest free extent and the reservation
+// doubled there, so it can go on growing in place while other files being
+// written at the same time still find room. Returns 0 on success.
+int bmfs_grow(int slot, u64 used)
+{
+	struct BMFSEntry *self = (struct BMFSEntry *)(Directory + slot * 64);
+	struct BMFSEntry *pEntry;
+	char dir_copy[4096];
+	u64 end = self->StartingBlock + self->ReservedBlocks;
+	u64 num_blocks = disksize / 2;				// number of blocks in the disk
+	u64 prev_file_end = 1, this_file_start, gap, avail = 0, beststart = 0, bestlen = 0;
+	u64 from, to, left;
+	char *buffer;
+	int count = 0, tint, ret;
+
+	// Walk the gaps between the files in disk order
+	memcpy(dir_copy, Directory, 4096);
+	while (count < 64 && dir_copy[count * 64] != 0x00)
+		count++;
+	qsort(dir_copy, count, 64, bmfs_entry_cmp);
+	for (tint = 0; tint <= count; tint++)
+	{
+		pEntry = (struct BMFSEntry *)(dir_copy + tint * 64);
+		if (tint == count || pEntry->FileName[0] == 0x01)	// Deleted entries are sorted last
+			this_file_start = num_blocks - 1;		// index of the last block
+		else
+			this_file_start = pEntry->StartingBlock;
+		gap = (this_file_start > prev_file_end) ? this_file_start - prev_file_end : 0;
+		if (prev_file_end == end)
+			avail = gap;
+		if (gap > bestlen)
+		{
+			beststart = prev_file_end;
+			bestlen = gap;
+		}
+		if (tint == count || pEntry->FileName[0] == 0x01)
+			break;
+		if (pEntry->StartingBlock + pEntry->ReservedBlocks > prev_file_end)
+			prev_file_end = pEntry->StartingBlock + pEntry->ReservedBlocks;
+	}
+
+	if (avail != 0)
+	{
+		self->ReservedBlocks += (avail < self->ReservedBlocks) ? avail : self->ReservedBlocks;
+		return 0;
+	}
+	if (bestlen <= self->ReservedBlocks)
+		return 1;
+
+	// Move the data, whole blocks as the reservation is full
+	from = self->StartingBlock * blockSize;
+	to = beststart * blockSize;
+	left = (used + blockSize - 1) / blockSize * blockSize;
+	if ((ret = bmfs_kernel_copy(bmfs_disk_fd(), from, bmfs_disk_fd(), to, left)) < 0)
+	{
+		ret = 0;
+		if ((buffer = bmfs_disk_buffer()) == NULL)
+			ret = 1;
+		for (; left != 0 && ret == 0; left -= blockSize, from += blockSize, to += blockSize)
+			if (bmfs_disk_read(buffer, blockSize, from) != 0 || bmfs_disk_write(buffer, blockSize, to) != 0)
+				ret = 1;
+	}
+	if (ret != 0)
+		return 1;
+	self->StartingBlock = beststart;
+	self->ReservedBlocks = (bestlen < self->ReservedBlocks * 2) ? bestlen : self->ReservedBlocks * 2;
+	return 0;
+}
+
+
+// Order src and dst for locking: by disk, then by starting block, so copies
+// in opposite directions take their locks in the same order and can not wait
+// for each other. Returns < 0 when src is locked first, > 0 when dst is, and
+// 0 when dst is the file src, on the same disk opened a second time; copying
+// it onto itself would wait forever for its own lock.
+static int bmfs_copy_order(struct BMFSDisk *src, struct BMFSEntry *srcentry, struct BMFSEntry *dstentry)
+{
+#ifdef BMFS_POSIX
+	struct stat a, b;
+
+	if (fstat(src->fd, &a) != 0 || fstat(bmfs_disk_fd(), &b) != 0)
+		return -1;
+	if (a.st_dev != b.st_dev)
+		return (a.st_dev < b.st_dev) ? -1 : 1;
+	if (a.st_ino != b.st_ino)
+		return (a.st_ino < b.st_ino) ? -1 : 1;
+	if (srcentry->StartingBlock != dstentry->StartingBlock)
+		return (srcentry->StartingBlock < dstentry->StartingBlock) ? -1 : 1;
+	return 0;
+#else
+	(void)src; (void)srcentry; (void)dstentry;
+	return -1;	// No locks to order
+#endif
+}
+
+
+// Lock the source file shared and the destination exclusive, in the order
+// bmfs_copy_order gave. Either entry is refreshed if its file changed before
+// it was locked. Returns 0 with both locked, or 1 with neither.
+static int bmfs_copy_lock(BMFSVolume *srcvol, char *srcname, struct BMFSEntry *srcentry, char *dstname, struct BMFSEntry *dstentry, int order)
+{
+	if (order > 0 && bmfs_volume_lockfile(volume, dstname, BMFS_EXCLUSIVE, dstentry) != BMFS_OK)
+	{
+		printf("bmfs error: File '%s' was changed by another process.\n", dstname);
+		return 1;
+	}
+	if (bmfs_volume_lockfile(srcvol, srcname, BMFS_SHARED, srcentry) != BMFS_OK)
+	{
+		printf("bmfs error: File '%s' was changed by another process.\n", srcname);
+		if (order > 0)
+			bmfs_volume_lockextent(volume, dstentry, BMFS_UNLOCK);
+		return 1;
+	}
+	if (order < 0 && bmfs_volume_lockfile(volume, dstname, BMFS_EXCLUSIVE, dstentry) != BMFS_OK)
+	{
+		printf("bmfs error: File '%s' was changed by another process.\n", dstname);
+		bmfs_volume_lockextent(srcvol, srcentry, BMFS_UNLOCK);
+		return 1;
+	}
+	return 0;
+}
+
+
+// Copy a file from one BMFS disk to another, or within one, without a local
+// copy. source is disk:file and dest is disk or disk:file (default the same
+// name). The destination file is created the way bmfs_write would if it does
+// not exist. Returns 0 on success.
+int bmfs_copy(char *source, char *dest)
+{
+	struct BMFSDisk src;
+	struct BMFSEntry srcentry, dstentry;
+	BMFSVolume *srcvol;
+	char *srcname, *dstname, *buffer;
+	u64 srcoff, dstoff, left, padded;
+	size_t chunk;
+	int slot, order, ret = 0;
+
+	srcname = strrchr(source, ':');
+	if (srcname == NULL || srcname[1] == 0)
+	{
+		printf("bmfs error: The source must be given as disk:file\n");
+		return 1;
+	}
+	*srcname++ = 0;
+	dstname = strrchr(dest, ':');
+	if (dstname != NULL && dstname[1] != 0 && strpbrk(dstname, "/\\") == NULL)	// Not a drive letter
+		*dstname++ = 0;
+	else
+		dstname = srcname;
+
+	// Look the file up on the source disk, then keep that disk open aside
+	// with a volume of its own
+	if ((ret = bmfs_open(source, 0)) != 0)
+	{
+		bmfs_open_failed(source, ret);
+		return 1;
+	}
+	bmfs_volume_close(volume);
+	volume = NULL;
+	src = diskdev;
+	disk = NULL;
+	if ((srcvol = bmfs_volume_attach(&bmfs_disk_io, &src, 0, &ret)) == NULL || bmfs_volume_find(srcvol, srcname, &srcentry, NULL) != BMFS_OK)
+	{
+		printf("bmfs error: File not found in BMFS.\n");
+		if (srcvol != NULL)
+			bmfs_volume_close(srcvol);
+		src.ops->close(&src);
+		return 1;
+	}
+	ret = 0;
+
+	if ((ret = bmfs_open(dest, 0)) != 0)
+	{
+		bmfs_open_failed(dest, ret);
+		ret = 1;
+	}
+	else
+	{
+		if (0 == bmfs_find(dstname, &dstentry, &slot))
+		{
+			bmfs_create(dstname, (srcentry.FileSize < blockSize) ? 1 : srcentry.FileSize / 1048576 + 1);
+			ret = (0 == bmfs_find(dstname, &dstentry, &slot));	// bmfs_create said why
+		}
+		order = (ret == 0) ? bmfs_copy_order(&src, &srcentry, &dstentry) : 0;
+		if (ret == 0 && order == 0)
+		{
+			printf("bmfs error: Source and destination are the same file.\n");
+			ret = 1;
+		}
+		else if (ret == 0 && bmfs_copy_lock(srcvol, srcname, &srcentry, dstname, &dstentry, order) != 0)
+		{
+			ret = 1;
+		}
+		else if (ret == 0 && (dstentry.ReservedBlocks*blockSize) < srcentry.FileSize)
+		{
+			printf("bmfs error: Not enough reserved space in BMFS.\n");
+			bmfs_volume_lockextent(volume, &dstentry, BMFS_UNLOCK);
+			bmfs_volume_lockextent(srcvol, &srcentry, BMFS_UNLOCK);
+			ret = 1;
+		}
+		else if (ret == 0)
+		{
+			srcoff = srcentry.StartingBlock*blockSize;
+			dstoff = dstentry.StartingBlock*blockSize;
+			left = srcentry.FileSize;
+			padded = (left + blockSize - 1) / blockSize * blockSize;
+			if (useuring && (ret = bmfs_uring_copy(src.fd, srcoff, bmfs_disk_fd(), dstoff, left, COPY_PAD | COPY_FULLREAD)) >= 0)
+			{
+				// Done
+			}
+			else if ((ret = bmfs_kernel_copy(src.fd, srcoff, bmfs_disk_fd(), dstoff, left)) >= 0)
+			{
+				if (ret == 0)
+					ret = bmfs_disk_zero(dstoff+left, padded-left);	// 0 the rest of the last block
+			}
+			else if ((buffer = bmfs_disk_buffer()) == NULL)
+			{
+				printf("bmfs error: Unable to allocate enough memory for buffer.\n");
+				ret = 1;
+			}
+			else
+			{
+				// Whole blocks, the source reservation is always whole blocks
+				ret = 0;
+				while (left != 0 && ret == 0)
+				{
+					chunk = (left < blockSize) ? (size_t)left : blockSize;
+					ret = src.ops->read(&src, buffer, blockSize, srcoff);
+					memset(buffer+chunk, 0, blockSize-chunk);	// 0 the rest of the buffer
+					if (ret == 0)
+						ret = bmfs_disk_write(buffer, blockSize, dstoff);
+					srcoff += chunk;
+					dstoff += chunk;
+					left -= chunk;
+				}
+			}
+			if (ret != 0)
+			{
+				printf("bmfs error: Could not copy '%s'\n", srcname);
 			}
+			else
+			{
+				bmfs_volume_setsize(volume, dstname, srcentry.FileSize);
+			}
+			bmfs_volume_lockextent(volume, &dstentry, BMFS_UNLOCK);
+			bmfs_volume_lockextent(srcvol, &srcentry, BMFS_UNLOCK);
+		}
+		bmfs_disk_close();
+	}
+	bmfs_volume_close(srcvol);
+	src.ops->close(&src);
 
-			// If this character is a valid unit indicator, but is not at the
-			// end of the string, then the string is invalid.
-			if (ret == 0 && size[i+1] != '\0')
+	return ret;
+}
+
+
+// Copy one file from the disk to localname. Safe to run on several threads at
+// once: the disk is only accessed at explicit offsets, and *buffer is the
+// caller's own transfer buffer, allocated here on first use. Returns 0 on
+// success.
+int bmfs_extract(struct BMFSEntry *entry, const char *localname, char **buffer)
+{
+	FILE *tfile;
+	u64 offset, left;
+	size_t chunk;
+	char *src;
+	int ret;
+
+	// Look the file up again, it may have changed since entry was taken
+	if (bmfs_volume_lockfile(volume, entry->FileName, BMFS_SHARED, entry) != BMFS_OK)
+	{
+		printf("bmfs error: File '%s' not found in BMFS.\n", entry->FileName);
+		return 1;
+	}
+	offset = entry->StartingBlock*blockSize;
+	left = entry->FileSize;
+	if ((tfile = fopen(localname, "wb")) == NULL)
+	{
+		printf("bmfs error: Could not open local file '%s'\n", localname);
+		bmfs_volume_lockextent(volume, entry, BMFS_UNLOCK);
+		return 1;
+	}
+	if (left != 0 && (src = bmfs_disk_map(offset, left)) != NULL)
+	{
+		ret = (fwrite(src, left, 1, tfile) != 1);
+	}
+	else if ((ret = bmfs_kernel_copy(bmfs_disk_fd(), offset, bmfs_host_fd(tfile), 0, left)) < 0)
+	{
+		ret = 0;
+		if (*buffer == NULL && (*buffer = bmfs_buffer_alloc(blockSize)) == NULL)
+		{
+			printf("bmfs error: Unable to allocate enough memory for buffer.\n");
+			ret = 1;
+		}
+		while (left != 0 && ret == 0)
+		{
+			chunk = (left < blockSize) ? (size_t)left : blockSize;
+			// Read whole sectors if the backend needs aligned I/O
+			if (bmfs_disk_read(*buffer, (chunk + bmfs_disk_align() - 1) / bmfs_disk_align() * bmfs_disk_align(), offset) != 0 || fwrite(*buffer, chunk, 1, tfile) != 1)
+				ret = 1;
+			offset += chunk;
+			left -= chunk;
+		}
+	}
+	if (fclose(tfile) != 0)
+		ret = 1;
+	bmfs_volume_lockextent(volume, entry, BMFS_UNLOCK);
+	if (ret != 0)
+		printf("bmfs error: Could not extract '%s'\n", entry->FileName);
+	return ret;
+}
+
+
+// Take files in disk order until none are left. Files that fail are marked
+// deleted in the entry list.
+static void *bulk_worker(void *arg)
+{
+	struct BMFSBulk *x = arg;
+	char *buffer = NULL;
+	char localname[4096];
+	int i, ret;
+
+	for (;;)
+	{
+#ifdef BMFS_THREADS
+		pthread_mutex_lock(&x->lock);
+#endif
+		i = x->next++;
+#ifdef BMFS_THREADS
+		pthread_mutex_unlock(&x->lock);
+#endif
+		if (i >= x->count)
+			break;
+		if (x->localnames != NULL)
+			snprintf(localname, sizeof(localname), "%s", x->localnames[i]);
+		else
+			snprintf(localname, sizeof(localname), "%s/%s", x->dir, x->entries[i].FileName);
+		if (x->localnames == NULL && !bmfs_name_valid(x->entries[i].FileName))
+		{
+			// Written by another tool, it would land outside x->dir
+			printf("bmfs error: Skipping '%s', not a valid local file name\n", x->entries[i].FileName);
+			ret = 1;
+		}
+		else if (x->todisk)
+			ret = bmfs_import(&x->entries[i], localname, &buffer);
+		else
+			ret = bmfs_extract(&x->entries[i], localname, &buffer);
+		if (ret != 0)
+		{
+#ifdef BMFS_THREADS
+			pthread_mutex_lock(&x->lock);
+#endif
+			x->failed++;
+			x->entries[i].FileName[0] = 0x01;
+#ifdef BMFS_THREADS
+			pthread_mutex_unlock(&x->lock);
+#endif
+		}
+	}
+	if (buffer != NULL)
+		bmfs_buffer_free(buffer, blockSize);
+	return NULL;
+}
+
+
+// Copy the files in x with a pool of jobs workers. Returns the number of
+// files that failed.
+static int bulk_run(struct BMFSBulk *x)
+{
+	unsigned int i, started = 0;
+#ifdef BMFS_THREADS
+	pthread_t workers[64];
+
+	pthread_mutex_init(&x->lock, NULL);
+	diskshared = (x->todisk && jobs > 1 && x->count > 1);
+	for (i = 0; i < jobs && i < (unsigned int)x->count; i++)
+		if (pthread_create(&workers[started], NULL, bulk_worker, x) == 0)
+			started++;
+#endif
+	if (started == 0)					// No threads, copy everything here
+		bulk_worker(x);
+#ifdef BMFS_THREADS
+	for (i = 0; i < started; i++)
+		pthread_join(workers[i], NULL);
+	pthread_mutex_destroy(&x->lock);
+	diskshared = 0;
+#endif
+	(void)i;
+	return x->failed;
+}
+
+
+// Extract every file into dirname. The files are handed to a pool of jobs
+// workers sorted by starting block so the disk is read front to back.
+// Returns 0 if every file was extracted.
+int bmfs_extract_all(char *dirname)
+{
+	struct BMFSBulk x;
+	char dir_copy[4096];
+
+	if (dirname == NULL)
+		dirname = ".";
+#if defined(BMFS_POSIX)
+	mkdir(dirname, 0777);					// May already exist
+#elif defined(_WIN32)
+	_mkdir(dirname);
+#endif
+
+	// Sort a copy of the directory, deleted entries go to the end
+	memcpy(dir_copy, Directory, 4096);
+	memset(&x, 0, sizeof(x));
+	x.entries = (struct BMFSEntry *)dir_copy;
+	x.dir = dirname;
+	while (x.count < 64 && x.entries[x.count].FileName[0] != 0x00)
+		x.count++;
+	qsort(dir_copy, x.count, 64, bmfs_entry_cmp);
+	while (x.count > 0 && x.entries[x.count-1].FileName[0] == 0x01)
+		x.count--;
+
+	return (bulk_run(&x) != 0);
+}
+
+
+// Copy a local file to the blocks already reserved for entry, zero filling
+// the last block. Thread safe in the same way as bmfs_extract.
+int bmfs_import(struct BMFSEntry *entry, const char *localname, char **buffer)
+{
+	FILE *tfile;
+	u64 offset = entry->StartingBlock*blockSize;
+	u64 left = entry->FileSize;
+	u64 padded = (left + blockSize - 1) / blockSize * blockSize;
+	size_t chunk;
+	char *dst;
+	int ret;
+
+	if ((tfile = fopen(localname, "rb")) == NULL)
+	{
+		printf("bmfs error: Could not open local file '%s'\n", localname);
+		return 1;
+	}
+	if (volume != NULL)					// build writes the image before it is a volume
+		bmfs_volume_lockextent(volume, entry, BMFS_EXCLUSIVE);
+	if (padded != 0 && (dst = bmfs_disk_map(offset, padded)) != NULL)
+	{
+		ret = (left != 0 && fread(dst, left, 1, tfile) != 1);
+		memset(dst+left, 0, padded-left);			// 0 the rest of the last block
+	}
+	else if ((ret = bmfs_kernel_copy(bmfs_host_fd(tfile), 0, bmfs_disk_fd(), offset, left)) >= 0)
+	{
+		if (ret == 0)
+			ret = bmfs_disk_zero(offset+left, padded-left);	// 0 the rest of the last block
+	}
+	else
+	{
+		ret = 0;
+		if (*buffer == NULL && (*buffer = bmfs_buffer_alloc(blockSize)) == NULL)
+		{
+			printf("bmfs error: Unable to allocate enough memory for buffer.\n");
+			ret = 1;
+		}
+		while (left != 0 && ret == 0)
+		{
+			chunk = (left < blockSize) ? (size_t)left : blockSize;
+			if (fread(*buffer, chunk, 1, tfile) != 1)
+				ret = 1;
+			memset(*buffer+chunk, 0, blockSize-chunk);	// 0 the rest of the buffer
+			if (ret == 0 && bmfs_disk_write(*buffer, blockSize, offset) != 0)
+				ret = 1;
+			offset += chunk;
+			left -= chunk;
+		}
+	}
+	fclose(tfile);
+	if (volume != NULL)
+		bmfs_volume_lockextent(volume, entry, BMFS_UNLOCK);
+	if (ret != 0)
+		printf("bmfs error: Could not import '%s'\n", localname);
+	return ret;
+}
+
+
+static int import_namecmp(const void *pa, const void *pb)
+{
+	return strcmp(*(char * const *)pa, *(char * const *)pb);
+}
+
+
+// Collect up to max local file names from a directory, or from a list file
+// with one name per line ('-' for standard input). Returns the number of
+// names, or -1 on error.
+static int import_list(const char *source, char *localnames[], int max)
+{
+	char line[4096];
+	FILE *list;
+	size_t len;
+	int count = 0;
+#ifdef BMFS_POSIX
+	struct stat st;
+	struct dirent *de;
+	DIR *dir;
+
+	if (stat(source, &st) == 0 && S_ISDIR(st.st_mode))
+	{
+		if ((dir = opendir(source)) == NULL)
+		{
+			printf("bmfs error: Could not open local directory '%s'\n", source);
+			return -1;
+		}
+		while ((de = readdir(dir)) != NULL && count <= max)
+		{
+			snprintf(line, sizeof(line), "%s/%s", source, de->d_name);
+			if (stat(line, &st) != 0 || !S_ISREG(st.st_mode))
+				continue;
+			if (count < max && (localnames[count] = malloc(strlen(line) + 1)) != NULL)
+				strcpy(localnames[count], line);
+			count++;
+		}
+		closedir(dir);
+		if (count > max)
+		{
+			printf("bmfs error: More than %d files in '%s'\n", max, source);
+			while (max > 0)
+				free(localnames[--max]);
+			return -1;
+		}
+		qsort(localnames, count, sizeof(char *), import_namecmp);
+		return count;
+	}
+#endif
+	if (strcmp(source, "-") == 0)
+		list = stdin;
+	else
+		list = fopen(source, "r");
+	if (list == NULL)
+	{
+		printf("bmfs error: Could not open file list '%s'\n", source);
+		return -1;
+	}
+	while (fgets(line, sizeof(line), list) != NULL)
+	{
+		len = strcspn(line, "\r\n");
+		line[len] = 0;
+		if (len == 0 || line[0] == '#')
+			continue;
+		if (count == max)
+		{
+			printf("bmfs error: More than %d files in '%s'\n", max, source);
+			while (count > 0)
+				free(localnames[--count]);
+			count = -1;
+			break;
+		}
+		if ((localnames[count] = malloc(len + 1)) != NULL)
+			strcpy(localnames[count++], line);
+	}
+	if (list != stdin)
+		fclose(list);
+	return count;
+}
+
+
+// Import many local files at once. Space for every file is planned first
+// from the free extents between the existing files, nothing is written
+// unless everything fits. The files are added empty in one locked step, the
+// data is then copied by a pool of jobs workers in ascending block order
+// with only the blocks of each file locked, and the lengths are recorded in
+// a second locked step.
+// BMFS file names are the local names without their directory. Returns 0 if
+// every file was imported.
+int bmfs_import_dir(char *source)
+{
+	struct BMFSBulk x;
+	struct BMFSEntry planned[64], *pEntry;
+	struct BMFSEntry tempentry;
+	char *localnames[64], *sortednames[64];
+	char dir_copy[4096];
+	u64 extstart[65], extlen[65], blocks;
+	unsigned long long num_blocks = disksize / 2;	// number of blocks in the disk
+	unsigned long long prev_file_end = 1;
+	FILE *tfile;
+	char *name;
+	int nfiles, nused = 0, nfree = 0, next = 0, slot;
+	int i, j, ret = 0;
+
+	if (source == NULL)
+	{
+		printf("bmfs error: Local directory or file list not specified.\n");
+		return 1;
+	}
+	if ((nfiles = import_list(source, localnames, 64)) < 0)
+		return 1;
+	bmfs_volume_lock(volume);
+	for (i = 0; i < 64; i++)				// Count the free directory entries
+	{
+		pEntry = (struct BMFSEntry *)(Directory + i * 64);
+		if (pEntry->FileName[0] == 0x00)		// End of directory, the rest is free
+		{
+			nfree += 64 - i;
+			break;
+		}
+		if (pEntry->FileName[0] == 0x01)
+			nfree++;
+		nused++;
+	}
+	if (nfiles > nfree)
+	{
+		printf("bmfs error: More than %d files in '%s'\n", nfree, source);
+		ret = 1;
+	}
+
+	// Build the list of free extents from a sorted copy of the directory
+	memcpy(dir_copy, Directory, 4096);
+	qsort(dir_copy, nused, 64, bmfs_entry_cmp);
+	for (i = 0; i < nused; i++)
+	{
+		pEntry = (struct BMFSEntry *)(dir_copy + i * 64);
+		if (pEntry->FileName[0] == 0x01)		// Deleted entries are sorted last
+			break;
+		if (pEntry->StartingBlock > prev_file_end)
+		{
+			extstart[next] = prev_file_end;
+			extlen[next++] = pEntry->StartingBlock - prev_file_end;
+		}
+		prev_file_end = pEntry->StartingBlock + pEntry->ReservedBlocks;
+	}
+	if (num_blocks - 1 > prev_file_end)			// Up to the last block
+	{
+		extstart[next] = prev_file_end;
+		extlen[next++] = num_blocks - 1 - prev_file_end;
+	}
+
+	// Plan every file, keeping the plan sorted by starting block
+	for (i = 0; i < nfiles && ret == 0; i++)
+	{
+		name = localnames[i] + strlen(localnames[i]);
+		while (name > localnames[i] && name[-1] != '/' && name[-1] != '\\')
+			name--;
+		for (j = 0; j < i && strcmp(planned[j].FileName, name) != 0; j++)
+			;
+		if (!bmfs_name_valid(name))
+		{
+			printf("bmfs error: Invalid BMFS file name for '%s'\n", localnames[i]);
+			ret = 1;
+		}
+		else if (j < i || bmfs_find(name, &tempentry, &slot) != 0)
+		{
+			printf("bmfs error: File '%s' already exists.\n", name);
+			ret = 1;
+		}
+		else if ((tfile = fopen(localnames[i], "rb")) == NULL)
+		{
+			printf("bmfs error: Could not open local file '%s'\n", localnames[i]);
+			ret = 1;
+		}
+		else
+		{
+			memset(&tempentry, 0, sizeof(tempentry));
+			strcpy(tempentry.FileName, name);
+			fseek(tfile, 0, SEEK_END);
+			tempentry.FileSize = ftell(tfile);
+			fclose(tfile);
+			// Reserve the same space bmfs_write would
+			blocks = (tempentry.FileSize < blockSize) ? 1 : (tempentry.FileSize / 1048576 + 2) / 2;
+			for (j = 0; j < next && extlen[j] < blocks; j++)	// First fit
+				;
+			if (j == next)
 			{
-				printf("bmfs error: Invalid disk size string: '%s'\n", size);
+				printf("bmfs error: Not enough free space for '%s'.\n", name);
 				ret = 1;
 			}
+			else
+			{
+				tempentry.StartingBlock = extstart[j];
+				tempentry.ReservedBlocks = blocks;
+				extstart[j] += blocks;
+				extlen[j] -= blocks;
+				for (j = i; j > 0 && planned[j-1].StartingBlock > tempentry.StartingBlock; j--)
+				{
+					planned[j] = planned[j-1];
+					sortednames[j] = sortednames[j-1];
+				}
+				planned[j] = tempentry;
+				sortednames[j] = localnames[i];
+			}
+		}
+	}
+
+	// Add the files, still empty, to free directory entries
+	if (ret == 0)
+	{
+		for (i = 0, slot = 0; i < nfiles; i++)
+		{
+			while (Directory[slot * 64] != 0x00 && Directory[slot * 64] != 0x01)
+				slot++;
+			if (Directory[slot * 64] == 0x00 && slot + 1 < 64)
+				Directory[(slot + 1) * 64] = 0x00;	// Keep the end of directory marker
+			memcpy(Directory + slot * 64, &planned[i], 64);
+			memset(Directory + slot * 64 + 48, 0, 8);	// The length is set once the data is there
+		}
+		if (nfiles != 0)
+			bmfs_flush_directory();
+	}
+	bmfs_volume_unlock(volume);
+
+	if (ret == 0 && nfiles != 0)
+	{
+		memset(&x, 0, sizeof(x));
+		x.entries = planned;
+		x.localnames = sortednames;
+		x.count = nfiles;
+		x.todisk = 1;
+		ret = (bulk_run(&x) != 0);
+
+		// Record the lengths, and remove the files that could not be copied
+		bmfs_volume_lock(volume);
+		for (i = 0; i < nfiles; i++)
+		{
+			for (slot = 0; slot < 64 && Directory[slot * 64] != 0x00; slot++)
+			{
+				pEntry = (struct BMFSEntry *)(Directory + slot * 64);
+				if (pEntry->FileName[0] == 0x01 || pEntry->StartingBlock != planned[i].StartingBlock)
+					continue;
+				if (planned[i].FileName[0] == 0x01)	// Failed, marked by the worker
+					pEntry->FileName[0] = 0x01;
+				else
+					pEntry->FileSize = planned[i].FileSize;
+				break;
+			}
 		}
+		bmfs_flush_directory();
+		bmfs_volume_unlock(volume);
+	}
+
+	for (i = 0; i < nfiles; i++)
+		free(localnames[i]);
+	return ret;
+}
+
+
+void bmfs_delete(char *filename)
+{
+	if (bmfs_volume_delete(volume, filename) == BMFS_ENOTFOUND)
+	{
+		printf("bmfs error: File not found in BMFS.\n");
+	}
+}
+
+
+// Write the directory to disk, or only note the change in batch mode
+void bmfs_flush_directory(void)
+{
+	bmfs_volume_commit(volume, -1);
+}
+
+
+// Split a command line into at most max words. Returns the number of words,
+// or -1 if there are more than max.
+int bmfs_split(char *line, char *args[], int max)
+{
+	int nargs = 0;
+	char *word = strtok(line, " \t\r\n");
+
+	while (word != NULL)
+	{
+		if (nargs == max)
+			return -1;
+		args[nargs++] = word;
+		word = strtok(NULL, " \t\r\n");
 	}
+	return nargs;
+}
 
-	// Adjust the disk size if a unit indicator was given.  Note that an
-	// input of something like "0" or "0K" will get past the checks above.
-	if (ret == 0 && diskSize > 0 && diskSizeFactor > 0)
+
+// Run one list, create, write, read or delete command for batch and shell
+// mode. where is appended to error messages to locate the command. Returns 0
+// if the command was understood.
+int bmfs_command(int nargs, char *args[], const char *where, int stdinbusy)
+{
+	unsigned long long size;
+
+	if (strcasecmp(s_list, args[0]) == 0)
 	{
-		while (diskSizeFactor--)
+		bmfs_list();
+	}
+	else if (strcasecmp(s_create, args[0]) != 0 && strcasecmp(s_read, args[0]) != 0 && strcasecmp(s_write, args[0]) != 0 && strcasecmp(s_delete, args[0]) != 0)
+	{
+		printf("bmfs error: Unknown command '%s'%s\n", args[0], where);
+		return 1;
+	}
+	else if (nargs < 2)
+	{
+		printf("bmfs error: File name not specified%s\n", where);
+		return 1;
+	}
+	else if (strcasecmp(s_create, args[0]) == 0)
+	{
+		size = (nargs > 2) ? strtoull(args[2], NULL, 10) : 0;
+		if (size < 1)
 		{
-			if (diskSize * 1024 > diskSize ) // Make sure we don't overflow
-			{
-				diskSize *= 1024;
-			}
-			else
-			{
-				printf("bmfs error: Disk size is too large\n");
-				ret = 1;
-			}
+			printf("bmfs error: Invalid file size%s\n", where);
+			return 1;
 		}
+		bmfs_create(args[1], size);
 	}
-
-	// Make sure the disk size is large enough.
-	if (ret == 0)
+	else if (strcasecmp(s_read, args[0]) == 0)
 	{
-		if (diskSize < minimumDiskSize)
+		bmfs_read(args[1], (nargs > 2) ? args[2] : NULL);
+	}
+	else if (strcasecmp(s_write, args[0]) == 0)
+	{
+		if (stdinbusy && nargs > 2 && strcmp(args[2], "-") == 0)
 		{
-			printf("bmfs error: Disk size must be at least %d bytes (%dMiB)\n", minimumDiskSize, minimumDiskSize / (1024*1024));
-			ret = 1;
+			printf("bmfs error: Standard input is in use for commands%s\n", where);
+			return 1;
 		}
+		bmfs_write(args[1], (nargs > 2) ? args[2] : NULL);
 	}
+	else
+	{
+		bmfs_delete(args[1]);
+	}
+	return 0;
+}
 
-	// Open the Master boot Record file for reading.
-	if (ret == 0 && mbr != NULL)
+
+// Is the next line of script on hand, so reading it does not wait? A
+// script that is not a regular file is read unbuffered to be able to tell.
+static int batch_ready(FILE *script)
+{
+#ifdef BMFS_POSIX
+	struct pollfd p;
+	struct stat st;
+
+	if (fstat(fileno(script), &st) == 0 && S_ISREG(st.st_mode))
+		return 1;
+	p.fd = fileno(script);
+	p.events = POLLIN;
+	return (poll(&p, 1, 0) == 1);
+#else
+	return (script != stdin);
+#endif
+}
+
+
+// Run list, create, write, read and delete commands from a script, one per
+// line with the same arguments as on the command line. Blank lines and lines
+// starting with '#' are skipped. The disk stays open and the directory is
+// kept in memory: each run of create, delete and list commands works on it
+// with the directory locked once, and writes it once at the end of the run.
+// The directory is let go of for reads and writes, which wait for the files'
+// blocks, and while the script is waited for. Returns 0 if every line was
+// understood.
+int bmfs_batch(char *scriptname)
+{
+	FILE *script;
+	char line[1024], where[32];
+	char *args[3];
+	int lineno = 0, nargs, dironly, deferred = 0, ret = 0;
+#ifdef BMFS_POSIX
+	struct stat st;
+#endif
+
+	if (scriptname == NULL || strcmp(scriptname, "-") == 0)
+		script = stdin;
+	else
+		script = fopen(scriptname, "r");
+	if (script == NULL)
 	{
-		mbrFile = fopen(mbr, "rb");
-		if (mbrFile == NULL )
-		{
-			printf("bmfs error: Unable to open MBR file '%s'\n", mbr);
-			ret = 1;
-		}
+		printf("bmfs error: Could not open batch file '%s'\n", scriptname);
+		return 1;
 	}
 
-	// Open the boot loader file for reading.
-	if (ret == 0 && boot != NULL)
+#ifdef BMFS_POSIX
+	if (fstat(fileno(script), &st) != 0 || !S_ISREG(st.st_mode))
+		setvbuf(script, NULL, _IONBF, 0);		// So batch_ready sees what is left
+#endif
+	for (;;)
 	{
-		bootFile = fopen(boot, "rb");
-		if (bootFile == NULL )
+		if (deferred && !batch_ready(script))
 		{
-			printf("bmfs error: Unable to open %s file '%s'\n", bootFileType, boot);
+			bmfs_volume_defer(volume, 0);		// Not locked while waiting
+			deferred = 0;
+		}
+		if (fgets(line, sizeof(line), script) == NULL)
+			break;
+		lineno++;
+		sprintf(where, " on line %d", lineno);
+		nargs = bmfs_split(line, args, 3);
+		if (nargs == 0 || args[0][0] == '#')	// args[0] is set even if there are too many
+			continue;
+		dironly = (strcasecmp(s_create, args[0]) == 0 || strcasecmp(s_delete, args[0]) == 0 || strcasecmp(s_list, args[0]) == 0);
+		if (dironly != deferred)
+		{
+			bmfs_volume_defer(volume, dironly);
+			deferred = dironly;
+		}
+		if (nargs < 0)
+		{
+			printf("bmfs error: Too many arguments%s\n", where);
 			ret = 1;
 		}
-	}
-
-	// Open the kernel file for reading.
-	if (ret == 0 && kernel != NULL)
-	{
-		kernelFile = fopen(kernel, "rb");
-		if (kernelFile == NULL )
+		else if (bmfs_command(nargs, args, where, script == stdin) != 0)
 		{
-			printf("bmfs error: Unable to open kernel file '%s'\n", kernel);
 			ret = 1;
 		}
 	}
+	if (deferred)
+		bmfs_volume_defer(volume, 0);
 
-	// Allocate buffer to use for filling the disk image with zeros.
-	if (ret == 0)
+	if (script != stdin)
+		fclose(script);
+	return ret;
+}
+
+
+// The shell works on a copy of the directory, shell_view, through a volume
+// of its own whose directory reads and writes go to the copy. Creates and
+// deletes change only the copy and are noted in shell_changes, to be applied
+// to the disk by shell_commit.
+struct ShellChange
+{
+	char FileName[32];
+	u64 ReservedBlocks;
+	int create;
+};
+
+static char shell_view[4096];
+static struct ShellChange shell_changes[64];
+static int shell_nchanges = 0;
+
+static int view_io_read(void *ctx, void *buf, size_t len, u64 offset)
+{
+	if (offset >= 4096 && offset + len <= 8192)
 	{
-		buffer = (char *) malloc(bufferSize);
-		if (buffer == NULL)
-		{
-			printf("bmfs error: Failed to allocate buffer\n");
-			ret = 1;
-		}
+		memcpy(buf, shell_view + offset - 4096, len);
+		return 0;
 	}
+	return disk_io_read(ctx, buf, len, offset);
+}
 
-	// Open the disk image file for writing.  This will truncate the disk file
-	// if it already exists, so we should do this only after we're ready to
-	// actually write to the file.
-	if (ret == 0)
+static int view_io_write(void *ctx, const void *buf, size_t len, u64 offset)
+{
+	if (offset >= 4096 && offset + len <= 8192)
+	{
+		memcpy(shell_view + offset - 4096, buf, len);
+		return 0;
+	}
+	(void)ctx;
+	return 1;						// Nothing but the directory changes before commit
+}
+
+static const struct BMFSVolumeIO shell_view_io = { view_io_read, view_io_write, disk_io_size, NULL, NULL };
+
+
+// Load the directory from the disk into the shell's copy
+static void shell_refresh(void)
+{
+	bmfs_volume_lock(volume);
+	memcpy(shell_view, Directory, 4096);
+	bmfs_volume_unlock(volume);
+}
+
+
+// Apply the noted creates and deletes to the disk, in order, with the
+// directory locked and reloaded so changes by other processes are kept.
+static void shell_commit(void)
+{
+	int i;
+
+	if (shell_nchanges == 0)
+		return;
+	bmfs_volume_defer(volume, 1);
+	for (i = 0; i < shell_nchanges; i++)
+	{
+		if (shell_changes[i].create)
+			bmfs_create(shell_changes[i].FileName, shell_changes[i].ReservedBlocks * 2);
+		else
+			bmfs_delete(shell_changes[i].FileName);
+	}
+	bmfs_volume_defer(volume, 0);
+	shell_nchanges = 0;
+}
+
+
+// Run list, create or delete on the shell's copy of the directory and note
+// the change it made
+static void shell_change(BMFSVolume *view, int nargs, char *args[])
+{
+	BMFSVolume *diskvolume = volume;
+	char *diskdirectory = Directory;
+	char before[4096];
+	struct ShellChange *change;
+	struct BMFSEntry entry;
+
+	if (shell_nchanges == 64)
+		shell_commit();
+	memcpy(before, shell_view, 4096);
+	volume = view;
+	Directory = bmfs_volume_directory(view);
+	bmfs_command(nargs, args, "", 1);
+	volume = diskvolume;
+	Directory = diskdirectory;
+	if (memcmp(before, shell_view, 4096) == 0)
+		return;
+
+	change = &shell_changes[shell_nchanges++];
+	memset(change, 0, sizeof(*change));
+	strncpy(change->FileName, args[1], 31);
+	change->create = (strcasecmp(s_create, args[0]) == 0);
+	if (change->create && bmfs_volume_find(view, args[1], &entry, NULL) == BMFS_OK)
+		change->ReservedBlocks = entry.ReservedBlocks;
+}
+
+
+#ifdef BMFS_POSIX
+// Complete the last word of line: commands for the first word, BMFS file
+// names after a command that takes one. A unique match is finished with a
+// space, otherwise the common prefix is added and the choices are listed.
+static void shell_complete(char *line, size_t *len, size_t max)
+{
+	static const char *verbs[] = { "list", "create", "read", "write", "delete", "commit", "help", "exit" };
+	const char *match[64];
+	char *word = line + *len;
+	int nmatch = 0, nwords = 0, i;
+	size_t wordlen, common;
+	struct BMFSEntry *pEntry;
+
+	while (word > line && word[-1] != ' ')
+		word--;
+	wordlen = line + *len - word;
+	for (i = 0; line + i < word; i++)
+		if (line[i] != ' ' && (i == 0 || line[i-1] == ' '))
+			nwords++;
+
+	if (nwords == 0)
+	{
+		for (i = 0; i < 8; i++)
+			if (strncasecmp(verbs[i], word, wordlen) == 0)
+				match[nmatch++] = verbs[i];
+	}
+	else if (nwords == 1 && (strncasecmp(line, "create ", 7) == 0 || strncasecmp(line, "read ", 5) == 0 || strncasecmp(line, "write ", 6) == 0 || strncasecmp(line, "delete ", 7) == 0))
 	{
-		disk = fopen(diskname, "wb");
-		if (disk == NULL)
+		for (i = 0; i < 64; i++)
 		{
-			printf("bmfs error: Unable to open disk '%s'\n", diskname);
-			ret = 1;
+			pEntry = (struct BMFSEntry *)(shell_view + i * 64);
+			if (pEntry->FileName[0] == 0x00)		// End of directory
+				break;
+			if (pEntry->FileName[0] != 0x01 && strncmp(pEntry->FileName, word, wordlen) == 0)
+				match[nmatch++] = pEntry->FileName;
 		}
 	}
+	if (nmatch == 0)
+		return;
 
-	// Fill the disk image with zeros.
-	if (ret == 0)
+	common = strlen(match[0]);
+	for (i = 1; i < nmatch; i++)
+		while (common > wordlen && strncmp(match[0], match[i], common) != 0)
+			common--;
+	while (wordlen < common && *len + 1 < max)
 	{
-		double percent;
-		memset(buffer, 0, bufferSize);
-		writeSize = 0;
-		while (writeSize < diskSize)
+		line[(*len)++] = match[0][wordlen];
+		putchar(match[0][wordlen++]);
+	}
+	if (nmatch == 1 && *len + 1 < max)
+	{
+		line[(*len)++] = ' ';
+		putchar(' ');
+	}
+	else if (nmatch > 1)
+	{
+		putchar('\n');
+		for (i = 0; i < nmatch; i++)
+			printf("%s  ", match[i]);
+		line[*len] = 0;
+		printf("\nbmfs> %s", line);
+	}
+	fflush(stdout);
+}
+
+
+// Read a line from the terminal with tab completion. Returns NULL at the end
+// of input (Ctrl-D on an empty line).
+static char *shell_readline(char *line, size_t max)
+{
+	struct termios saved, raw;
+	size_t len = 0;
+	int c;
+
+	printf("bmfs> ");
+	fflush(stdout);
+	if (!isatty(STDIN_FILENO) || tcgetattr(STDIN_FILENO, &saved) != 0)
+		return fgets(line, max, stdin);
+
+	raw = saved;
+	raw.c_lflag &= ~(ICANON | ECHO | ISIG);
+	raw.c_cc[VMIN] = 1;
+	raw.c_cc[VTIME] = 0;
+	tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw);
+	for (;;)
+	{
+		c = getchar();
+		if (c == EOF || (c == 4 && len == 0))		// Ctrl-D
 		{
-			percent = writeSize;
-			percent /= diskSize;
-			percent *= 100;
-			printf("Formatting disk: %llu of %llu bytes (%.0f%%)...\r", writeSize, diskSize, percent);
-			chunkSize = bufferSize;
-			if (chunkSize > diskSize - writeSize)
-			{
-				chunkSize = diskSize - writeSize;
-			}
-			if (fwrite(buffer, chunkSize, 1, disk) != 1)
-			{
-				printf("bmfs error: Failed to write disk '%s'\n", diskname);
-				ret = 1;
-				break;
-			}
-			writeSize += chunkSize;
+			putchar('\n');
+			line = NULL;
+			break;
 		}
-		if (ret == 0)
+		else if (c == '\r' || c == '\n')
 		{
-			printf("Formatting disk: %llu of %llu bytes (100%%)%9s\n", writeSize, diskSize, "");
+			putchar('\n');
+			break;
+		}
+		else if (c == 3)				// Ctrl-C discards the line
+		{
+			printf("^C\nbmfs> ");
+			len = 0;
+		}
+		else if (c == '\t')
+		{
+			line[len] = 0;
+			shell_complete(line, &len, max);
+		}
+		else if ((c == 127 || c == 8) && len != 0)	// Backspace
+		{
+			len--;
+			printf("\b \b");
+		}
+		else if (isprint(c) && len + 1 < max)
+		{
+			line[len++] = c;
+			putchar(c);
 		}
+		fflush(stdout);
 	}
+	tcsetattr(STDIN_FILENO, TCSAFLUSH, &saved);
+	if (line != NULL)
+		line[len] = 0;
+	return line;
+}
+#else
+static char *shell_readline(char *line, size_t max)
+{
+	printf("bmfs> ");
+	fflush(stdout);
+	return fgets(line, max, stdin);
+}
+#endif
 
-	// Format the disk.
-	if (ret == 0)
+
+// Interactive shell. The disk stays open between commands and the directory
+// is kept in memory: create and delete change the shell's copy, and list and
+// tab completion show it, until commit or exit writes the changes. They are
+// applied with the directory locked and reloaded, so files created or
+// deleted by other processes in the meantime are kept. read and write commit
+// first and work on the disk. The directory is never locked while the shell
+// waits for input.
+int bmfs_shell(void)
+{
+	BMFSVolume *view;
+	char line[1024];
+	char *args[3];
+	int nargs, error;
+
+	shell_refresh();
+	if ((view = bmfs_volume_attach(&shell_view_io, disk, BMFS_NOCHECK, &error)) == NULL)
 	{
-		rewind(disk);
-		bmfs_format();
+		printf("bmfs error: %s\n", bmfs_strerror(error));
+		return 1;
 	}
-
-	// Write the master boot record if it was specified by the caller.
-	if (ret == 0 && mbrFile != NULL)
+	for (;;)
 	{
-		fseek(disk, 0, SEEK_SET);
-		if (fread(buffer, 512, 1, mbrFile) == 1)
+		if (shell_nchanges == 0)
+			shell_refresh();				// Nothing of ours to keep, show the disk
+		if (shell_readline(line, sizeof(line)) == NULL)
+			break;
+		nargs = bmfs_split(line, args, 3);
+		if (nargs == 0)
+			continue;
+		if (nargs < 0)
 		{
-			if (fwrite(buffer, 512, 1, disk) != 1)
-			{
-				printf("bmfs error: Failed to write disk '%s'\n", diskname);
-				ret = 1;
-			}
+			printf("bmfs error: Too many arguments\n");
+		}
+		else if (strcasecmp(args[0], "exit") == 0 || strcasecmp(args[0], "quit") == 0)
+		{
+			break;
+		}
+		else if (strcasecmp(args[0], "commit") == 0)
+		{
+			shell_commit();
+		}
+		else if (strcasecmp(args[0], "help") == 0)
+		{
+			printf("list, create file size, read file [local], write file [local], delete file\n");
+			printf("commit writes creates and deletes to the disk, exit commits and quits\n");
+		}
+		else if (strcasecmp(s_list, args[0]) == 0 || strcasecmp(s_create, args[0]) == 0 || strcasecmp(s_delete, args[0]) == 0)
+		{
+			shell_change(view, nargs, args);
 		}
 		else
 		{
-			printf("bmfs error: Failed to read file '%s'\n", mbr);
-			ret = 1;
+			shell_commit();
+			bmfs_command(nargs, args, "", 1);
 		}
 	}
+	shell_commit();
+	bmfs_volume_close(view);
+	return 0;
+}
 
-	// Write the boot loader if it was specified by the caller.
-	if (ret == 0 && bootFile != NULL)
+
+// Match name against a shell-style pattern: * matches any run of characters,
+// ? any one character and [...] any in the set, where a-z is a range and a
+// leading ! or ^ negates the set. Returns 1 on a match.
+int bmfs_match(const char *pattern, const char *name)
+{
+	const char *star = NULL, *resume = NULL, *next, *close;
+	int found, negate;
+
+	while (*name != 0)
 	{
-		fseek(disk, 8192, SEEK_SET);
-		for (;;)
+		next = pattern + 1;
+		if (*pattern == '*')
 		{
-			chunkSize = fread( buffer, 1, bufferSize, bootFile);
-			if (chunkSize > 0)
+			star = pattern = next;
+			resume = name;
+			continue;
+		}
+		negate = (*pattern == '[' && (*next == '!' || *next == '^'));
+		if (*pattern == '?')
+		{
+			found = 1;
+		}
+		else if (*pattern == '[' && next[negate] != 0 && (close = strchr(next + negate + 1, ']')) != NULL)
+		{
+			// A ] straight after the [ is part of the set
+			found = 0;
+			for (next += negate; next < close; next++)
 			{
-				if (fwrite(buffer, chunkSize, 1, disk) != 1)
+				if (next[1] == '-' && next + 2 < close)
 				{
-					printf("bmfs error: Failed to write disk '%s'\n", diskname);
-					ret = 1;
+					if ((unsigned char)*name >= (unsigned char)next[0] && (unsigned char)*name <= (unsigned char)next[2])
+						found = 1;
+					next += 2;
 				}
-			}
-			else
-			{
-				if (ferror(disk))
+				else if (*name == *next)
 				{
-					printf("bmfs error: Failed to read file '%s'\n", boot);
-					ret = 1;
+					found = 1;
 				}
-				break;
 			}
+			found ^= negate;
+			next = close + 1;
+		}
+		else
+		{
+			found = (*pattern == *name);
+		}
+
+		if (found)
+		{
+			pattern = next;
+			name++;
+		}
+		else if (star != NULL)				// Let the last * take one more
+		{
+			pattern = star;
+			name = ++resume;
+		}
+		else
+		{
+			return 0;
+		}
+	}
+	while (*pattern == '*')
+		pattern++;
+	return (*pattern == 0);
+}
+
+
+// Write the local files of the entries in files, which are sorted by
+// starting block, each under its own name. Sizes are checked against the
+// reservations first, then the data is copied by a pool of jobs workers
+// with the directory free, and the new sizes are recorded together at the
+// end.
+// Returns 0 if every file was written.
+static int bmfs_multi_write(struct BMFSEntry *files, int count)
+{
+	struct BMFSBulk x;
+	struct BMFSEntry tempentry;
+	char *localnames[64];
+	FILE *tfile;
+	int i, slot, n = 0, ret = 0;
+
+	memset(&x, 0, sizeof(x));
+	x.entries = files;
+	x.localnames = localnames;
+	x.todisk = 1;
+	for (i = 0; i < count; i++)
+	{
+		if ((tfile = fopen(files[i].FileName, "rb")) == NULL)
+		{
+			printf("bmfs error: Could not open local file '%s'\n", files[i].FileName);
+			ret = 1;
+			continue;
+		}
+		fseek(tfile, 0, SEEK_END);
+		files[i].FileSize = ftell(tfile);
+		fclose(tfile);
+		if (files[i].ReservedBlocks*blockSize < files[i].FileSize)
+		{
+			printf("bmfs error: Not enough reserved space in BMFS for '%s'.\n", files[i].FileName);
+			ret = 1;
+			continue;
 		}
+		files[n] = files[i];					// Keep the ones that fit, in order
+		n++;
+	}
+	for (i = 0; i < n; i++)
+		localnames[i] = files[i].FileName;
+	x.count = n;
+	if (bulk_run(&x) != 0)
+		ret = 1;
+
+	// Record the sizes of the files that were written, all in one step. A
+	// file that was deleted or moved meanwhile is left alone.
+	bmfs_volume_lock(volume);
+	for (i = 0; i < n; i++)
+	{
+		if (files[i].FileName[0] != 0x01 && bmfs_find(files[i].FileName, &tempentry, &slot) && tempentry.StartingBlock == files[i].StartingBlock)
+			((struct BMFSEntry *)(Directory + slot * 64))->FileSize = files[i].FileSize;
 	}
+	if (n != 0)
+		bmfs_flush_directory();
+	bmfs_volume_unlock(volume);
+	return ret;
+}
 
-	// Write the kernel if it was specified by the caller. The kernel must
-	// immediately follow the boot loader on disk (i.e. no seek needed.)
-	if (ret == 0 && kernelFile != NULL)
+
+// Run read, write or delete on every file named in args. Names may be
+// shell-style patterns, which are matched against the directory. The set is
+// resolved once, with the files write needs created in the same step, and
+// handled in the order the files are stored on the disk. write takes the
+// local files of the same names, creates the BMFS files that do not exist
+// yet and copies the data of several files at once. Returns 0 if every name
+// was found.
+int bmfs_multi(char *command, int nargs, char *args[])
+{
+	struct BMFSEntry tempentry, *entries = (struct BMFSEntry *)Directory;
+	char picked[64], selected[4096];
+	int i, slot, count = 0, matched, ret = 0;
+	int writing = (strcasecmp(s_write, command) == 0);
+	unsigned long long size;
+	FILE *tfile;
+
+	memset(picked, 0, sizeof(picked));
+	bmfs_volume_defer(volume, 1);
+	for (i = 0; i < nargs; i++)
 	{
-		for (;;)
+		if (strpbrk(args[i], "*?[") != NULL)
 		{
-			chunkSize = fread( buffer, 1, bufferSize, kernelFile);
-			if (chunkSize > 0)
+			matched = 0;
+			for (slot = 0; slot < 64 && entries[slot].FileName[0] != 0x00; slot++)
 			{
-				if (fwrite(buffer, chunkSize, 1, disk) != 1)
+				if (entries[slot].FileName[0] != 0x01 && bmfs_match(args[i], entries[slot].FileName))
 				{
-					printf("bmfs error: Failed to write disk '%s'\n", diskname);
-					ret = 1;
+					picked[slot] = 1;
+					matched = 1;
 				}
 			}
-			else
+			if (!matched)
 			{
-				if (ferror(disk))
-				{
-					printf("bmfs error: Failed to read file '%s'\n", kernel);
-					ret = 1;
-				}
-				break;
+				printf("bmfs error: No files match '%s' in BMFS.\n", args[i]);
+				ret = 1;
 			}
 		}
+		else if (bmfs_find(args[i], &tempentry, &slot))
+		{
+			picked[slot] = 1;
+		}
+		else if (!writing)
+		{
+			printf("bmfs error: File '%s' not found in BMFS.\n", args[i]);
+			ret = 1;
+		}
+		else if ((tfile = fopen(args[i], "rb")) == NULL)
+		{
+			printf("bmfs error: Could not open local file '%s'\n", args[i]);
+			ret = 1;
+		}
+		else
+		{
+			// New file, reserve space for the local one
+			fseek(tfile, 0, SEEK_END);
+			size = ftell(tfile);
+			fclose(tfile);
+			bmfs_create_for(args[i], size);
+			if (bmfs_find(args[i], &tempentry, &slot))
+				picked[slot] = 1;
+			else
+				ret = 1;
+		}
 	}
 
-	// Close any files that were opened.
-	if (mbrFile != NULL)
+	// Copy the chosen entries and sort them into disk order. The copy keeps
+	// the names valid while deletes change the directory.
+	for (slot = 0; slot < 64; slot++)
+		if (picked[slot])
+			memcpy(selected + 64 * count++, Directory + 64 * slot, 64);
+	qsort(selected, count, 64, bmfs_entry_cmp);
+	if (strcasecmp(s_delete, command) == 0)
 	{
-		fclose(mbrFile);
+		for (i = 0; i < count; i++)
+			bmfs_delete(((struct BMFSEntry *)(selected + 64 * i))->FileName);
+		bmfs_volume_defer(volume, 0);
+		return ret;
 	}
-	if (bootFile != NULL)
+
+	// The data is moved with the directory free
+	bmfs_volume_defer(volume, 0);
+	if (writing && bmfs_multi_write((struct BMFSEntry *)selected, count) != 0)
+		ret = 1;
+	for (i = 0; i < count && !writing; i++)
+		bmfs_read(((struct BMFSEntry *)(selected + 64 * i))->FileName, NULL);
+	return ret;
+}
+
+
+#ifdef BMFS_POSIX
+// Run a command (or a batch of them) through the bmfsd server at serverpath
+// instead of opening the disk. The server keeps the disk open, so each
+// command costs a request on the socket. File data is moved by the server
+// straight between the disk and the local file, which is passed to it.
+// Returns 0 on success.
+int bmfs_client(int argc, char *argv[])
+{
+	struct sockaddr_un addr;
+	struct BMFSDRequest req;
+	struct BMFSDReply reply;
+	char path[PATH_MAX], line[1024], where[32];
+	char *args[3];
+	FILE *script;
+	int lineno = 0, nargs, ret = 0;
+
+	signal(SIGPIPE, SIG_IGN);				// A server that goes away is noticed by write
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, serverpath, sizeof(addr.sun_path) - 1);
+	if ((serversock = socket(AF_UNIX, SOCK_STREAM, 0)) < 0 || connect(serversock, (struct sockaddr *)&addr, sizeof(addr)) != 0)
 	{
-		fclose(bootFile);
+		printf("bmfs error: Could not connect to the server at '%s'\n", serverpath);
+		return 1;
 	}
-	if (kernelFile != NULL)
+	if (realpath(argv[1], path) == NULL)			// The server runs elsewhere
+		snprintf(path, sizeof(path), "%s", argv[1]);
+	memset(&req, 0, sizeof(req));
+	req.Command = BMFSD_OPEN;
+	req.Length = strlen(path);
+	if (bmfs_client_call(&req, -1, path, &reply) != 0 || reply.Status != BMFS_OK)
 	{
-		fclose(kernelFile);
+		printf("bmfs error: The server does not serve disk '%s'\n", argv[1]);
+		close(serversock);
+		return 1;
 	}
-	if (disk != NULL)
+	servervolume = reply.Count;
+
+	if (strcasecmp(s_batch, argv[2]) != 0)
 	{
-		fclose(disk);
-		disk = NULL;
+		ret = bmfs_client_command(argc - 2, argv + 2, "");
 	}
-
-	// Free the buffer if it was allocated.
-	if (buffer != NULL)
+	else if ((script = (argc < 4 || strcmp(argv[3], "-") == 0) ? stdin : fopen(argv[3], "r")) == NULL)
 	{
-		free(buffer);
+		printf("bmfs error: Could not open batch file '%s'\n", argv[3]);
+		ret = 1;
 	}
-
-	if (ret == 0)
+	else
 	{
-		printf("Disk initialization complete.\n");
+		while (fgets(line, sizeof(line), script) != NULL)
+		{
+			lineno++;
+			sprintf(where, " on line %d", lineno);
+			nargs = bmfs_split(line, args, 3);
+			if (nargs == 0 || args[0][0] == '#')
+				continue;
+			if (nargs < 0)
+			{
+				printf("bmfs error: Too many arguments%s\n", where);
+				ret = 1;
+			}
+			else if (script == stdin && nargs > 2 && strcmp(args[2], "-") == 0)
+			{
+				printf("bmfs error: Standard input is in use for commands%s\n", where);
+				ret = 1;
+			}
+			else if (bmfs_client_command(nargs, args, where) != 0)
+			{
+				ret = 1;
+			}
+		}
+		if (script != stdin)
+			fclose(script);
 	}
-
+	close(serversock);
 	return ret;
 }
 
 
-// helper function for qsort, sorts by StartingBlock field
-static int StartingBlockCmp(const void *pa, const void *pb)
+// Send a request, with the descriptor fd (unless -1) and for OPEN the path in
+// data, and receive the reply. Returns 0, or 1 if the server is gone.
+int bmfs_client_call(struct BMFSDRequest *req, int fd, const void *data, struct BMFSDReply *reply)
 {
-	struct BMFSEntry *ea = (struct BMFSEntry *)pa;
-	struct BMFSEntry *eb = (struct BMFSEntry *)pb;
-	// empty records go to the end
-	if (ea->FileName[0] == 0x01)
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	union
+	{
+		struct cmsghdr align;
+		char buf[CMSG_SPACE(sizeof(int))];
+	} control;
+	ssize_t n;
+
+	req->Volume = servervolume;
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = req;
+	iov.iov_len = sizeof(*req);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	if (fd >= 0)
+	{
+		req->Flags |= BMFSD_FD;
+		memset(&control, 0, sizeof(control));
+		msg.msg_control = control.buf;
+		msg.msg_controllen = sizeof(control.buf);
+		cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+		memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+	}
+	while ((n = sendmsg(serversock, &msg, 0)) < 0 && errno == EINTR)
+		;
+	if (n < 0 || (n < (ssize_t)sizeof(*req) && bmfs_client_full((char *)req + n, sizeof(*req) - n, 1) != 0))
 		return 1;
-	if (eb->FileName[0] == 0x01)
-		return -1;
-	// compare non-empty records by their starting blocks number
-	return (ea->StartingBlock - eb->StartingBlock);
+	if (data != NULL && bmfs_client_full((void *)data, req->Length, 1) != 0)
+		return 1;
+	return bmfs_client_full(reply, sizeof(*reply), 0);
 }
 
-void bmfs_create(char *filename, unsigned long long maxsize)
-{
-	struct BMFSEntry tempentry;
-	int slot;
 
-	if (maxsize % 2 != 0)
-		maxsize++;
+// Receive (out 0) or send (out 1) exactly len bytes on the server socket
+int bmfs_client_full(void *buf, size_t len, int out)
+{
+	char *p = buf;
+	ssize_t n;
 
-	if (bmfs_find(filename, &tempentry, &slot) == 0)
+	while (len != 0)
 	{
-		unsigned long long blocks_requested = maxsize / 2; // how many blocks to allocate
-		unsigned long long num_blocks = disksize / 2; // number of blocks in the disk
-		char dir_copy[4096]; // copy of directory
-		int num_used_entries = 0; // how many entries of Directory are either used or deleted
-		int first_free_entry = -1; // where to put new entry
-		int tint;
-		struct BMFSEntry *pEntry;
-		unsigned long long new_file_start = 0;
-		unsigned long long prev_file_end = 1;
-
-		// Make a copy of Directory to play with
-		memcpy(dir_copy, Directory, 4096);
-
-		// Calculate number of files
-		for (tint = 0; tint < 64; tint++)
-		{
-			pEntry = (struct BMFSEntry *)(dir_copy + tint * 64); // points to the current directory entry
-			if (pEntry->FileName[0] == 0x00) // end of directory
-			{
-				num_used_entries = tint;
-				if (first_free_entry == -1)
-					first_free_entry = tint; // there were no unused entires before, will use this one
-				break;
-			}
-			else if (pEntry->FileName[0] == 0x01) // unused entry
-			{
-				if (first_free_entry == -1)
-					first_free_entry = tint; // will use it for our new file
-			}
-		}
-
-		if (first_free_entry == -1)
-		{
-			printf("bmfs error: Cannot create file. No free directory entries.\n");
-			return;
-		}
-
-		// Find an area with enough free blocks
-		// Sort our copy of the directory by starting block number
-		qsort(dir_copy, num_used_entries, 64, StartingBlockCmp);
-
-		for (tint = 0; tint < num_used_entries + 1; tint++)
-		{
-			// on each iteration of this loop we'll see if a new file can fit
-			// between the end of the previous file (initially == 1)
-			// and the beginning of the current file (or the last data block if there are no more files).
+		n = out ? write(serversock, p, len) : read(serversock, p, len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return 1;
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
 
-			unsigned long long this_file_start;
-			pEntry = (struct BMFSEntry *)(dir_copy + tint * 64); // points to the current directory entry
 
-			if (tint == num_used_entries || pEntry->FileName[0] == 0x01)
-				this_file_start = num_blocks - 1; // index of the last block
-			else
-				this_file_start = pEntry->StartingBlock;
+// Copy the stream fd to a temporary file and return that instead, positioned
+// at the start, or -1 on failure. fd is closed.
+int bmfs_client_spool(int fd)
+{
+	FILE *tmp = tmpfile();
+	char *buffer = bmfs_buffer_alloc(blockSize);
+	ssize_t n;
+	int ret = -1;
 
-			if (this_file_start - prev_file_end >= blocks_requested)
-			{ // fits here
-				new_file_start = prev_file_end;
+	if (tmp != NULL && buffer != NULL)
+	{
+		while ((n = read(fd, buffer, blockSize)) > 0 || (n < 0 && errno == EINTR))
+			if (n > 0 && fwrite(buffer, n, 1, tmp) != 1)
 				break;
-			}
-
-			if (tint < num_used_entries)
-				prev_file_end = pEntry->StartingBlock + pEntry->ReservedBlocks;
-		}
+		if (n == 0 && fflush(tmp) == 0 && (ret = dup(fileno(tmp))) >= 0)
+			lseek(ret, 0, SEEK_SET);
+	}
+	if (buffer != NULL)
+		bmfs_buffer_free(buffer, blockSize);
+	if (tmp != NULL)
+		fclose(tmp);					// Removed once ret is closed too
+	close(fd);
+	return ret;
+}
 
-		if (new_file_start == 0)
-		{
-			printf("bmfs error: Cannot create file of size %lld MiB.\n", maxsize);
-			return;
-		}
 
-		// Add file record to Directory
-		pEntry = (struct BMFSEntry *)(Directory + first_free_entry * 64);
-		pEntry->StartingBlock = new_file_start;
-		pEntry->ReservedBlocks = blocks_requested;
-		pEntry->FileSize = 0;
-		strcpy(pEntry->FileName, filename);
+// Run one list, create, read, write or delete command through the server,
+// with the same arguments and messages as bmfs_command. Returns 0 on
+// success.
+int bmfs_client_command(int nargs, char *args[], const char *where)
+{
+	struct BMFSDRequest req;
+	struct BMFSDReply reply;
+	struct BMFSEntry entries[64];
+	struct BMFSInfo info;
+	struct stat st;
+	char *localname;
+	unsigned long long size;
+	off_t pos;
+	int fd, tint;
 
-		if (first_free_entry == num_used_entries && num_used_entries + 1 < 64)
+	memset(&req, 0, sizeof(req));
+	if (strcasecmp(s_list, args[0]) == 0)
+	{
+		req.Command = BMFSD_QUERY;
+		if (bmfs_client_call(&req, -1, NULL, &reply) != 0 || reply.Length != sizeof(info) || bmfs_client_full(&info, sizeof(info), 0) != 0)
+			goto lost;
+		req.Command = BMFSD_LIST;
+		// The entries must fill exactly Length bytes, which fit entries
+		if (bmfs_client_call(&req, -1, NULL, &reply) != 0 || reply.Count > 64 || reply.Length != reply.Count * sizeof(struct BMFSEntry) || bmfs_client_full(entries, reply.Length, 0) != 0)
+			goto lost;
+		printf("Disk Size: %llu MiB\n", (unsigned long long)(info.DiskSize / 1048576));
+		printf("Name                            |            Size (B)|      Reserved (MiB)\n");
+		printf("==========================================================================\n");
+		for (tint = 0; tint < (int)reply.Count; tint++)
 		{
-			// here we used the record that was marked with 0x00,
-			// so make sure to mark the next record with 0x00 if it exists
-			pEntry = (struct BMFSEntry *)(Directory + (num_used_entries + 1) * 64);
-			pEntry->FileName[0] = 0x00;
+			printf("%-32s %20lld %20lld\n", entries[tint].FileName, (long long int)entries[tint].FileSize, (long long int)(entries[tint].ReservedBlocks*2));
 		}
-
-		// Flush Directory to disk
-		fseek(disk, 4096, SEEK_SET);				// Seek 4KiB in for directory
-		fwrite(Directory, 4096, 1, disk);			// Write 4096 bytes for the Directory
-
-//		printf("Complete: file %s starts at block %lld, directory entry #%d.\n", filename, new_file_start, first_free_entry);
+		return 0;
 	}
-	else
+	if (strcasecmp(s_create, args[0]) != 0 && strcasecmp(s_read, args[0]) != 0 && strcasecmp(s_write, args[0]) != 0 && strcasecmp(s_delete, args[0]) != 0)
 	{
-		printf("bmfs error: File already exists.\n");
+		printf("bmfs error: '%s' is not available through the server%s\n", args[0], where);
+		return 1;
+	}
+	if (nargs < 2)
+	{
+		printf("bmfs error: File name not specified%s\n", where);
+		return 1;
+	}
+	strncpy(req.FileName, args[1], 31);
+	if (strlen(args[1]) > 31)
+	{
+		printf("bmfs error: Filename too long.\n");
+		return 1;
 	}
-}
-
-// Read a file from a BMFS volume
-void bmfs_read(char *filename)
-{
-	struct BMFSEntry tempentry;
-	FILE *tfile;
-	int slot, retval;
-	unsigned long long bytestoread;
-	char *buffer;
 
-	if (0 == bmfs_find(filename, &tempentry, &slot))
+	if (strcasecmp(s_create, args[0]) == 0)
 	{
-		printf("bmfs error: File not found in BMFS.\n");
+		size = (nargs > 2) ? strtoull(args[2], NULL, 10) : 0;
+		if (size < 1)
+		{
+			printf("bmfs error: Invalid file size%s\n", where);
+			return 1;
+		}
+		req.Command = BMFSD_CREATE;
+		req.Length = (size + 1) / 2;				// MiB, rounded up to 2MiB blocks
 	}
-	else
+	else if (strcasecmp(s_delete, args[0]) == 0)
+	{
+		req.Command = BMFSD_DELETE;
+	}
+	else if (strcasecmp(s_read, args[0]) == 0)
 	{
-		if ((tfile = fopen(tempentry.FileName, "wb")) == NULL)
+		localname = (nargs > 2) ? args[2] : args[1];
+		if (strcmp(localname, "-") == 0)
 		{
-			printf("bmfs error: Could not open local file '%s'\n", tempentry.FileName);
+			fflush(stdout);
+			fd = dup(STDOUT_FILENO);
 		}
 		else
 		{
-			bytestoread = tempentry.FileSize;
-			fseek(disk, tempentry.StartingBlock*blockSize, SEEK_SET); // Skip to the starting block in the disk
-			buffer = malloc(blockSize);
-			if (buffer == NULL)
-			{
-				printf("bmfs error: Unable to allocate enough memory for buffer.\n");
-			}
-			else
-			{
-				while (bytestoread != 0)
-				{
-					if (bytestoread >= blockSize)
-					{
-						retval = fread(buffer, blockSize, 1, disk);
-						if (retval == 1)
-						{
-							fwrite(buffer, blockSize, 1, tfile);
-							bytestoread -= blockSize;
-						}
-						else
-						{
-							printf("bmfs error: Unexpected read length detected.\n");
-							bytestoread = 0;
-						}
-					}
-					else
-					{
-						retval = fread(buffer, bytestoread, 1, disk);
-						if (retval == 1)
-						{
-							fwrite(buffer, bytestoread, 1, tfile);
-							bytestoread = 0;
-						}
-						else
-						{
-							printf("bmfs error: Unexpected read length detected.\n");
-							bytestoread = 0;
-						}
-					}
-				}
-			}
-			fclose(tfile);
+			fd = open(localname, O_WRONLY | O_CREAT | O_TRUNC, 0666);
 		}
-	}
-}
-
-
-// Write a file to a BMFS volume
-void bmfs_write(char *filename)
-{
-	struct BMFSEntry tempentry;
-	FILE *tfile;
-	int slot, retval;
-	unsigned long long tempfilesize;
-	char *buffer;
-
-	if ((tfile = fopen(filename, "rb")) == NULL)
-	{
-		printf("bmfs error: Could not open local file '%s'\n", filename);
+		if (fd < 0)
+		{
+			printf("bmfs error: Could not open local file '%s'\n", localname);
+			return 1;
+		}
+		req.Command = BMFSD_READ;
+		req.Offset = rangeoffset;
+		req.Length = rangelength;
+		tint = bmfs_client_call(&req, fd, NULL, &reply);
+		close(fd);
+		if (tint != 0)
+			goto lost;
 	}
 	else
 	{
-		// Is there enough room in BMFS?
-		fseek(tfile, 0, SEEK_END);
-		tempfilesize = ftell(tfile);
-		rewind(tfile);
-		if (0 == bmfs_find(filename, &tempentry, &slot))
+		localname = (nargs > 2) ? args[2] : args[1];
+		fd = (strcmp(localname, "-") == 0) ? dup(STDIN_FILENO) : open(localname, O_RDONLY);
+		if (fd >= 0 && (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)))
 		{
-			if (tempfilesize < blockSize)
-			{
-				bmfs_create(filename, (tempfilesize+blockSize)/blockSize);
-			}
-			else
-			{
-				bmfs_create(filename, ceil((tempfilesize+1048576)/1048576));
-			}
-			bmfs_find(filename, &tempentry, &slot);
+			// The server needs the length up front, so keep a pipe aside first
+			fd = bmfs_client_spool(fd);
 		}
-		if ((tempentry.ReservedBlocks*blockSize) < tempfilesize)
+		if (fd < 0 || fstat(fd, &st) != 0 || (pos = lseek(fd, 0, SEEK_CUR)) < 0)
 		{
-			printf("bmfs error: Not enough reserved space in BMFS.\n");
+			printf("bmfs error: Could not open local file '%s'\n", localname);
+			if (fd >= 0)
+				close(fd);
+			return 1;
 		}
+		// Reserve room for the file the way write does, it may already exist
+		size = st.st_size - pos;
+		req.Command = BMFSD_CREATE;
+		if (size < blockSize)
+			req.Length = 1;
 		else
+			req.Length = ((size + 1048576) / 1048576 + 1) / 2;
+		tint = bmfs_client_call(&req, -1, NULL, &reply);
+		if (tint == 0 && (reply.Status == BMFS_OK || reply.Status == BMFS_EEXIST))
 		{
-			fseek(disk, tempentry.StartingBlock*blockSize, SEEK_SET); // Skip to the starting block in the disk
-			buffer = malloc(blockSize);
-			if (buffer == NULL)
-			{
-				printf("bmfs error: Unable to allocate enough memory for buffer.\n");
-			}
-			else
-			{
-				while (tempfilesize != 0)
-				{
-					if (tempfilesize >= blockSize)
-					{
-						retval = fread(buffer, blockSize, 1, tfile);
-						if (retval == 1)
-						{
-							fwrite(buffer, blockSize, 1, disk);
-							tempfilesize -= blockSize;
-						}
-						else
-						{
-							printf("bmfs error: Unexpected read length detected.\n");
-							tempfilesize = 0;
-						}
-					}
-					else
-					{
-						retval = fread(buffer, tempfilesize, 1, tfile);
-						if (retval == 1)
-						{
-							memset(buffer+(tempfilesize), 0, (blockSize-tempfilesize)); // 0 the rest of the buffer
-							fwrite(buffer, blockSize, 1, disk);
-							tempfilesize = 0;
-						}
-						else
-						{
-							printf("bmfs error: Unexpected read length detected.\n");
-							tempfilesize = 0;
-						}
-					}
-				}
-			}
-			// Update directory
-			tempfilesize = ftell(tfile);
-			memcpy(Directory+(slot*64)+48, &tempfilesize, 8);
-			fseek(disk, 4096, SEEK_SET);			// Seek 4KiB in for directory
-			fwrite(Directory, 4096, 1, disk);		// Write new directory to disk
+			req.Command = BMFSD_WRITE;
+			req.Flags = BMFSD_TRUNCATE;
+			req.Length = size;
+			tint = bmfs_client_call(&req, fd, NULL, &reply);
 		}
-		fclose(tfile);
+		close(fd);
+		if (tint != 0)
+			goto lost;
 	}
-}
+	if (req.Command != BMFSD_READ && req.Command != BMFSD_WRITE && bmfs_client_call(&req, -1, NULL, &reply) != 0)
+		goto lost;
 
-
-void bmfs_delete(char *filename)
-{
-	struct BMFSEntry tempentry;
-	char delmarker = 0x01;
-	int slot;
-
-	if (0 == bmfs_find(filename, &tempentry, &slot))
-	{
-		printf("bmfs error: File not found in BMFS.\n");
-	}
-	else
+	switch (reply.Status)
 	{
-		// Update directory
-		memcpy(Directory+(slot*64), &delmarker, 1);
-		fseek(disk, 4096, SEEK_SET);				// Seek 4KiB in for directory
-		fwrite(Directory, 4096, 1, disk);			// Write new directory to disk
+		case BMFS_OK:
+			return 0;
+		case BMFS_ENOTFOUND:
+			printf("bmfs error: File not found in BMFS.\n");
+			break;
+		case BMFS_EEXIST:
+			printf("bmfs error: File already exists.\n");
+			break;
+		case BMFS_EDIRFULL:
+			printf("bmfs error: Cannot create file. No free directory entries.\n");
+			break;
+		case BMFS_ENOSPC:
+			if (req.Command == BMFSD_CREATE)
+				printf("bmfs error: Cannot create file of size %lld MiB.\n", (long long int)req.Length * 2);
+			else
+				printf("bmfs error: Not enough reserved space in BMFS.\n");
+			break;
+		case BMFS_ERANGE:
+			printf("bmfs error: Offset is past the end of the file.\n");
+			break;
+		default:
+			printf("bmfs error: %s%s\n", bmfs_strerror(reply.Status), where);
+			break;
 	}
+	return 1;
+
+lost:
+	printf("bmfs error: Lost the connection to the server\n");
+	return 1;
+}
+#else
+int bmfs_client(int argc, char *argv[])
+{
+	(void)argc; (void)argv;
+	return 1;
 }
+#endif
+
 
 
 /* EOF */
@@ -0,0 +1,1210 @@
+/* BareMetal File System Server */
+/* Serves BMFS disks to local programs over a Unix domain socket, or disks and
+ * files as NBD block devices */
+/* v1.0 (2026 10 15) */
+
+/* Feature test macros */
+#if defined(__linux__)
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+#endif
+
+/* Global includes */
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include "libbmfs.h"
+#include "bmfsd.h"
+
+/* Platform includes */
+#if defined(__unix__) || defined(__APPLE__)
+#define BMFS_POSIX
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#endif
+#if defined(__linux__)
+#define BMFS_COPYRANGE
+#include <sys/sendfile.h>
+#endif
+
+/* Typedefs */
+typedef uint64_t u64;
+
+#ifdef BMFS_POSIX
+
+/* Global defines */
+// A disk being served. The directory is handled by libbmfs, file data is
+// moved through fd at the offsets of the reserved blocks.
+struct BMFSServed
+{
+	BMFSVolume *volume;
+	int fd;
+	u64 blocksize;
+	char path[PATH_MAX];	// Resolved, to match OPEN requests
+};
+
+// NBD protocol, fixed newstyle handshake. All values are big endian.
+#define NBD_MAGIC		UINT64_C(0x4E42444D41474943)	// "NBDMAGIC"
+#define NBD_IHAVEOPT		UINT64_C(0x49484156454F5054)	// "IHAVEOPT"
+#define NBD_REPLY_MAGIC		UINT64_C(0x0003E889045565A9)	// Option replies
+#define NBD_REQUEST_MAGIC	0x25609513
+#define NBD_SIMPLE_REPLY_MAGIC	0x67446698
+#define NBD_FLAG_FIXED_NEWSTYLE	1		// Handshake flags
+#define NBD_FLAG_NO_ZEROES	2
+#define NBD_OPT_EXPORT_NAME	1		// Options
+#define NBD_OPT_ABORT		2
+#define NBD_OPT_LIST		3
+#define NBD_OPT_INFO		6
+#define NBD_OPT_GO		7
+#define NBD_REP_ACK		1		// Option reply types
+#define NBD_REP_SERVER		2
+#define NBD_REP_INFO		3
+#define NBD_REP_ERR_UNSUP	0x80000001
+#define NBD_REP_ERR_INVALID	0x80000003
+#define NBD_REP_ERR_UNKNOWN	0x80000006
+#define NBD_INFO_EXPORT		0
+#define NBD_INFO_BLOCK_SIZE	3
+#define NBD_FLAG_HAS_FLAGS	1		// Transmission flags
+#define NBD_FLAG_READ_ONLY	2
+#define NBD_FLAG_SEND_FLUSH	4
+#define NBD_FLAG_SEND_FUA	8
+#define NBD_FLAG_SEND_TRIM	32
+#define NBD_FLAG_CAN_MULTI_CONN	256
+#define NBD_CMD_READ		0		// Commands
+#define NBD_CMD_WRITE		1
+#define NBD_CMD_DISC		2
+#define NBD_CMD_FLUSH		3
+#define NBD_CMD_TRIM		4
+#define NBD_CMD_FLAG_FUA	1
+#define NBD_EPERM		1		// Errors, with their usual errno values
+#define NBD_EIO			5
+#define NBD_EINVAL		22
+#define NBD_ENOSPC		28
+
+// A disk or one file of a disk exported as an NBD block device. Requests
+// are moved by offset into the disk: a file is one run of reserved blocks.
+struct BMFSExport
+{
+	struct BMFSServed *disk;
+	char name[PATH_MAX];	// Asked for by clients, the file name or the disk as given
+	u64 offset;		// Byte offset of the device on the disk
+	u64 size;
+	unsigned flags;		// NBD transmission flags, read only or not
+	u64 end;		// End of the data of a file, the most written
+	u64 recorded;		// Size in the file's entry
+	pthread_mutex_t sizelock;
+};
+
+// An NBD connection. Its workers take turns receiving a request (and the
+// data of a write) and then carry it out in parallel with the others.
+struct BMFSNBDConnection
+{
+	int sock;
+	struct BMFSExport *export;
+	pthread_mutex_t recvlock, sendlock;
+	int workers;		// Still running, the last one closes the connection
+	int done;		// Disconnected or failed, no more requests are taken
+};
+
+/* Global constants */
+// Buffer for data the kernel can not move by itself
+const size_t bufferSize = 1024 * 1024;
+// NBD requests carrying more data than this are refused
+const u64 nbdMaxRequest = 32 * 1024 * 1024;
+// Requests of one NBD connection carried out at the same time
+const int nbdWorkers = 4;
+
+/* Global variables */
+struct BMFSServed *served;
+int nserved;
+const char *socketpath;
+struct BMFSExport *exports;
+int nexports;
+
+/* Built-in functions */
+int bmfsd_open(const char *path, struct BMFSServed *s, int flags);
+int bmfsd_listen(const char *path);
+int bmfsd_listen_tcp(const char *port);
+void bmfsd_stop(int sig);
+void *bmfsd_connection(void *arg);
+int bmfsd_request(int sock, struct BMFSDRequest *req, int fd, char *buffer);
+int bmfsd_recv(int sock, struct BMFSDRequest *req, int *fd);
+int bmfsd_full(int fd, void *buf, size_t len, int out);
+int bmfsd_copy(int infd, u64 *inoff, int outfd, u64 *outoff, u64 len, u64 *done, char *buffer);
+int bmfsd_read(int sock, struct BMFSServed *s, struct BMFSDRequest *req, int fd, char *buffer, struct BMFSDReply *reply);
+int bmfsd_write(int sock, struct BMFSServed *s, struct BMFSDRequest *req, int fd, char *buffer, struct BMFSDReply *reply);
+int bmfsd_nbd(int argc, char *argv[]);
+int bmfsd_export(const char *spec, struct BMFSExport *e, int readonly);
+void *bmfsd_nbd_connection(void *arg);
+struct BMFSExport *bmfsd_nbd_handshake(int sock);
+int bmfsd_nbd_option_reply(int sock, uint32_t option, uint32_t type, const char *data, uint32_t len);
+struct BMFSExport *bmfsd_nbd_find(const char *name);
+void *bmfsd_nbd_worker(void *arg);
+int bmfsd_nbd_request(struct BMFSNBDConnection *c, const char *req, char *buffer);
+int bmfsd_nbd_record(struct BMFSExport *e);
+void bmfsd_put(char *p, u64 value, int bytes);
+u64 bmfsd_get(const char *p, int bytes);
+
+/* Program code */
+int main(int argc, char *argv[])
+{
+	pthread_t thread;
+	int i, sock, conn;
+
+	if (argc > 1 && strcasecmp(argv[1], "--nbd") == 0)
+		return bmfsd_nbd(argc - 2, argv + 2);
+	if (argc < 3)
+	{
+		printf("BareMetal File System Server v1.0 (2026 10 15)\n\n");
+		printf("Usage: bmfsd socket disk [disk ...]\n");
+		printf("       bmfsd --nbd [--readonly] address export [export ...]\n\n");
+		printf("Serves the disks to bmfs --server=socket and other local programs\n");
+		printf("until it is stopped.\n\n");
+		printf("With --nbd the exports are served as NBD block devices instead. An\n");
+		printf("export is a disk, exported whole, or disk:FileName for one file. The\n");
+		printf("address is a Unix socket, or a TCP port on the loopback address.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	nserved = argc - 2;
+	if ((served = calloc(nserved, sizeof(struct BMFSServed))) == NULL)
+	{
+		printf("bmfsd error: Out of memory.\n");
+		exit(EXIT_FAILURE);
+	}
+	for (i = 0; i < nserved; i++)
+	{
+		if (bmfsd_open(argv[i + 2], &served[i], 0) != 0)
+			exit(EXIT_FAILURE);
+	}
+
+	socketpath = argv[1];
+	if ((sock = bmfsd_listen(socketpath)) < 0)
+		exit(EXIT_FAILURE);
+	signal(SIGPIPE, SIG_IGN);				// Clients that go away are noticed by send
+	signal(SIGINT, bmfsd_stop);
+	signal(SIGTERM, bmfsd_stop);
+
+	// A thread for each client, they share the open disks
+	for (;;)
+	{
+		if ((conn = accept(sock, NULL, NULL)) < 0)
+		{
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			printf("bmfsd error: Could not accept connections on '%s'\n", socketpath);
+			break;
+		}
+		if (pthread_create(&thread, NULL, bmfsd_connection, (void *)(intptr_t)conn) != 0)
+			close(conn);
+		else
+			pthread_detach(thread);
+	}
+	unlink(socketpath);
+	return 1;
+}
+
+
+// Open a disk to serve, with the bmfs_volume_open flags. Returns 0 on
+// success.
+int bmfsd_open(const char *path, struct BMFSServed *s, int flags)
+{
+	struct BMFSInfo info;
+	int error;
+
+	if ((s->volume = bmfs_volume_open(path, flags, &error)) == NULL)
+	{
+		printf("bmfsd error: Unable to open disk '%s': %s\n", path, bmfs_strerror(error));
+		return 1;
+	}
+	if ((s->fd = open(path, (flags & BMFS_READONLY) ? O_RDONLY : O_RDWR)) < 0 || realpath(path, s->path) == NULL)
+	{
+		printf("bmfsd error: Unable to open disk '%s'\n", path);
+		return 1;
+	}
+	bmfs_volume_query(s->volume, &info);
+	s->blocksize = info.BlockSize;
+	return 0;
+}
+
+
+// Create the listening socket. A socket file left by a server that is no
+// longer running is replaced. Returns the socket or -1.
+int bmfsd_listen(const char *path)
+{
+	struct sockaddr_un addr;
+	int sock;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(addr.sun_path))
+	{
+		printf("bmfsd error: Socket path '%s' is too long.\n", path);
+		return -1;
+	}
+	strcpy(addr.sun_path, path);
+	if ((sock = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+	{
+		printf("bmfsd error: Could not create a socket.\n");
+		return -1;
+	}
+	if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) == 0)
+	{
+		printf("bmfsd error: A server is already running on '%s'\n", path);
+		close(sock);
+		return -1;
+	}
+	close(sock);
+	unlink(path);
+	if ((sock = socket(AF_UNIX, SOCK_STREAM, 0)) < 0 || bind(sock, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(sock, 64) != 0)
+	{
+		printf("bmfsd error: Could not listen on '%s'\n", path);
+		return -1;
+	}
+	return sock;
+}
+
+
+// Listen on a TCP port of the loopback address. Returns the socket or -1.
+int bmfsd_listen_tcp(const char *port)
+{
+	struct sockaddr_in addr;
+	int sock, on = 1;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	addr.sin_port = htons((unsigned short)atoi(port));
+	if ((sock = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+	{
+		printf("bmfsd error: Could not create a socket.\n");
+		return -1;
+	}
+	setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+	if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(sock, 64) != 0)
+	{
+		printf("bmfsd error: Could not listen on port %s\n", port);
+		return -1;
+	}
+	return sock;
+}
+
+
+// Every change is on the disk once it is answered, so just remove the socket
+void bmfsd_stop(int sig)
+{
+	(void)sig;
+	if (socketpath != NULL)
+		unlink(socketpath);
+	_exit(EXIT_SUCCESS);
+}
+
+
+// Answer the requests of one client until it disconnects. The blocks the
+// client's requests lock belong to this thread, so clients sharing a volume
+// handle keep out of each other's files as separate processes would.
+void *bmfsd_connection(void *arg)
+{
+	struct BMFSDRequest req;
+	int sock = (int)(intptr_t)arg;
+	int fd, ret = 0;
+	char *buffer;
+
+	if ((buffer = malloc(bufferSize)) != NULL)
+	{
+		while (ret == 0 && bmfsd_recv(sock, &req, &fd) == 0)
+		{
+			ret = bmfsd_request(sock, &req, fd, buffer);
+			if (fd >= 0)
+				close(fd);
+		}
+		free(buffer);
+	}
+	close(sock);
+	return NULL;
+}
+
+
+// Carry out one request and send the reply. Returns 0, or -1 if the
+// connection can not be used any more.
+int bmfsd_request(int sock, struct BMFSDRequest *req, int fd, char *buffer)
+{
+	struct BMFSDReply reply;
+	struct BMFSEntry entries[64];
+	struct BMFSInfo info;
+	struct BMFSServed *s = NULL;
+	char path[PATH_MAX], resolved[PATH_MAX];
+	const void *data = NULL;
+	int i, count;
+
+	memset(&reply, 0, sizeof(reply));
+	req->FileName[31] = 0;
+	if (req->Command == BMFSD_OPEN)
+	{
+		if (req->Length >= sizeof(path) || bmfsd_full(sock, path, req->Length, 0) != 0)
+			return -1;
+		path[req->Length] = 0;
+		reply.Status = BMFS_ENOTFOUND;
+		if (realpath(path, resolved) != NULL)
+		{
+			for (i = 0; i < nserved; i++)
+			{
+				if (strcmp(served[i].path, resolved) == 0)
+				{
+					reply.Status = BMFS_OK;
+					reply.Count = i;
+					break;
+				}
+			}
+		}
+	}
+	else if (req->Volume >= (uint32_t)nserved)
+	{
+		reply.Status = BMFS_EINVAL;
+		if (req->Command == BMFSD_WRITE && !(req->Flags & BMFSD_FD))
+			return -1;					// The data that follows can not be skipped safely
+	}
+	else
+	{
+		s = &served[req->Volume];
+		switch (req->Command)
+		{
+			case BMFSD_QUERY:
+				reply.Status = bmfs_volume_query(s->volume, &info);
+				reply.Length = sizeof(info);
+				data = &info;
+				break;
+			case BMFSD_LIST:
+				reply.Status = bmfs_volume_list(s->volume, entries, 64, &count);
+				reply.Count = count;
+				reply.Length = (u64)count * 64;
+				data = entries;
+				break;
+			case BMFSD_CREATE:
+				reply.Status = bmfs_volume_create(s->volume, req->FileName, req->Length);
+				break;
+			case BMFSD_DELETE:
+				reply.Status = bmfs_volume_delete(s->volume, req->FileName);
+				break;
+			case BMFSD_READ:
+				return bmfsd_read(sock, s, req, fd, buffer, &reply);
+			case BMFSD_WRITE:
+				return bmfsd_write(sock, s, req, fd, buffer, &reply);
+			default:
+				reply.Status = BMFS_EINVAL;
+				break;
+		}
+	}
+	if (bmfsd_full(sock, &reply, sizeof(reply), 1) != 0)
+		return -1;
+	if (reply.Status == BMFS_OK && data != NULL && bmfsd_full(sock, (void *)data, reply.Length, 1) != 0)
+		return -1;
+	return 0;
+}
+
+
+// Read a file. The blocks stay locked while the data is moved, straight
+// from the disk to the client's descriptor or to the socket.
+int bmfsd_read(int sock, struct BMFSServed *s, struct BMFSDRequest *req, int fd, char *buffer, struct BMFSDReply *reply)
+{
+	struct BMFSEntry entry;
+	u64 offset, len, done = 0;
+	int ret = 0;
+
+	if ((reply->Status = bmfs_volume_lockfile(s->volume, req->FileName, BMFS_SHARED, &entry)) != BMFS_OK)
+		return bmfsd_full(sock, reply, sizeof(*reply), 1);
+	if (req->Offset > entry.FileSize)
+	{
+		reply->Status = BMFS_ERANGE;
+		ret = bmfsd_full(sock, reply, sizeof(*reply), 1);
+	}
+	else
+	{
+		len = entry.FileSize - req->Offset;
+		if (len > req->Length)
+			len = req->Length;
+		offset = entry.StartingBlock * s->blocksize + req->Offset;
+		if (fd >= 0)
+		{
+			if (bmfsd_copy(s->fd, &offset, fd, NULL, len, &done, buffer) != 0 || done != len)
+				reply->Status = BMFS_EIO;
+			reply->Length = done;
+			ret = bmfsd_full(sock, reply, sizeof(*reply), 1);
+		}
+		else
+		{
+			// The length is promised up front, a short transfer ends the connection
+			reply->Length = len;
+			if (bmfsd_full(sock, reply, sizeof(*reply), 1) != 0 || bmfsd_copy(s->fd, &offset, sock, NULL, len, &done, buffer) != 0 || done != len)
+				ret = -1;
+		}
+	}
+	bmfs_volume_lockextent(s->volume, &entry, BMFS_UNLOCK);
+	return ret;
+}
+
+
+// Write a file at an offset up to its size, from the client's descriptor or
+// from the data following the request. The blocks are locked while the data
+// is moved and until the new size is recorded.
+int bmfsd_write(int sock, struct BMFSServed *s, struct BMFSDRequest *req, int fd, char *buffer, struct BMFSDReply *reply)
+{
+	struct BMFSEntry entry, current;
+	u64 offset, limit, done = 0;
+	int infd = (fd >= 0) ? fd : sock;
+	int copied = 0, ret = 0;
+	char c;
+
+	if (fd < 0 && req->Length == BMFSD_TOEND)
+		return -1;						// No way to tell where the data ends
+	memset(&entry, 0, sizeof(entry));
+	if ((reply->Status = bmfs_volume_lockfile(s->volume, req->FileName, BMFS_EXCLUSIVE, &entry)) != BMFS_OK)
+	{
+		// Not found
+	}
+	else if (req->Offset > entry.FileSize)
+	{
+		reply->Status = BMFS_ERANGE;
+	}
+	else if (req->Length != BMFSD_TOEND && req->Length > entry.ReservedBlocks * s->blocksize - req->Offset)
+	{
+		reply->Status = BMFS_ENOSPC;
+	}
+	else
+	{
+		copied = 1;
+		limit = (req->Length == BMFSD_TOEND) ? entry.ReservedBlocks * s->blocksize - req->Offset : req->Length;
+		offset = entry.StartingBlock * s->blocksize + req->Offset;
+		if (bmfsd_copy(infd, NULL, s->fd, &offset, limit, &done, buffer) != 0)
+			reply->Status = BMFS_EIO;
+		else if (req->Length != BMFSD_TOEND && done != limit)
+			reply->Status = BMFS_EIO;			// The data ended early
+		else if (req->Length == BMFSD_TOEND && done == limit && read(fd, &c, 1) == 1)
+			reply->Status = BMFS_ENOSPC;			// More than the reservation holds
+		reply->Length = done;
+		if (fd < 0 && done != limit)
+			ret = -1;
+	}
+
+	// Skip the data that was refused, to stay in step with the client
+	while (fd < 0 && !copied && done < req->Length && ret == 0)
+	{
+		limit = (req->Length - done < bufferSize) ? req->Length - done : bufferSize;
+		ret = bmfsd_full(sock, buffer, limit, 0);
+		done += limit;
+	}
+
+	// Record the new size, unless the file was replaced in the meantime
+	if (copied && (reply->Length != 0 || (req->Flags & BMFSD_TRUNCATE)))
+	{
+		bmfs_volume_lock(s->volume);
+		if (bmfs_volume_find(s->volume, req->FileName, &current, NULL) == BMFS_OK && current.StartingBlock == entry.StartingBlock)
+		{
+			if (req->Offset + reply->Length > current.FileSize || (req->Flags & BMFSD_TRUNCATE))
+				bmfs_volume_setsize(s->volume, req->FileName, req->Offset + reply->Length);
+		}
+		bmfs_volume_unlock(s->volume);
+	}
+	bmfs_volume_lockextent(s->volume, &entry, BMFS_UNLOCK);
+	if (ret == 0)
+		ret = bmfsd_full(sock, reply, sizeof(*reply), 1);
+	return ret;
+}
+
+
+// Receive a request and the descriptor that may come with it (-1 if none).
+// Returns 0, or -1 when the client is gone.
+int bmfsd_recv(int sock, struct BMFSDRequest *req, int *fd)
+{
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	union
+	{
+		struct cmsghdr align;
+		char buf[CMSG_SPACE(sizeof(int))];
+	} control;
+	ssize_t n;
+
+	*fd = -1;
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = req;
+	iov.iov_len = sizeof(*req);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buf;
+	msg.msg_controllen = sizeof(control.buf);
+	while ((n = recvmsg(sock, &msg, 0)) < 0 && errno == EINTR)
+		;
+	if (n <= 0)
+		return -1;
+	for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg))
+		if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+			memcpy(fd, CMSG_DATA(cmsg), sizeof(int));
+	if (n < (ssize_t)sizeof(*req) && bmfsd_full(sock, (char *)req + n, sizeof(*req) - n, 0) != 0)
+		return -1;
+	if ((*fd >= 0) != ((req->Flags & BMFSD_FD) != 0))
+	{
+		if (*fd >= 0)
+			close(*fd);
+		return -1;						// Out of step with the client
+	}
+	return 0;
+}
+
+
+// Receive (out 0) or send (out 1) exactly len bytes. Returns 0 on success.
+int bmfsd_full(int fd, void *buf, size_t len, int out)
+{
+	char *p = buf;
+	ssize_t n;
+
+	while (len != 0)
+	{
+		n = out ? write(fd, p, len) : read(fd, p, len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+
+// Copy up to len bytes from infd to outfd, at *inoff and *outoff (which are
+// advanced) or at the file position where they are NULL. The data is moved
+// inside the kernel where it can be, with copy_file_range or sendfile,
+// otherwise through buffer. Stops early at the end of the input. Returns 0
+// with the number of bytes copied in *done, or -1 on an error.
+int bmfsd_copy(int infd, u64 *inoff, int outfd, u64 *outoff, u64 len, u64 *done, char *buffer)
+{
+	size_t chunk;
+	ssize_t n;
+#ifdef BMFS_COPYRANGE
+	int mode = 0;						// 0 copy_file_range, 1 sendfile, 2 buffer
+	loff_t in, out;
+	off_t pos;
+#endif
+
+	*done = 0;
+	while (*done < len)
+	{
+		chunk = (len - *done > 0x40000000) ? 0x40000000 : (size_t)(len - *done);	// 1GiB per call
+#ifdef BMFS_COPYRANGE
+		if (mode == 0)
+		{
+			in = (inoff != NULL) ? (loff_t)*inoff : 0;
+			out = (outoff != NULL) ? (loff_t)*outoff : 0;
+			n = copy_file_range(infd, (inoff != NULL) ? &in : NULL, outfd, (outoff != NULL) ? &out : NULL, chunk, 0);
+			if (n < 0 && (errno == EXDEV || errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP || errno == EBADF))
+			{
+				mode = (outoff == NULL) ? 1 : 2;	// sendfile writes at the file position
+				continue;
+			}
+		}
+		else if (mode == 1)
+		{
+			pos = (inoff != NULL) ? (off_t)*inoff : 0;
+			n = sendfile(outfd, infd, (inoff != NULL) ? &pos : NULL, chunk);
+			if (n < 0 && (errno == EINVAL || errno == ENOSYS))
+			{
+				mode = 2;
+				continue;
+			}
+		}
+		else
+#endif
+		{
+			if (chunk > bufferSize)
+				chunk = bufferSize;
+			n = (inoff != NULL) ? pread(infd, buffer, chunk, (off_t)*inoff) : read(infd, buffer, chunk);
+			if (n > 0 && outoff != NULL)
+			{
+				if (pwrite(outfd, buffer, n, (off_t)*outoff) != n)	// A short write to a disk is an error
+					return -1;
+			}
+			else if (n > 0 && bmfsd_full(outfd, buffer, n, 1) != 0)
+			{
+				return -1;
+			}
+		}
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			return -1;
+		if (n == 0)						// End of the input
+			break;
+		if (inoff != NULL)
+			*inoff += n;
+		if (outoff != NULL)
+			*outoff += n;
+		*done += n;
+	}
+	return 0;
+}
+
+
+// Serve exports over NBD until stopped. argv holds the options, the address
+// and the exports.
+int bmfsd_nbd(int argc, char *argv[])
+{
+	pthread_t thread;
+	int i, sock, conn, readonly = 0, on = 1, tcp;
+
+	if (argc > 0 && strcasecmp(argv[0], "--readonly") == 0)
+	{
+		readonly = 1;
+		argc--;
+		argv++;
+	}
+	if (argc < 2)
+	{
+		printf("bmfsd error: An address and at least one export are needed.\n");
+		return 1;
+	}
+	served = calloc(argc - 1, sizeof(struct BMFSServed));
+	exports = calloc(argc - 1, sizeof(struct BMFSExport));
+	if (served == NULL || exports == NULL)
+	{
+		printf("bmfsd error: Out of memory.\n");
+		return 1;
+	}
+	for (i = 1; i < argc; i++)
+	{
+		if (bmfsd_export(argv[i], &exports[nexports], readonly) != 0)
+			return 1;
+		nexports++;
+	}
+
+	// A port number is TCP on the loopback address, anything else a Unix socket
+	tcp = (argv[0][0] != 0 && strspn(argv[0], "0123456789") == strlen(argv[0]));
+	if (!tcp)
+		socketpath = argv[0];
+	if ((sock = tcp ? bmfsd_listen_tcp(argv[0]) : bmfsd_listen(argv[0])) < 0)
+		return 1;
+	signal(SIGPIPE, SIG_IGN);
+	signal(SIGINT, bmfsd_stop);
+	signal(SIGTERM, bmfsd_stop);
+
+	for (;;)
+	{
+		if ((conn = accept(sock, NULL, NULL)) < 0)
+		{
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			printf("bmfsd error: Could not accept connections on '%s'\n", argv[0]);
+			break;
+		}
+		if (tcp)
+			setsockopt(conn, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));	// Replies are small
+		if (pthread_create(&thread, NULL, bmfsd_nbd_connection, (void *)(intptr_t)conn) != 0)
+			close(conn);
+		else
+			pthread_detach(thread);
+	}
+	if (socketpath != NULL)
+		unlink(socketpath);
+	return 1;
+}
+
+
+// Set up an export from "disk" (the whole disk) or "disk:FileName". A disk is
+// opened once however often it is exported. The blocks of an exported file,
+// or all of an exported disk, stay locked, exclusive or shared if read only,
+// until the server stops. The device is the whole reservation, while the
+// file keeps its size until data is written past it. Returns 0 on success.
+int bmfsd_export(const char *spec, struct BMFSExport *e, int readonly)
+{
+	struct BMFSEntry entry;
+	struct BMFSInfo info;
+	struct stat st;
+	char path[PATH_MAX], resolved[PATH_MAX];
+	char *file = NULL, *colon;
+	int i, ret;
+
+	if (strlen(spec) >= sizeof(path))
+	{
+		printf("bmfsd error: Export '%s' is too long.\n", spec);
+		return 1;
+	}
+	strcpy(path, spec);
+	if (stat(path, &st) != 0 && (colon = strrchr(path, ':')) != NULL)
+	{
+		*colon = 0;
+		file = colon + 1;
+	}
+	e->disk = NULL;
+	for (i = 0; i < nserved && e->disk == NULL; i++)
+		if (realpath(path, resolved) != NULL && strcmp(served[i].path, resolved) == 0)
+			e->disk = &served[i];
+	if (e->disk == NULL)
+	{
+		if (bmfsd_open(path, &served[nserved], readonly ? BMFS_READONLY : 0) != 0)
+			return 1;
+		e->disk = &served[nserved++];
+	}
+
+	e->flags = NBD_FLAG_HAS_FLAGS | NBD_FLAG_SEND_FLUSH | NBD_FLAG_SEND_FUA | NBD_FLAG_CAN_MULTI_CONN;
+	if (readonly)
+		e->flags |= NBD_FLAG_READ_ONLY;
+#if defined(__linux__)
+	else
+		e->flags |= NBD_FLAG_SEND_TRIM;
+#endif
+	// A writable disk can not be exported whole along with files on it, the
+	// lock on the whole disk would keep the server from its own files
+	for (i = 0; i < nexports && (readonly || exports[i].disk != e->disk || (exports[i].offset == 0) == (file == NULL)); i++)
+		;
+	if (i < nexports)
+	{
+		printf("bmfsd error: '%s' can not be exported whole along with files on it unless --readonly is given.\n", path);
+		return 1;
+	}
+	if (file == NULL)
+	{
+		bmfs_volume_query(e->disk->volume, &info);
+		if (bmfs_fd_lock(e->disk->fd, readonly ? BMFS_SHARED : BMFS_EXCLUSIVE, 0, info.DiskSize) != BMFS_OK)
+		{
+			printf("bmfsd error: Unable to lock disk '%s'\n", path);
+			return 1;
+		}
+		e->offset = 0;
+		e->size = info.DiskSize;
+		strcpy(e->name, spec);
+		return 0;
+	}
+
+	ret = bmfs_volume_lockfile(e->disk->volume, file, readonly ? BMFS_SHARED : BMFS_EXCLUSIVE, &entry);
+	if (ret != BMFS_OK)
+	{
+		printf("bmfsd error: Unable to export '%s' of '%s': %s\n", file, path, bmfs_strerror(ret));
+		return 1;
+	}
+	e->offset = entry.StartingBlock * e->disk->blocksize;
+	e->size = entry.ReservedBlocks * e->disk->blocksize;
+	e->end = e->recorded = entry.FileSize;
+	pthread_mutex_init(&e->sizelock, NULL);
+	strcpy(e->name, file);
+	return 0;
+}
+
+
+// Negotiate an export with a new NBD client, then serve it on nbdWorkers
+// threads, this one included
+void *bmfsd_nbd_connection(void *arg)
+{
+	struct BMFSNBDConnection *c;
+	struct BMFSExport *e;
+	pthread_t thread;
+	int sock = (int)(intptr_t)arg;
+	int i;
+
+	if ((e = bmfsd_nbd_handshake(sock)) == NULL || (c = calloc(1, sizeof(*c))) == NULL)
+	{
+		close(sock);
+		return NULL;
+	}
+	c->sock = sock;
+	c->export = e;
+	pthread_mutex_init(&c->recvlock, NULL);
+	pthread_mutex_init(&c->sendlock, NULL);
+	c->workers = nbdWorkers;
+	for (i = 1; i < nbdWorkers; i++)
+	{
+		if (pthread_create(&thread, NULL, bmfsd_nbd_worker, c) == 0)
+		{
+			pthread_detach(thread);
+		}
+		else
+		{
+			pthread_mutex_lock(&c->sendlock);
+			c->workers--;
+			pthread_mutex_unlock(&c->sendlock);
+		}
+	}
+	return bmfsd_nbd_worker(c);
+}
+
+
+// The fixed newstyle handshake. Returns the export chosen by the client, or
+// NULL if it went away or asked for one that does not exist.
+struct BMFSExport *bmfsd_nbd_handshake(int sock)
+{
+	struct BMFSExport *e;
+	char buf[4096], out[256], name[PATH_MAX], listing[4 + PATH_MAX];
+	uint32_t option, len, namelen, requests, i;
+	int noZeroes;
+
+	bmfsd_put(out, NBD_MAGIC, 8);
+	bmfsd_put(out + 8, NBD_IHAVEOPT, 8);
+	bmfsd_put(out + 16, NBD_FLAG_FIXED_NEWSTYLE | NBD_FLAG_NO_ZEROES, 2);
+	if (bmfsd_full(sock, out, 18, 1) != 0 || bmfsd_full(sock, buf, 4, 0) != 0)
+		return NULL;
+	if (bmfsd_get(buf, 4) & ~(u64)(NBD_FLAG_FIXED_NEWSTYLE | NBD_FLAG_NO_ZEROES))
+		return NULL;
+	noZeroes = (bmfsd_get(buf, 4) & NBD_FLAG_NO_ZEROES) != 0;
+
+	for (;;)
+	{
+		if (bmfsd_full(sock, buf, 16, 0) != 0 || bmfsd_get(buf, 8) != NBD_IHAVEOPT)
+			return NULL;
+		option = bmfsd_get(buf + 8, 4);
+		len = bmfsd_get(buf + 12, 4);
+		if (len >= sizeof(buf) || bmfsd_full(sock, buf, len, 0) != 0)
+			return NULL;
+		buf[len] = 0;
+		switch (option)
+		{
+			case NBD_OPT_EXPORT_NAME:		// Old style, no way to report an error
+				if ((e = bmfsd_nbd_find(buf)) == NULL)
+					return NULL;
+				bmfsd_put(out, e->size, 8);
+				bmfsd_put(out + 8, e->flags, 2);
+				memset(out + 10, 0, 124);
+				return (bmfsd_full(sock, out, noZeroes ? 10 : 134, 1) == 0) ? e : NULL;
+			case NBD_OPT_ABORT:
+				bmfsd_nbd_option_reply(sock, option, NBD_REP_ACK, NULL, 0);
+				return NULL;
+			case NBD_OPT_LIST:
+				for (i = 0; i < (uint32_t)nexports; i++)
+				{
+					namelen = strlen(exports[i].name);	// Up to PATH_MAX - 1
+					bmfsd_put(listing, namelen, 4);
+					memcpy(listing + 4, exports[i].name, namelen);
+					if (bmfsd_nbd_option_reply(sock, option, NBD_REP_SERVER, listing, namelen + 4) != 0)
+						return NULL;
+				}
+				if (bmfsd_nbd_option_reply(sock, option, NBD_REP_ACK, NULL, 0) != 0)
+					return NULL;
+				break;
+			case NBD_OPT_INFO:
+			case NBD_OPT_GO:
+				namelen = (len >= 6) ? bmfsd_get(buf, 4) : len;
+				requests = (namelen <= len - 6) ? bmfsd_get(buf + 4 + namelen, 2) : 0;
+				if (len < 6 || namelen > len - 6 || len != 6 + namelen + 2 * requests)
+				{
+					if (bmfsd_nbd_option_reply(sock, option, NBD_REP_ERR_INVALID, NULL, 0) != 0)
+						return NULL;
+					break;
+				}
+				memcpy(name, buf + 4, namelen);
+				name[namelen] = 0;
+				if ((e = bmfsd_nbd_find(name)) == NULL)
+				{
+					if (bmfsd_nbd_option_reply(sock, option, NBD_REP_ERR_UNKNOWN, NULL, 0) != 0)
+						return NULL;
+					break;
+				}
+				bmfsd_put(out, NBD_INFO_EXPORT, 2);
+				bmfsd_put(out + 2, e->size, 8);
+				bmfsd_put(out + 10, e->flags, 2);
+				if (bmfsd_nbd_option_reply(sock, option, NBD_REP_INFO, out, 12) != 0)
+					return NULL;
+				for (i = 0; i < requests; i++)
+				{
+					if (bmfsd_get(buf + 6 + namelen + 2 * i, 2) != NBD_INFO_BLOCK_SIZE)
+						continue;
+					bmfsd_put(out, NBD_INFO_BLOCK_SIZE, 2);
+					bmfsd_put(out + 2, 1, 4);			// Any size and alignment
+					bmfsd_put(out + 6, 4096, 4);			// Preferred, a page
+					bmfsd_put(out + 10, nbdMaxRequest, 4);
+					if (bmfsd_nbd_option_reply(sock, option, NBD_REP_INFO, out, 14) != 0)
+						return NULL;
+				}
+				if (bmfsd_nbd_option_reply(sock, option, NBD_REP_ACK, NULL, 0) != 0)
+					return NULL;
+				if (option == NBD_OPT_GO)
+					return e;
+				break;
+			default:
+				if (bmfsd_nbd_option_reply(sock, option, NBD_REP_ERR_UNSUP, NULL, 0) != 0)
+					return NULL;
+				break;
+		}
+	}
+}
+
+
+// Answer a handshake option. Returns 0 on success.
+int bmfsd_nbd_option_reply(int sock, uint32_t option, uint32_t type, const char *data, uint32_t len)
+{
+	char out[20];
+
+	bmfsd_put(out, NBD_REPLY_MAGIC, 8);
+	bmfsd_put(out + 8, option, 4);
+	bmfsd_put(out + 12, type, 4);
+	bmfsd_put(out + 16, len, 4);
+	if (bmfsd_full(sock, out, 20, 1) != 0)
+		return -1;
+	return (len == 0) ? 0 : bmfsd_full(sock, (void *)data, len, 1);
+}
+
+
+// The export of that name, the first one for an empty name
+struct BMFSExport *bmfsd_nbd_find(const char *name)
+{
+	int i;
+
+	if (name[0] == 0)
+		return &exports[0];
+	for (i = 0; i < nexports; i++)
+		if (strcmp(exports[i].name, name) == 0)
+			return &exports[i];
+	return NULL;
+}
+
+
+// Take the next request of the connection, with the data of a write, and
+// carry it out. Requests are answered as they complete, so several of them
+// are on the disk at once. The last worker to stop closes the connection.
+void *bmfsd_nbd_worker(void *arg)
+{
+	struct BMFSNBDConnection *c = arg;
+	char req[28];
+	char *buffer, *bigger;
+	u64 buffersize = bufferSize, len;
+	int ok, last;
+
+	buffer = malloc(bufferSize);
+	for (;;)
+	{
+		pthread_mutex_lock(&c->recvlock);
+		ok = (!c->done && buffer != NULL && bmfsd_full(c->sock, req, 28, 0) == 0 && bmfsd_get(req, 4) == NBD_REQUEST_MAGIC);
+		if (ok && bmfsd_get(req + 6, 2) == NBD_CMD_WRITE)
+		{
+			len = bmfsd_get(req + 24, 4);
+			if (len > nbdMaxRequest)
+			{
+				ok = 0;
+			}
+			else if (len > buffersize)
+			{
+				if ((bigger = realloc(buffer, len)) == NULL)
+					ok = 0;
+				else
+				{
+					buffer = bigger;
+					buffersize = len;
+				}
+			}
+			if (ok && bmfsd_full(c->sock, buffer, len, 0) != 0)
+				ok = 0;
+		}
+		if (ok && bmfsd_get(req + 6, 2) == NBD_CMD_DISC)
+			ok = 0;						// Requests already taken are still answered
+		if (!ok)
+			c->done = 1;
+		pthread_mutex_unlock(&c->recvlock);
+
+		// Room for the data of a read, which is sent from memory
+		len = bmfsd_get(req + 24, 4);
+		if (ok && bmfsd_get(req + 6, 2) == NBD_CMD_READ && len > buffersize && len <= nbdMaxRequest)
+		{
+			if ((bigger = realloc(buffer, len)) == NULL)
+				ok = 0;
+			else
+			{
+				buffer = bigger;
+				buffersize = len;
+			}
+		}
+		if (!ok || bmfsd_nbd_request(c, req, buffer) != 0)
+			break;
+	}
+	free(buffer);
+
+	// Wake up a worker waiting for a request that will not come
+	shutdown(c->sock, SHUT_RD);
+	pthread_mutex_lock(&c->sendlock);
+	last = (--c->workers == 0);
+	pthread_mutex_unlock(&c->sendlock);
+	if (last)
+	{
+		bmfsd_nbd_record(c->export);
+		close(c->sock);
+		pthread_mutex_destroy(&c->recvlock);
+		pthread_mutex_destroy(&c->sendlock);
+		free(c);
+	}
+	return NULL;
+}
+
+
+// Carry out one request and answer it. Every offset is just moved to where
+// the export starts on the disk. Read data is read into buffer first, so the
+// connection is only held to send it and other requests reach the disk
+// meanwhile. Returns 0, or -1 if the connection can not be used any more.
+int bmfsd_nbd_request(struct BMFSNBDConnection *c, const char *req, char *buffer)
+{
+	struct BMFSExport *e = c->export;
+	char reply[16];
+	uint32_t flags, type, error = 0;
+	u64 offset, len, pos, done = 0;
+	ssize_t n;
+	int ret;
+
+	flags = bmfsd_get(req + 4, 2);
+	type = bmfsd_get(req + 6, 2);
+	offset = bmfsd_get(req + 16, 8);
+	len = bmfsd_get(req + 24, 4);
+	pos = e->offset + offset;
+	bmfsd_put(reply, NBD_SIMPLE_REPLY_MAGIC, 4);
+	memcpy(reply + 8, req + 8, 8);					// The client's handle
+
+	if ((type == NBD_CMD_READ || type == NBD_CMD_WRITE || type == NBD_CMD_TRIM) && (offset > e->size || len > e->size - offset))
+	{
+		error = (type == NBD_CMD_WRITE) ? NBD_ENOSPC : NBD_EINVAL;
+	}
+	else if (type == NBD_CMD_READ && len > nbdMaxRequest)
+	{
+		error = NBD_EINVAL;
+	}
+	else if ((type == NBD_CMD_WRITE || type == NBD_CMD_TRIM) && (e->flags & NBD_FLAG_READ_ONLY))
+	{
+		error = NBD_EPERM;
+	}
+	else if (type == NBD_CMD_READ)
+	{
+		while (done < len)
+		{
+			n = pread(e->disk->fd, buffer + done, len - done, (off_t)(pos + done));
+			if (n < 0 && errno == EINTR)
+				continue;
+			if (n <= 0)
+				break;
+			done += n;
+		}
+		if (done != len)
+		{
+			error = NBD_EIO;
+		}
+		else
+		{
+			// The data follows the reply
+			bmfsd_put(reply + 4, 0, 4);
+			pthread_mutex_lock(&c->sendlock);
+#ifdef MSG_MORE
+			n = send(c->sock, reply, 16, MSG_MORE);
+#else
+			n = send(c->sock, reply, 16, 0);
+#endif
+			ret = (n >= 0 && bmfsd_full(c->sock, reply + n, 16 - n, 1) == 0 && bmfsd_full(c->sock, buffer, len, 1) == 0) ? 0 : -1;
+			pthread_mutex_unlock(&c->sendlock);
+			return ret;
+		}
+	}
+	else if (type == NBD_CMD_WRITE)
+	{
+		while (done < len)
+		{
+			n = pwrite(e->disk->fd, buffer + done, len - done, (off_t)(pos + done));
+			if (n < 0 && errno == EINTR)
+				continue;
+			if (n <= 0)
+				break;
+			done += n;
+		}
+		if (done != len)
+		{
+			error = NBD_EIO;
+		}
+		else if (e->offset != 0)					// A file, note how far it now goes
+		{
+			pthread_mutex_lock(&e->sizelock);
+			if (offset + len > e->end)
+				e->end = offset + len;
+			pthread_mutex_unlock(&e->sizelock);
+		}
+	}
+	else if (type == NBD_CMD_TRIM)
+	{
+#if defined(__linux__)
+		fallocate(e->disk->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, (off_t)pos, (off_t)len);	// Only a hint
+#endif
+	}
+	else if (type != NBD_CMD_FLUSH)
+	{
+		error = NBD_EINVAL;
+	}
+	if (error == 0 && (type == NBD_CMD_FLUSH || (flags & NBD_CMD_FLAG_FUA)) && (fsync(e->disk->fd) != 0 || bmfsd_nbd_record(e) != 0))
+		error = NBD_EIO;
+
+	bmfsd_put(reply + 4, error, 4);
+	pthread_mutex_lock(&c->sendlock);
+	ret = bmfsd_full(c->sock, reply, 16, 1);
+	pthread_mutex_unlock(&c->sendlock);
+	return ret;
+}
+
+
+// Record how far the data written to a file export goes as the size of the
+// file, so it reads back through BMFS as the client left it. Done when the
+// client flushes and when it disconnects, rather than on every write. The
+// size only grows. Returns 0 on success.
+int bmfsd_nbd_record(struct BMFSExport *e)
+{
+	int ret = 0;
+
+	if (e->offset == 0 || (e->flags & NBD_FLAG_READ_ONLY))	// A whole disk has no entry
+		return 0;
+	pthread_mutex_lock(&e->sizelock);
+	if (e->end > e->recorded)
+	{
+		if (bmfs_volume_setsize(e->disk->volume, e->name, e->end) == BMFS_OK)
+			e->recorded = e->end;
+		else
+			ret = -1;
+	}
+	pthread_mutex_unlock(&e->sizelock);
+	return ret;
+}
+
+
+// Store value big endian in bytes bytes
+void bmfsd_put(char *p, u64 value, int bytes)
+{
+	while (bytes-- > 0)
+	{
+		p[bytes] = (char)(value & 0xFF);
+		value >>= 8;
+	}
+}
+
+// Read a big endian value of bytes bytes
+u64 bmfsd_get(const char *p, int bytes)
+{
+	u64 value = 0;
+	int i;
+
+	for (i = 0; i < bytes; i++)
+		value = (value << 8) | (unsigned char)p[i];
+	return value;
+}
+
+#else
+
+int main(int argc, char *argv[])
+{
+	(void)argc; (void)argv;
+	printf("bmfsd error: The server is not supported on this platform\n");
+	return 1;
+}
+
+#endif
+
+
+/* EOF */
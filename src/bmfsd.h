@@ -0,0 +1,57 @@
+/* BareMetal File System Server Protocol */
+/* Requests and replies between bmfsd and its clients */
+/* v1.0 (2026 10 15) */
+
+#ifndef BMFSD_H
+#define BMFSD_H
+
+#include <stdint.h>
+#include "libbmfs.h"
+
+/* The server and its clients are on the same machine and talk over a Unix
+ * domain stream socket, so the messages are plain structures in host byte
+ * order. Every request is answered by one reply, in order.
+ *
+ * A request may carry a file descriptor (SCM_RIGHTS, with BMFSD_FD set). READ
+ * then writes the data to it and WRITE reads the data from it, both at its
+ * file position, and the server moves the data inside the kernel where it
+ * can. Without a descriptor READ data follows the reply and WRITE data
+ * follows the request on the socket. */
+
+/* Commands */
+#define BMFSD_OPEN	1	// Select the disk for the later requests. Length bytes of path follow
+#define BMFSD_QUERY	2	// Reply Length is sizeof(struct BMFSInfo), which follows
+#define BMFSD_LIST	3	// Reply Count files, Length bytes of 64 byte entries follow
+#define BMFSD_CREATE	4	// Create FileName with Length blocks
+#define BMFSD_DELETE	5
+#define BMFSD_READ	6	// At most Length bytes from Offset into FileName
+#define BMFSD_WRITE	7	// Length bytes at Offset into FileName, which may be at most its size
+
+/* Request flags */
+#define BMFSD_FD	1	// A descriptor for the data comes with the request
+#define BMFSD_TRUNCATE	2	// WRITE: the file ends after the data
+// WRITE Length from a descriptor when the amount is not known in advance.
+// The data is read until the end, and must fit in the reservation.
+#define BMFSD_TOEND	UINT64_C(0xFFFFFFFFFFFFFFFF)
+
+struct BMFSDRequest
+{
+	uint32_t Command;
+	uint32_t Flags;
+	uint64_t Offset;
+	uint64_t Length;
+	char FileName[32];
+	uint32_t Volume;	// From the OPEN reply
+	uint32_t Unused;
+};
+
+struct BMFSDReply
+{
+	uint32_t Status;	// BMFS_OK or a libbmfs error code
+	uint32_t Count;		// OPEN: the volume, LIST: the number of files
+	uint64_t Length;	// Bytes that follow, or bytes moved through a descriptor
+};
+
+#endif
+
+/* EOF */
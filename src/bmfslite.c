@@ -2,6 +2,11 @@
 /* Written by Ian Seyler of Return Infinity */
 /* v1.0 (2024 11 21) */
 
+/* Feature test macros */
+#if defined(__linux__)
+#define _GNU_SOURCE
+#endif
+
 /* Global includes */
 #include <stdio.h>
 #include <stdint.h>
@@ -9,6 +14,12 @@
 #include <string.h>
 #include <strings.h>
 #include <ctype.h>
+#include "libbmfs.h"
+
+/* Platform includes */
+#if defined(__unix__) || defined(__APPLE__)
+#define BMFS_POSIX
+#endif
 
 /* Typedefs */
 typedef uint8_t u8;
@@ -16,16 +27,6 @@ typedef uint16_t u16;
 typedef uint32_t u32;
 typedef uint64_t u64;
 
-/* Global defines */
-struct BMFSEntry
-{
-	char FileName[32];
-	u64 StartingBlock; // Files start at block 4
-	u64 ReservedBlocks;
-	u64 FileSize;
-	u64 Unused;
-};
-
 /* Global constants */
 // Min drive size is 64KiB
 const unsigned int minimumDiskSize = (64 * 1024);
@@ -36,7 +37,7 @@ const unsigned int blockSize = 1024;
 
 /* Global variables */
 FILE *file, *disk;
-unsigned int filesize, disksize, retval;
+unsigned int filesize;
 char tempfilename[32], tempstring[32];
 char *filename, *diskname, *command;
 char s_list[] = "list";
@@ -45,14 +46,10 @@ char s_initialize[] = "initialize";
 char s_create[] = "create";
 char s_read[] = "read";
 char s_write[] = "write";
-struct BMFSEntry entry;
-void *pentry = &entry;
-char *BlockMap;
-char *FileBlocks;
-char Directory[4096];
+BMFSVolume *volume;			// Files start at block 4, after the directory
+int usemmap = 0;
 
 /* Built-in functions */
-int bmfs_find(char *filename, struct BMFSEntry *fileentry, int *entrynumber);
 void bmfs_list(void);
 void bmfs_format(void);
 int bmfs_initialize(char *diskname, char *size);
@@ -63,15 +60,42 @@ void bmfs_write(char *filename);
 /* Program code */
 int main(int argc, char *argv[])
 {
+	int i, j;
+
+	/* Parse options, leaving the positional arguments in argv */
+	for (i = 1, j = 1; i < argc; i++)
+	{
+		if (strcasecmp(argv[i], "--mmap") == 0)
+		{
+#ifdef BMFS_POSIX
+			usemmap = 1;
+#else
+			printf("bmfs error: --mmap is not supported on this platform\n");
+			exit(EXIT_FAILURE);
+#endif
+		}
+		else if (strncmp(argv[i], "--", 2) == 0)
+		{
+			printf("bmfs error: Unknown option '%s'\n", argv[i]);
+			exit(EXIT_FAILURE);
+		}
+		else
+		{
+			argv[j++] = argv[i];
+		}
+	}
+	argc = j;
+
 	/* Parse arguments */
 	if (argc == 1) // No arguments provided
 	{
 		printf("BareMetal File System Lite Utility v1.0 (2024 11 19)\n");
 		printf("Written by Ian Seyler @ Return Infinity (ian.seyler@returninfinity.com)\n\n");
-		printf("Usage: bmfs disk function file\n\n");
+		printf("Usage: bmfs [options] disk function file\n\n");
 		printf("Disk:     the name of the disk file\n");
 		printf("Function: list, read, write, create, format, initialize\n");
 		printf("File:     (if applicable)\n");
+		printf("Options:  --mmap  access the disk through a memory mapping\n");
 		exit(EXIT_SUCCESS);
 	}
 
@@ -100,19 +124,12 @@ int main(int argc, char *argv[])
 		}
 	}
 
-	if ((disk = fopen(diskname, "r+b")) == NULL)			// Open for read/write in binary mode
+	// The whole disk is mapped with --mmap, it is at most 2MiB
+	if ((volume = bmfs_volume_open(diskname, BMFS_LITE | (usemmap ? BMFS_MMAP : 0), NULL)) == NULL)
 	{
 		printf("bmfs error: Unable to open disk '%s'\n", diskname);
 		exit(EXIT_FAILURE);
 	}
-	else								// Opened ok, is it a valid BMFS disk?
-	{
-		fseek(disk, 0, SEEK_END);
-		disksize = ftell(disk);					// Disk size in Bytes
-		fseek(disk, 0, SEEK_SET);				// Seek to start for directory
-		retval = fread(Directory, 4096, 1, disk);		// Read 4096 bytes to the Directory buffer
-		rewind(disk);
-	}
 
 	if (strcasecmp(s_list, command) == 0)
 	{
@@ -181,74 +198,34 @@ int main(int argc, char *argv[])
 		printf("bmfs error: Unknown command\n");
 	}
 
-	if (disk != NULL)
-	{
-		fclose( disk );
-		disk = NULL;
-	}
+	bmfs_volume_close(volume);
 
 	return 0;
 }
 
 
-int bmfs_find(char *filename, struct BMFSEntry *fileentry, int *entrynumber)
-{
-	int tint;
-
-	for (tint = 0; tint < 64; tint++)
-	{
-		memcpy(pentry, Directory+(tint*64), 64);
-		if (entry.FileName[0] == 0x00)				// End of directory
-		{
-			tint = 64;
-		}
-		else if (entry.FileName[0] == 0x01)			// Empty entry
-		{
-			// Ignore
-		}
-		else							// Valid entry
-		{
-			if (strcmp(filename, entry.FileName) == 0)
-			{
-				memcpy(fileentry, pentry, 64);
-				*entrynumber = tint;
-				return 1;
-			}
-		}
-	}
-	return 0;
-}
-
-
 void bmfs_list(void)
 {
-	int tint;
+	struct BMFSEntry entries[64];
+	struct BMFSInfo info;
+	int count, tint;
 
-	printf("BMFS-Lite Drive Size: %d bytes\n", disksize);
+	bmfs_volume_query(volume, &info);
+	bmfs_volume_list(volume, entries, 64, &count);
+	printf("BMFS-Lite Drive Size: %d bytes\n", (int)info.DiskSize);
 	printf("Name                            |    Size | Reserved | Block\n");
 	printf("============================================================\n");
-	for (tint = 0; tint < 64; tint++)				// Max 64 entries
+	for (tint = 0; tint < count; tint++)
 	{
-		memcpy(pentry, Directory+(tint*64), 64);
-		if (entry.FileName[0] == 0x00)				// End of directory, bail out
-		{
-			tint = 64;
-		}
-		else if (entry.FileName[0] == 0x01)			// Empty entry
-		{
-			// Ignore
-		}
-		else							// Valid entry
-		{
-			printf("%-32s %8lld %10lld %7lld\n", entry.FileName, (long long int)entry.FileSize, (long long int)(entry.ReservedBlocks*blockSize), (long long int)entry.StartingBlock);
-		}
+		printf("%-32s %8lld %10lld %7lld\n", entries[tint].FileName, (long long int)entries[tint].FileSize, (long long int)(entries[tint].ReservedBlocks*blockSize), (long long int)entries[tint].StartingBlock);
 	}
 }
 
 
 void bmfs_format(void)
 {
-// Todo - overwrite entire file with zeros
+	if (bmfs_volume_format(volume) != BMFS_OK)
+		printf("bmfs error: Failed to write disk\n");
 }
 
 
@@ -404,12 +381,7 @@ int bmfs_initialize(char *diskname, char *size)
 		}
 	}
 
-	// Format the disk.
-	if (ret == 0)
-	{
-		rewind(disk);
-		bmfs_format();
-	}
+	// A disk of zeros has an empty directory, there is nothing to format
 
 	if (disk != NULL)
 	{
@@ -431,108 +403,30 @@ int bmfs_initialize(char *diskname, char *size)
 	return ret;
 }
 
-// helper function for qsort, sorts by StartingBlock field
-static int StartingBlockCmp(const void *pa, const void *pb)
-{
-	struct BMFSEntry *ea = (struct BMFSEntry *)pa;
-	struct BMFSEntry *eb = (struct BMFSEntry *)pb;
-	// empty records go to the end
-	if (ea->FileName[0] == 0x01)
-		return 1;
-	if (eb->FileName[0] == 0x01)
-		return -1;
-	// compare non-empty records by their starting blocks number
-	return (ea->StartingBlock - eb->StartingBlock);
-}
-
 void bmfs_create(char *filename, unsigned long long maxsize)
 {
-	struct BMFSEntry tempentry;
-	int slot;
-
-	if (bmfs_find(filename, &tempentry, &slot) == 0)
+	switch (bmfs_volume_create(volume, filename, maxsize / 2))
 	{
-		unsigned long long blocks_requested = maxsize / 2; // how many blocks to allocate
-		char dir_copy[4096]; // copy of directory
-		int num_used_entries = 0; // how many entries of Directory are either used or deleted
-		int first_free_entry = -1; // where to put new entry
-		int tint;
-		struct BMFSEntry *pEntry;
-		unsigned long long new_file_start = 0;
-
-		if(strlen(filename) > 31)
-		{
-			printf("bmfs error: Filename too long.\n");
-			return;
-		}
-
-		// Make a copy of Directory to play with
-		memcpy(dir_copy, Directory, 4096);
-
-		// Calculate number of files
-		for (tint = 0; tint < 64; tint++)
-		{
-			pEntry = (struct BMFSEntry *)(dir_copy + tint * 64); // points to the current directory entry
-			if (pEntry->FileName[0] == 0x00) // end of directory
-			{
-				num_used_entries = tint;
-				if (first_free_entry == -1)
-					first_free_entry = tint; // there were no unused entires before, will use this one
-				break;
-			}
-			else if (pEntry->FileName[0] == 0x01) // unused entry
-			{
-				if (first_free_entry == -1)
-					first_free_entry = tint; // will use it for our new file
-			}
-		}
-
-		if (first_free_entry == -1)
-		{
+		case BMFS_OK:
+			break;
+		case BMFS_EEXIST:
+			printf("bmfs error: File already exists.\n");
+			break;
+		case BMFS_EDIRFULL:
 			printf("bmfs error: Cannot create file. No free directory entries.\n");
-			return;
-		}
-
-		// Find an area with enough free blocks
-		// Sort our copy of the directory by starting block number
-		qsort(dir_copy, num_used_entries, 64, StartingBlockCmp);
-
-		for (tint = 0; tint < num_used_entries + 1; tint++)
-		{
-			// on each iteration of this loop we'll see if a new file can fit
-			// between the end of the previous file (initially == 1)
-			// and the beginning of the current file (or the last data block if there are no more files).
-
-			pEntry = (struct BMFSEntry *)(dir_copy + tint * 64); // points to the current directory entry
-
-			new_file_start += pEntry->ReservedBlocks;
-		}
-		new_file_start += 4; // Skip the directory
-
-		// Add file record to Directory
-		pEntry = (struct BMFSEntry *)(Directory + first_free_entry * 64);
-		pEntry->StartingBlock = new_file_start;
-		pEntry->ReservedBlocks = blocks_requested;
-		pEntry->FileSize = 0;
-		strcpy(pEntry->FileName, filename);
-
-		if (first_free_entry == num_used_entries && num_used_entries + 1 < 64)
-		{
-			// here we used the record that was marked with 0x00,
-			// so make sure to mark the next record with 0x00 if it exists
-			pEntry = (struct BMFSEntry *)(Directory + (num_used_entries + 1) * 64);
-			pEntry->FileName[0] = 0x00;
-		}
-
-		// Flush Directory to disk
-		fseek(disk, 0, SEEK_SET);				// Seek to start for directory
-		fwrite(Directory, 4096, 1, disk);			// Write 4096 bytes for the Directory
-
-		// printf("Complete: file %s starts at block %lld, directory entry #%d.\n", pEntry->FileName, pEntry->StartingBlock, first_free_entry);
-	}
-	else
-	{
-		printf("bmfs error: File already exists.\n");
+			break;
+		case BMFS_ENAME:
+			printf("bmfs error: Invalid file name.\n");
+			break;
+		case BMFS_ENOSPC:
+			printf("bmfs error: Cannot create file of size %lld bytes.\n", maxsize);
+			break;
+		case BMFS_EINVAL:
+			printf("bmfs-lite error: Invalid file size.\n");
+			break;
+		default:
+			printf("bmfs error: Failed to write disk\n");
+			break;
 	}
 }
 
@@ -541,65 +435,37 @@ void bmfs_read(char *filename)
 {
 	struct BMFSEntry tempentry;
 	FILE *tfile;
-	int slot, retval;
-	unsigned long long bytestoread;
+	size_t bytesread;
 	char *buffer;
 
-	if (0 == bmfs_find(filename, &tempentry, &slot))
+	if (bmfs_volume_find(volume, filename, &tempentry, NULL) != BMFS_OK)
 	{
 		printf("bmfs error: File not found in BMFS.\n");
 	}
+	else if ((tfile = fopen(tempentry.FileName, "wb")) == NULL)
+	{
+		printf("bmfs error: Could not open local file '%s'\n", tempentry.FileName);
+	}
 	else
 	{
-		if ((tfile = fopen(tempentry.FileName, "wb")) == NULL)
+		// Files are small, read it whole
+		if ((buffer = malloc(tempentry.FileSize + 1)) == NULL)
 		{
-			printf("bmfs error: Could not open local file '%s'\n", tempentry.FileName);
+			printf("bmfs error: Unable to allocate enough memory for buffer.\n");
 		}
 		else
 		{
-			bytestoread = tempentry.FileSize;
-			fseek(disk, tempentry.StartingBlock*blockSize, SEEK_SET); // Skip to the starting block in the disk
-			buffer = malloc(blockSize);
-			if (buffer == NULL)
+			if (bmfs_volume_read(volume, filename, 0, buffer, tempentry.FileSize, &bytesread) != BMFS_OK)
 			{
-				printf("bmfs error: Unable to allocate enough memory for buffer.\n");
+				printf("bmfs error: Unexpected read length detected.\n");
 			}
-			else
+			else if (bytesread != 0 && fwrite(buffer, bytesread, 1, tfile) != 1)
 			{
-				while (bytestoread != 0)
-				{
-					if (bytestoread >= blockSize)
-					{
-						retval = fread(buffer, blockSize, 1, disk);
-						if (retval == 1)
-						{
-							fwrite(buffer, blockSize, 1, tfile);
-							bytestoread -= blockSize;
-						}
-						else
-						{
-							printf("bmfs error: Unexpected read length detected.\n");
-							bytestoread = 0;
-						}
-					}
-					else
-					{
-						retval = fread(buffer, bytestoread, 1, disk);
-						if (retval == 1)
-						{
-							fwrite(buffer, bytestoread, 1, tfile);
-							bytestoread = 0;
-						}
-						else
-						{
-							printf("bmfs error: Unexpected read length detected.\n");
-							bytestoread = 0;
-						}
-					}
-				}
+				printf("bmfs error: Could not write local file '%s'\n", tempentry.FileName);
 			}
-			fclose(tfile);
+			free(buffer);
 		}
+		fclose(tfile);
 	}
 }
 
@@ -609,8 +475,7 @@ void bmfs_write(char *filename)
 {
 	struct BMFSEntry tempentry;
 	FILE *tfile;
-	int slot, retval;
-	unsigned long long tempfilesize;
+	unsigned long long tempfilesize, padded;
 	char *buffer;
 
 	if ((tfile = fopen(filename, "rb")) == NULL)
@@ -623,63 +488,32 @@ void bmfs_write(char *filename)
 		fseek(tfile, 0, SEEK_END);
 		tempfilesize = ftell(tfile);
 		rewind(tfile);
-		if (0 == bmfs_find(filename, &tempentry, &slot))
+		if (bmfs_volume_find(volume, filename, &tempentry, NULL) != BMFS_OK)
 		{
 			bmfs_create(filename, (tempfilesize+blockSize)/blockSize*2);
-			bmfs_find(filename, &tempentry, &slot);
+			if (bmfs_volume_find(volume, filename, &tempentry, NULL) != BMFS_OK)
+			{
+				fclose(tfile);
+				return;
+			}
 		}
+		padded = (tempfilesize+blockSize-1)/blockSize*blockSize;
 		if ((tempentry.ReservedBlocks*blockSize) < tempfilesize)
 		{
 			printf("bmfs error: Not enough reserved space in BMFS.\n");
 		}
+		else if ((buffer = calloc(1, padded + 1)) == NULL)
+		{
+			printf("bmfs error: Unable to allocate enough memory for buffer.\n");
+		}
 		else
 		{
-			fseek(disk, tempentry.StartingBlock*blockSize, SEEK_SET); // Skip to the starting block in the disk
-			buffer = malloc(blockSize);
-			if (buffer == NULL)
-			{
-				printf("bmfs error: Unable to allocate enough memory for buffer.\n");
-			}
-			else
-			{
-				while (tempfilesize != 0)
-				{
-					if (tempfilesize >= blockSize)
-					{
-						retval = fread(buffer, blockSize, 1, tfile);
-						if (retval == 1)
-						{
-							fwrite(buffer, blockSize, 1, disk);
-							tempfilesize -= blockSize;
-						}
-						else
-						{
-							printf("bmfs error: Unexpected read length detected.\n");
-							tempfilesize = 0;
-						}
-					}
-					else
-					{
-						retval = fread(buffer, tempfilesize, 1, tfile);
-						if (retval == 1)
-						{
-							memset(buffer+(tempfilesize), 0, (blockSize-tempfilesize)); // 0 the rest of the buffer
-							fwrite(buffer, blockSize, 1, disk);
-							tempfilesize = 0;
-						}
-						else
-						{
-							printf("bmfs error: Unexpected read length detected.\n");
-							tempfilesize = 0;
-						}
-					}
-				}
-			}
-			// Update directory
-			tempfilesize = ftell(tfile);
-			memcpy(Directory+(slot*64)+48, &tempfilesize, 8);
-			fseek(disk, 0, SEEK_SET);			// Seek to directory
-			fwrite(Directory, 4096, 1, disk);		// Write new directory to disk
+			// Whole blocks with the rest of the last one zeroed, then the real size
+			if (tempfilesize != 0 && fread(buffer, tempfilesize, 1, tfile) != 1)
+				printf("bmfs error: Unexpected read length detected.\n");
+			else if (bmfs_volume_write(volume, filename, 0, buffer, padded) != BMFS_OK || bmfs_volume_setsize(volume, filename, tempfilesize) != BMFS_OK)
+				printf("bmfs error: Failed to write disk\n");
+			free(buffer);
 		}
 		fclose(tfile);
 	}
@@ -0,0 +1,1126 @@
+/* BareMetal File System Library */
+/* Volume handles for BMFS and BMFS-Lite disks */
+/* v1.0 (2026 10 15) */
+
+/* Feature test macros */
+#if defined(__linux__)
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+#endif
+
+/* Global includes */
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include "libbmfs.h"
+
+/* Platform includes */
+#if defined(__unix__) || defined(__APPLE__)
+#define BMFS_POSIX
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#if defined(__linux__)
+#include <linux/fs.h>
+#elif defined(__APPLE__)
+#include <sys/disk.h>
+#endif
+#define BMFS_THREADS
+#include <pthread.h>
+#endif
+
+/* Typedefs */
+typedef uint64_t u64;
+
+#ifdef BMFS_THREADS
+// Blocks locked by one thread of a handle. The lock on the disk is shared
+// by the whole handle, so the threads are kept apart here.
+struct BMFSRange
+{
+	u64 start, end;		// Bytes
+	int type;
+	int pending;		// Still waiting for the lock on the disk
+	pthread_t owner;
+};
+#endif
+
+struct BMFSVolume
+{
+	const struct BMFSVolumeIO *io;
+	void *ctx;
+	int flags;
+	u64 disksize;		// Bytes
+	u64 blocksize;
+	u64 diroffset;		// Byte offset of the directory
+	u64 firstblock;		// First block files can use
+	u64 endblock;		// Files end before this block
+	int deferred, dirty;	// Directory changes waiting for bmfs_volume_flush
+	int holds, held;	// Nesting and type of the directory lock on the disk
+	char directory[4096];
+
+#ifdef BMFS_THREADS
+	pthread_mutex_t lock;
+
+	// Blocks locked by the threads of the handle
+	struct BMFSRange *ranges;
+	int nranges, maxranges;
+	pthread_mutex_t rangelock;
+	pthread_cond_t rangewait;
+#endif
+
+	// Built-in disk access of bmfs_volume_open
+	FILE *fp;
+	int fd;
+	char *map;
+};
+
+/* Global constants */
+static const char fs_tag[] = "BMFS";
+
+
+/* Locking */
+
+// Threads sharing the handle
+static void volume_mutex_lock(BMFSVolume *vol)
+{
+#ifdef BMFS_THREADS
+	pthread_mutex_lock(&vol->lock);
+#else
+	(void)vol;
+#endif
+}
+
+static void volume_mutex_unlock(BMFSVolume *vol)
+{
+#ifdef BMFS_THREADS
+	pthread_mutex_unlock(&vol->lock);
+#else
+	(void)vol;
+#endif
+}
+
+
+// Lock a byte range of the disk against other processes. Open file
+// description locks are used where available, so two handles on the same
+// disk exclude each other even within one process.
+int bmfs_fd_lock(int fd, int type, uint64_t offset, uint64_t len)
+{
+#ifdef BMFS_POSIX
+	struct flock fl;
+	int cmd = F_SETLKW;
+
+	memset(&fl, 0, sizeof(fl));
+	fl.l_type = (type == BMFS_EXCLUSIVE) ? F_WRLCK : (type == BMFS_SHARED) ? F_RDLCK : F_UNLCK;
+	fl.l_whence = SEEK_SET;
+	fl.l_start = (off_t)offset;
+	fl.l_len = (off_t)len;
+#ifdef F_OFD_SETLKW
+	cmd = F_OFD_SETLKW;
+#endif
+	while (fcntl(fd, cmd, &fl) != 0)
+	{
+		if (errno == EINTR)
+			continue;
+#ifdef F_OFD_SETLKW
+		if (cmd == F_OFD_SETLKW && errno == EINVAL)	// Kernel without OFD locks
+		{
+			cmd = F_SETLKW;
+			continue;
+		}
+#endif
+		return BMFS_EIO;
+	}
+#else
+	(void)fd; (void)type; (void)offset; (void)len;
+#endif
+	return BMFS_OK;
+}
+
+
+// Lock len bytes of the disk at offset through the disk access functions.
+// Locking is advisory, a disk that cannot be locked is used anyway.
+static void volume_range(BMFSVolume *vol, int type, u64 offset, u64 len)
+{
+	if (type == BMFS_EXCLUSIVE && (vol->flags & BMFS_READONLY))
+		type = BMFS_SHARED;				// Read only descriptors cannot hold write locks
+	if (vol->io->lock != NULL && len != 0)			// 0 would mean up to the end of the disk
+		vol->io->lock(vol->ctx, type, offset, len);
+}
+
+#ifdef BMFS_THREADS
+// The first byte from pos on that no range covers, leaving out the calling
+// thread's ranges if others is set and pending ones if held is set. Called
+// with rangelock held.
+static u64 range_skip(BMFSVolume *vol, u64 pos, int others, int held)
+{
+	struct BMFSRange *r;
+	int i, moved = 1;
+
+	while (moved)
+	{
+		moved = 0;
+		for (i = 0; i < vol->nranges; i++)
+		{
+			r = &vol->ranges[i];
+			if ((others && pthread_equal(r->owner, pthread_self())) || (held && r->pending))
+				continue;
+			if (r->start <= pos && r->end > pos)
+			{
+				pos = r->end;
+				moved = 1;
+			}
+		}
+	}
+	return pos;
+}
+
+// Drop the parts of the calling thread's ranges inside [start, end). The
+// table has room for the one extra range a split needs. Called with
+// rangelock held.
+static void range_cut(BMFSVolume *vol, u64 start, u64 end)
+{
+	struct BMFSRange *r;
+	int i;
+
+	for (i = 0; i < vol->nranges; i++)
+	{
+		r = &vol->ranges[i];
+		if (!pthread_equal(r->owner, pthread_self()) || r->end <= start || r->start >= end)
+			continue;
+		if (r->start < start && r->end > end)		// Keep both ends
+		{
+			vol->ranges[vol->nranges] = *r;
+			vol->ranges[vol->nranges++].start = end;
+			r->end = start;
+		}
+		else if (r->start < start)
+			r->end = start;
+		else if (r->end > end)
+			r->start = end;
+		else
+			vol->ranges[i--] = vol->ranges[--vol->nranges];
+	}
+}
+#endif
+
+// Lock or unlock len bytes of blocks at offset for the calling thread. Other
+// threads of the handle wait like other processes do, and the disk is only
+// locked or unlocked where no other thread still needs it. A thread's own
+// locks are changed in place, as the disk's are.
+static void volume_extent(BMFSVolume *vol, int type, u64 offset, u64 len)
+{
+#ifdef BMFS_THREADS
+	struct BMFSRange *r, *more;
+	u64 end = offset + len, pos, next;
+	int i, conflict, ondisk;
+
+	if (len == 0)
+		return;
+	pthread_mutex_lock(&vol->rangelock);
+	if (vol->nranges + 2 > vol->maxranges)
+	{
+		if ((more = realloc(vol->ranges, (vol->maxranges + 16) * sizeof(*more))) == NULL)
+		{
+			pthread_mutex_unlock(&vol->rangelock);
+			volume_range(vol, type, offset, len);	// Other processes are still kept out
+			return;
+		}
+		vol->ranges = more;
+		vol->maxranges += 16;
+	}
+	do
+	{
+		conflict = 0;
+		for (i = 0; i < vol->nranges && type != BMFS_UNLOCK && !conflict; i++)
+		{
+			r = &vol->ranges[i];
+			conflict = (!pthread_equal(r->owner, pthread_self()) && r->start < end && r->end > offset && (type == BMFS_EXCLUSIVE || r->type == BMFS_EXCLUSIVE));
+		}
+		if (conflict)
+			pthread_cond_wait(&vol->rangewait, &vol->rangelock);
+	} while (conflict);
+	range_cut(vol, offset, end);
+
+	if (type == BMFS_UNLOCK)
+	{
+		// Unlock the gaps between what other ranges still cover
+		for (pos = range_skip(vol, offset, 0, 0); pos < end; pos = range_skip(vol, next, 0, 0))
+		{
+			for (next = end, i = 0; i < vol->nranges; i++)
+				if (vol->ranges[i].start > pos && vol->ranges[i].start < next)
+					next = vol->ranges[i].start;
+			volume_range(vol, BMFS_UNLOCK, pos, next - pos);
+		}
+		pthread_cond_broadcast(&vol->rangewait);
+		pthread_mutex_unlock(&vol->rangelock);
+		return;
+	}
+
+	// Other threads' shared locks may already hold the disk
+	ondisk = (type == BMFS_SHARED && range_skip(vol, offset, 1, 1) >= end);
+	r = &vol->ranges[vol->nranges++];
+	r->start = offset;
+	r->end = end;
+	r->type = type;
+	r->pending = !ondisk;
+	r->owner = pthread_self();
+	if (ondisk)
+	{
+		pthread_mutex_unlock(&vol->rangelock);
+		return;
+	}
+
+	// Wait for other processes with the table free
+	pthread_mutex_unlock(&vol->rangelock);
+	volume_range(vol, type, offset, len);
+	pthread_mutex_lock(&vol->rangelock);
+	for (i = 0; i < vol->nranges; i++)
+	{
+		r = &vol->ranges[i];
+		if (r->pending && r->start == offset && r->end == end && pthread_equal(r->owner, pthread_self()))
+			r->pending = 0;
+	}
+	pthread_cond_broadcast(&vol->rangewait);
+	pthread_mutex_unlock(&vol->rangelock);
+#else
+	volume_range(vol, type, offset, len);
+#endif
+}
+
+// Hold the directory lock of the disk, counting nested holds. The first hold
+// reloads the directory (if reload is set) so changes made by other processes
+// are seen. Called with the mutex held.
+static void volume_hold(BMFSVolume *vol, int type, int reload)
+{
+	char dir[4096];
+
+	if (vol->holds++ != 0 && type <= vol->held)
+		return;
+	volume_range(vol, type, vol->diroffset, 4096);
+	vol->held = type;
+	if (reload && !vol->dirty && vol->io->read(vol->ctx, dir, 4096, vol->diroffset) == 0)
+		memcpy(vol->directory, dir, 4096);
+}
+
+static void volume_release(BMFSVolume *vol)
+{
+	if (--vol->holds == 0)
+	{
+		volume_range(vol, BMFS_UNLOCK, vol->diroffset, 4096);
+		vol->held = BMFS_UNLOCK;
+	}
+}
+
+// Read access to the directory
+static void volume_enter(BMFSVolume *vol)
+{
+	volume_mutex_lock(vol);
+	volume_hold(vol, BMFS_SHARED, 1);
+}
+
+static void volume_leave(BMFSVolume *vol)
+{
+	volume_release(vol);
+	volume_mutex_unlock(vol);
+}
+
+
+// Exclusive access to the directory, current as of the first lock
+void bmfs_volume_lock(BMFSVolume *vol)
+{
+	volume_mutex_lock(vol);
+	volume_hold(vol, BMFS_EXCLUSIVE, 1);
+}
+
+
+void bmfs_volume_unlock(BMFSVolume *vol)
+{
+	volume_leave(vol);
+}
+
+
+// Lock the reserved blocks of entry, or unlock them with BMFS_UNLOCK
+int bmfs_volume_lockextent(BMFSVolume *vol, const struct BMFSEntry *entry, int type)
+{
+	volume_extent(vol, type, entry->StartingBlock * vol->blocksize, entry->ReservedBlocks * vol->blocksize);
+	return BMFS_OK;
+}
+
+
+// Find a file and lock its blocks. They are waited for with the directory
+// free, so a holder of blocks can always get the directory, and the file is
+// then looked up again in case it was moved or deleted in the meantime.
+int bmfs_volume_lockfile(BMFSVolume *vol, const char *name, int type, struct BMFSEntry *entry)
+{
+	struct BMFSEntry current;
+	int ret;
+
+	if ((ret = bmfs_volume_find(vol, name, entry, NULL)) != BMFS_OK)
+		return ret;
+	for (;;)
+	{
+		bmfs_volume_lockextent(vol, entry, type);
+		ret = bmfs_volume_find(vol, name, &current, NULL);
+		if (ret == BMFS_OK && current.StartingBlock == entry->StartingBlock && current.ReservedBlocks == entry->ReservedBlocks)
+		{
+			*entry = current;				// The length may have changed
+			return BMFS_OK;
+		}
+		bmfs_volume_lockextent(vol, entry, BMFS_UNLOCK);
+		if (ret != BMFS_OK)
+			return ret;
+		*entry = current;
+	}
+}
+
+
+/* Built-in disk access, pread/pwrite or a mapping where available */
+
+static int file_read(void *ctx, void *buf, size_t len, u64 offset)
+{
+	BMFSVolume *vol = ctx;
+#ifdef BMFS_POSIX
+	char *p = buf;
+	ssize_t n;
+
+	if (vol->map != NULL)
+	{
+		if (offset + len > vol->disksize)
+			return 1;
+		memcpy(buf, vol->map + offset, len);
+		return 0;
+	}
+	while (len != 0)
+	{
+		n = pread(vol->fd, p, len, (off_t)offset);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)					// Error or unexpected end of disk
+			return 1;
+		p += n;
+		len -= n;
+		offset += n;
+	}
+	return 0;
+#else
+	int ret;
+
+	volume_mutex_lock(vol);					// One file position for all callers
+	ret = (fseek(vol->fp, (long)offset, SEEK_SET) != 0 || fread(buf, len, 1, vol->fp) != 1);
+	volume_mutex_unlock(vol);
+	return ret;
+#endif
+}
+
+static int file_write(void *ctx, const void *buf, size_t len, u64 offset)
+{
+	BMFSVolume *vol = ctx;
+#ifdef BMFS_POSIX
+	const char *p = buf;
+	ssize_t n;
+
+	if (vol->map != NULL)
+	{
+		if (offset + len > vol->disksize)
+			return 1;
+		memcpy(vol->map + offset, buf, len);
+		return 0;
+	}
+	while (len != 0)
+	{
+		n = pwrite(vol->fd, p, len, (off_t)offset);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return 1;
+		p += n;
+		len -= n;
+		offset += n;
+	}
+	return 0;
+#else
+	int ret;
+
+	volume_mutex_lock(vol);
+	ret = (fseek(vol->fp, (long)offset, SEEK_SET) != 0 || fwrite(buf, len, 1, vol->fp) != 1);
+	volume_mutex_unlock(vol);
+	return ret;
+#endif
+}
+
+static u64 file_size(void *ctx)
+{
+	BMFSVolume *vol = ctx;
+#ifdef BMFS_POSIX
+	struct stat st;
+#if defined(BLKGETSIZE64)
+	u64 size;
+#elif defined(DKIOCGETBLOCKCOUNT)
+	u64 count;
+	uint32_t sector;
+#endif
+
+	if (fstat(vol->fd, &st) != 0)
+		return 0;
+	if (!S_ISBLK(st.st_mode))
+		return st.st_size;
+#if defined(BLKGETSIZE64)
+	if (ioctl(vol->fd, BLKGETSIZE64, &size) == 0)
+		return size;
+#elif defined(DKIOCGETBLOCKCOUNT)
+	if (ioctl(vol->fd, DKIOCGETBLOCKCOUNT, &count) == 0 && ioctl(vol->fd, DKIOCGETBLOCKSIZE, &sector) == 0)
+		return count * sector;
+#endif
+	return lseek(vol->fd, 0, SEEK_END);
+#else
+	fseek(vol->fp, 0, SEEK_END);
+	return ftell(vol->fp);
+#endif
+}
+
+static int file_lock(void *ctx, int type, u64 offset, u64 len)
+{
+	BMFSVolume *vol = ctx;
+
+	return (vol->fd < 0) ? BMFS_OK : bmfs_fd_lock(vol->fd, type, offset, len);
+}
+
+static void file_close(void *ctx)
+{
+	BMFSVolume *vol = ctx;
+
+#ifdef BMFS_POSIX
+	if (vol->map != NULL)
+		munmap(vol->map, vol->disksize);
+	if (vol->fd >= 0)
+		close(vol->fd);
+#endif
+	if (vol->fp != NULL)
+		fclose(vol->fp);
+}
+
+static const struct BMFSVolumeIO file_io = { file_read, file_write, file_size, file_close, file_lock };
+
+
+/* Opening and closing */
+
+// Allocate a handle and set up its lock
+static BMFSVolume *volume_new(int flags)
+{
+	BMFSVolume *vol = calloc(1, sizeof(BMFSVolume));
+#ifdef BMFS_THREADS
+	pthread_mutexattr_t attr;
+#endif
+
+	if (vol == NULL)
+		return NULL;
+	vol->flags = flags;
+	vol->fd = -1;
+#ifdef BMFS_THREADS
+	// Recursive, so callers holding bmfs_volume_lock can still use the API
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+	pthread_mutex_init(&vol->lock, &attr);
+	pthread_mutexattr_destroy(&attr);
+	pthread_mutex_init(&vol->rangelock, NULL);
+	pthread_cond_init(&vol->rangewait, NULL);
+#endif
+	return vol;
+}
+
+static void volume_free(BMFSVolume *vol)
+{
+#ifdef BMFS_THREADS
+	pthread_mutex_destroy(&vol->lock);
+	pthread_mutex_destroy(&vol->rangelock);
+	pthread_cond_destroy(&vol->rangewait);
+	free(vol->ranges);
+#endif
+	free(vol);
+}
+
+// Work out the geometry and load the directory. Returns 0 or an error code.
+static int volume_load(BMFSVolume *vol)
+{
+	char info[512];
+	int ret;
+
+	vol->disksize = vol->io->size(vol->ctx);
+	if (vol->flags & BMFS_LITE)
+	{
+		vol->blocksize = 1024;
+		vol->diroffset = 0;
+		vol->firstblock = 4;				// After the directory
+		vol->endblock = vol->disksize / vol->blocksize;
+	}
+	else
+	{
+		vol->blocksize = 2 * 1024 * 1024;
+		vol->diroffset = 4096;
+		vol->firstblock = 1;				// Block 0 holds the boot loader and directory
+		vol->endblock = vol->disksize / vol->blocksize;
+		if (vol->endblock > 0)
+			vol->endblock--;			// The last block is never used
+	}
+	if (vol->disksize < vol->diroffset + 4096)
+		return BMFS_EFORMAT;
+	if (!(vol->flags & (BMFS_LITE | BMFS_NOCHECK)))
+	{
+		volume_range(vol, BMFS_SHARED, 1024, 512);
+		ret = vol->io->read(vol->ctx, info, 512, 1024);
+		volume_range(vol, BMFS_UNLOCK, 1024, 512);
+		if (ret != 0)
+			return BMFS_EIO;
+		info[511] = 0;
+		if (strcasecmp(info, fs_tag) != 0)
+			return BMFS_EFORMAT;
+	}
+	volume_range(vol, BMFS_SHARED, vol->diroffset, 4096);
+	ret = vol->io->read(vol->ctx, vol->directory, 4096, vol->diroffset);
+	volume_range(vol, BMFS_UNLOCK, vol->diroffset, 4096);
+	return (ret != 0) ? BMFS_EIO : BMFS_OK;
+}
+
+
+// Open a volume through caller supplied disk access
+BMFSVolume *bmfs_volume_attach(const struct BMFSVolumeIO *io, void *ctx, int flags, int *error)
+{
+	BMFSVolume *vol;
+	int ret;
+
+	if (io == NULL || io->read == NULL || io->write == NULL || io->size == NULL)
+		ret = BMFS_EINVAL;
+	else if ((vol = volume_new(flags)) == NULL)
+		ret = BMFS_ENOMEM;
+	else
+	{
+		vol->io = io;
+		vol->ctx = ctx;
+		if ((ret = volume_load(vol)) == BMFS_OK)
+		{
+			if (error != NULL)
+				*error = BMFS_OK;
+			return vol;
+		}
+		volume_free(vol);
+	}
+	if (error != NULL)
+		*error = ret;
+	return NULL;
+}
+
+
+// Open the disk or disk image at path
+BMFSVolume *bmfs_volume_open(const char *path, int flags, int *error)
+{
+	BMFSVolume *vol;
+	int ret;
+
+	if ((vol = volume_new(flags)) == NULL)
+	{
+		if (error != NULL)
+			*error = BMFS_ENOMEM;
+		return NULL;
+	}
+	vol->io = &file_io;
+	vol->ctx = vol;
+#ifdef BMFS_POSIX
+	vol->fd = open(path, (flags & BMFS_READONLY) ? O_RDONLY : O_RDWR);
+	ret = (vol->fd < 0) ? BMFS_EIO : BMFS_OK;
+	if (ret == BMFS_OK && (flags & BMFS_MMAP))
+	{
+		vol->disksize = file_size(vol);
+		vol->map = mmap(NULL, vol->disksize, (flags & BMFS_READONLY) ? PROT_READ : (PROT_READ | PROT_WRITE), MAP_SHARED, vol->fd, 0);
+		if (vol->map == MAP_FAILED)
+			vol->map = NULL;			// Fall back to pread/pwrite
+	}
+#else
+	vol->fp = fopen(path, (flags & BMFS_READONLY) ? "rb" : "r+b");
+	ret = (vol->fp == NULL) ? BMFS_EIO : BMFS_OK;
+#endif
+	if (ret == BMFS_OK)
+		ret = volume_load(vol);
+	if (ret != BMFS_OK)
+	{
+		file_close(vol);
+		volume_free(vol);
+		vol = NULL;
+	}
+	if (error != NULL)
+		*error = ret;
+	return vol;
+}
+
+
+// Write any deferred directory changes and release the handle
+int bmfs_volume_close(BMFSVolume *vol)
+{
+	int ret;
+
+	if (vol == NULL)
+		return BMFS_OK;
+	ret = bmfs_volume_defer(vol, 0);
+	if (vol->io->close != NULL)
+		vol->io->close(vol->ctx);
+	volume_free(vol);
+	return ret;
+}
+
+
+const char *bmfs_strerror(int error)
+{
+	switch (error)
+	{
+		case BMFS_OK:
+			return "Success";
+		case BMFS_EIO:
+			return "Disk I/O error";
+		case BMFS_ENOTFOUND:
+			return "File not found in BMFS";
+		case BMFS_EEXIST:
+			return "File already exists";
+		case BMFS_ENOSPC:
+			return "Not enough space in BMFS";
+		case BMFS_EDIRFULL:
+			return "No free directory entries";
+		case BMFS_ENAME:
+			return "Invalid file name";
+		case BMFS_EFORMAT:
+			return "Not a valid BMFS drive";
+		case BMFS_ERANGE:
+			return "Offset is past the end of the file";
+		case BMFS_ENOMEM:
+			return "Out of memory";
+		case BMFS_EREADONLY:
+			return "Volume is read only";
+		default:
+			return "Invalid argument";
+	}
+}
+
+
+/* Directory */
+
+// Slot of a file, or -1. Called with the lock held.
+static int volume_slot(BMFSVolume *vol, const char *name)
+{
+	struct BMFSEntry *pEntry;
+	int tint;
+
+	for (tint = 0; tint < 64; tint++)
+	{
+		pEntry = (struct BMFSEntry *)(vol->directory + tint * 64);
+		if (pEntry->FileName[0] == 0x00)			// End of directory
+			break;
+		if (pEntry->FileName[0] != 0x01 && strncmp(name, pEntry->FileName, 32) == 0)
+			return tint;
+	}
+	return -1;
+}
+
+// helper function for qsort, sorts by StartingBlock field
+int bmfs_entry_cmp(const void *pa, const void *pb)
+{
+	const struct BMFSEntry *ea = pa;
+	const struct BMFSEntry *eb = pb;
+	// empty records go to the end
+	if (ea->FileName[0] == 0x01)
+		return (eb->FileName[0] == 0x01) ? 0 : 1;
+	if (eb->FileName[0] == 0x01)
+		return -1;
+	// compare non-empty records by their starting blocks number
+	return (ea->StartingBlock > eb->StartingBlock) - (ea->StartingBlock < eb->StartingBlock);
+}
+
+// Walk the gaps between files in disk order. Returns the start of the first
+// gap of at least want blocks (0 if none), with the total and largest free
+// space in *freeblocks and *largest. Called with the lock held.
+static u64 volume_gaps(BMFSVolume *vol, u64 want, u64 *freeblocks, u64 *largest)
+{
+	char dir_copy[4096];
+	struct BMFSEntry *pEntry;
+	u64 prev_file_end = vol->firstblock, this_file_start, gap, found = 0;
+	int count = 0, tint;
+
+	memcpy(dir_copy, vol->directory, 4096);
+	while (count < 64 && dir_copy[count * 64] != 0x00)
+		count++;
+	qsort(dir_copy, count, 64, bmfs_entry_cmp);
+	*freeblocks = 0;
+	*largest = 0;
+	for (tint = 0; tint <= count; tint++)
+	{
+		pEntry = (struct BMFSEntry *)(dir_copy + tint * 64);
+		if (tint == count || pEntry->FileName[0] == 0x01)	// Deleted entries are sorted last
+			this_file_start = vol->endblock;
+		else
+			this_file_start = pEntry->StartingBlock;
+		gap = (this_file_start > prev_file_end) ? this_file_start - prev_file_end : 0;
+		*freeblocks += gap;
+		if (gap > *largest)
+			*largest = gap;
+		if (found == 0 && want != 0 && gap >= want)
+			found = prev_file_end;
+		if (tint == count || pEntry->FileName[0] == 0x01)
+			break;
+		if (pEntry->StartingBlock + pEntry->ReservedBlocks > prev_file_end)
+			prev_file_end = pEntry->StartingBlock + pEntry->ReservedBlocks;
+	}
+	return found;
+}
+
+
+int bmfs_volume_query(BMFSVolume *vol, struct BMFSInfo *info)
+{
+	struct BMFSEntry *pEntry;
+	int tint;
+
+	volume_enter(vol);
+	memset(info, 0, sizeof(*info));
+	info->DiskSize = vol->disksize;
+	info->BlockSize = vol->blocksize;
+	info->DataBlocks = (vol->endblock > vol->firstblock) ? vol->endblock - vol->firstblock : 0;
+	volume_gaps(vol, 0, &info->FreeBlocks, &info->LargestFree);
+	for (tint = 0; tint < 64; tint++)
+	{
+		pEntry = (struct BMFSEntry *)(vol->directory + tint * 64);
+		if (pEntry->FileName[0] == 0x00)
+		{
+			info->FreeEntries += 64 - tint;
+			break;
+		}
+		if (pEntry->FileName[0] == 0x01)
+			info->FreeEntries++;
+		else
+			info->Files++;
+	}
+	volume_leave(vol);
+	return BMFS_OK;
+}
+
+
+int bmfs_volume_find(BMFSVolume *vol, const char *name, struct BMFSEntry *entry, int *slot)
+{
+	int tint;
+
+	volume_enter(vol);
+	tint = volume_slot(vol, name);
+	if (tint >= 0 && entry != NULL)
+		memcpy(entry, vol->directory + tint * 64, 64);
+	if (tint >= 0 && slot != NULL)
+		*slot = tint;
+	volume_leave(vol);
+	return (tint >= 0) ? BMFS_OK : BMFS_ENOTFOUND;
+}
+
+
+// Copy up to max files in directory order to entries, with the number of
+// files (which may be more than max) in *count
+int bmfs_volume_list(BMFSVolume *vol, struct BMFSEntry *entries, int max, int *count)
+{
+	struct BMFSEntry *pEntry;
+	int tint, n = 0;
+
+	volume_enter(vol);
+	for (tint = 0; tint < 64; tint++)
+	{
+		pEntry = (struct BMFSEntry *)(vol->directory + tint * 64);
+		if (pEntry->FileName[0] == 0x00)
+			break;
+		if (pEntry->FileName[0] == 0x01)
+			continue;
+		if (n < max)
+			entries[n] = *pEntry;
+		n++;
+	}
+	volume_leave(vol);
+	*count = n;
+	return BMFS_OK;
+}
+
+
+// Reserve blocks for a new, empty file in the first gap that holds them
+int bmfs_volume_create(BMFSVolume *vol, const char *name, uint64_t blocks)
+{
+	return bmfs_volume_reserve(vol, name, blocks, NULL, NULL);
+}
+
+
+// Is name usable for a new file? It must fit the entry and be safe to use
+// as a local file name in a directory, so no path separators, "." or "..".
+int bmfs_name_valid(const char *name)
+{
+	return (name[0] != 0x00 && name[0] != 0x01 && strlen(name) <= 31 && strpbrk(name, "/\\") == NULL && strcmp(name, ".") != 0 && strcmp(name, "..") != 0);
+}
+
+
+// Create a file and return its entry in the same locked step, so the blocks
+// can be written before anyone else changes the directory
+int bmfs_volume_reserve(BMFSVolume *vol, const char *name, uint64_t blocks, struct BMFSEntry *entry, int *slot)
+{
+	struct BMFSEntry *pEntry;
+	int num_used_entries = 0, first_free_entry = -1, tint, ret = BMFS_OK;
+	u64 start, freeblocks, largest;
+
+	if (vol->flags & BMFS_READONLY)
+		return BMFS_EREADONLY;
+	if (!bmfs_name_valid(name))
+		return BMFS_ENAME;
+	if (blocks == 0)
+		return BMFS_EINVAL;
+
+	bmfs_volume_lock(vol);
+	for (tint = 0; tint < 64; tint++)
+	{
+		pEntry = (struct BMFSEntry *)(vol->directory + tint * 64);
+		if (pEntry->FileName[0] == 0x00)		// end of directory
+		{
+			num_used_entries = tint;
+			if (first_free_entry == -1)
+				first_free_entry = tint;
+			break;
+		}
+		else if (pEntry->FileName[0] == 0x01)		// unused entry
+		{
+			if (first_free_entry == -1)
+				first_free_entry = tint;
+		}
+	}
+	if (volume_slot(vol, name) >= 0)
+		ret = BMFS_EEXIST;
+	else if (first_free_entry == -1)
+		ret = BMFS_EDIRFULL;
+	else if ((start = volume_gaps(vol, blocks, &freeblocks, &largest)) == 0)
+		ret = BMFS_ENOSPC;
+	else
+	{
+		pEntry = (struct BMFSEntry *)(vol->directory + first_free_entry * 64);
+		memset(pEntry, 0, 64);
+		strcpy(pEntry->FileName, name);
+		pEntry->StartingBlock = start;
+		pEntry->ReservedBlocks = blocks;
+		if (first_free_entry == num_used_entries && num_used_entries + 1 < 64)
+		{
+			// here we used the record that was marked with 0x00,
+			// so make sure to mark the next record with 0x00 if it exists
+			vol->directory[(num_used_entries + 1) * 64] = 0x00;
+		}
+		if (entry != NULL)
+			*entry = *pEntry;
+		if (slot != NULL)
+			*slot = first_free_entry;
+		ret = bmfs_volume_commit(vol, -1);
+	}
+	bmfs_volume_unlock(vol);
+	return ret;
+}
+
+
+int bmfs_volume_delete(BMFSVolume *vol, const char *name)
+{
+	int slot, ret = BMFS_ENOTFOUND;
+
+	if (vol->flags & BMFS_READONLY)
+		return BMFS_EREADONLY;
+	bmfs_volume_lock(vol);
+	if ((slot = volume_slot(vol, name)) >= 0)
+	{
+		vol->directory[slot * 64] = 0x01;
+		ret = bmfs_volume_commit(vol, slot);
+	}
+	bmfs_volume_unlock(vol);
+	return ret;
+}
+
+
+// Write an empty directory, and the disk info of a BMFS disk
+int bmfs_volume_format(BMFSVolume *vol)
+{
+	char info[512];
+	int ret = BMFS_OK;
+
+	if (vol->flags & BMFS_READONLY)
+		return BMFS_EREADONLY;
+	bmfs_volume_lock(vol);
+	memset(vol->directory, 0, 4096);
+	if (!(vol->flags & BMFS_LITE))
+	{
+		memset(info, 0, 512);
+		memcpy(info, fs_tag, 4);			// Add the 'BMFS' tag
+		volume_range(vol, BMFS_EXCLUSIVE, 1024, 512);
+		if (vol->io->write(vol->ctx, info, 512, 1024) != 0)
+			ret = BMFS_EIO;
+		volume_range(vol, BMFS_UNLOCK, 1024, 512);
+	}
+	vol->dirty = 0;
+	if (ret == BMFS_OK && vol->io->write(vol->ctx, vol->directory, 4096, vol->diroffset) != 0)
+		ret = BMFS_EIO;
+	bmfs_volume_unlock(vol);
+	return ret;
+}
+
+
+/* File data */
+
+int bmfs_volume_read(BMFSVolume *vol, const char *name, uint64_t offset, void *buf, size_t len, size_t *done)
+{
+	struct BMFSEntry entry;
+	int ret;
+
+	*done = 0;
+	if ((ret = bmfs_volume_lockfile(vol, name, BMFS_SHARED, &entry)) != BMFS_OK)
+		return ret;
+	if (offset > entry.FileSize)
+		ret = BMFS_ERANGE;
+	else
+	{
+		if (len > entry.FileSize - offset)
+			len = entry.FileSize - offset;
+		if (len != 0 && vol->io->read(vol->ctx, buf, len, entry.StartingBlock * vol->blocksize + offset) != 0)
+			ret = BMFS_EIO;
+		else
+			*done = len;
+	}
+	bmfs_volume_lockextent(vol, &entry, BMFS_UNLOCK);
+	return ret;
+}
+
+
+int bmfs_volume_write(BMFSVolume *vol, const char *name, uint64_t offset, const void *buf, size_t len)
+{
+	struct BMFSEntry entry, *pEntry;
+	int slot, ret;
+
+	if (vol->flags & BMFS_READONLY)
+		return BMFS_EREADONLY;
+	if ((ret = bmfs_volume_lockfile(vol, name, BMFS_EXCLUSIVE, &entry)) != BMFS_OK)
+		return ret;
+	if (offset > entry.FileSize)
+		ret = BMFS_ERANGE;
+	else if (offset + len > entry.ReservedBlocks * vol->blocksize)
+		ret = BMFS_ENOSPC;
+	// The data goes straight to the reserved blocks, only the size update
+	// needs the directory. It is made before the blocks are released, so a
+	// writer waiting for them sees the new size.
+	else if (len != 0 && vol->io->write(vol->ctx, buf, len, entry.StartingBlock * vol->blocksize + offset) != 0)
+		ret = BMFS_EIO;
+	if (ret == BMFS_OK)
+	{
+		bmfs_volume_lock(vol);
+		slot = volume_slot(vol, name);
+		pEntry = (slot >= 0) ? (struct BMFSEntry *)(vol->directory + slot * 64) : NULL;
+		if (pEntry != NULL && pEntry->StartingBlock == entry.StartingBlock && offset + len > pEntry->FileSize)
+		{
+			pEntry->FileSize = offset + len;
+			ret = bmfs_volume_commit(vol, slot);
+		}
+		bmfs_volume_unlock(vol);
+	}
+	bmfs_volume_lockextent(vol, &entry, BMFS_UNLOCK);
+	return ret;
+}
+
+
+int bmfs_volume_setsize(BMFSVolume *vol, const char *name, uint64_t size)
+{
+	struct BMFSEntry *pEntry;
+	int slot, ret = BMFS_OK;
+
+	if (vol->flags & BMFS_READONLY)
+		return BMFS_EREADONLY;
+	bmfs_volume_lock(vol);
+	if ((slot = volume_slot(vol, name)) < 0)
+		ret = BMFS_ENOTFOUND;
+	else
+	{
+		pEntry = (struct BMFSEntry *)(vol->directory + slot * 64);
+		if (size > pEntry->ReservedBlocks * vol->blocksize)
+			ret = BMFS_ENOSPC;
+		else if (size != pEntry->FileSize)
+		{
+			pEntry->FileSize = size;
+			ret = bmfs_volume_commit(vol, slot);
+		}
+	}
+	bmfs_volume_unlock(vol);
+	return ret;
+}
+
+
+/* Direct directory access */
+
+char *bmfs_volume_directory(BMFSVolume *vol)
+{
+	return vol->directory;
+}
+
+
+// Write one directory entry (or all of them for slot -1), unless deferred
+int bmfs_volume_commit(BMFSVolume *vol, int slot)
+{
+	int ret = BMFS_OK;
+
+	if (vol->flags & BMFS_READONLY)
+		return BMFS_EREADONLY;
+	volume_mutex_lock(vol);
+	volume_hold(vol, BMFS_EXCLUSIVE, 0);			// Keep what the caller changed
+	if (vol->deferred)
+		vol->dirty = 1;
+	else if (slot < 0 || slot >= 64)
+		ret = (vol->io->write(vol->ctx, vol->directory, 4096, vol->diroffset) != 0) ? BMFS_EIO : BMFS_OK;
+	else
+		ret = (vol->io->write(vol->ctx, vol->directory + slot * 64, 64, vol->diroffset + slot * 64) != 0) ? BMFS_EIO : BMFS_OK;
+	volume_leave(vol);
+	return ret;
+}
+
+
+// While deferred the directory lock is held, so the changes are made to the
+// current directory and no other process can overwrite them. Every other
+// process waits meanwhile, so callers keep deferral short.
+int bmfs_volume_defer(BMFSVolume *vol, int defer)
+{
+	int ret = BMFS_OK;
+
+	volume_mutex_lock(vol);
+	if (defer && !vol->deferred)
+	{
+		volume_hold(vol, BMFS_EXCLUSIVE, 1);
+		vol->deferred = 1;
+	}
+	else if (!defer && vol->deferred)
+	{
+		ret = bmfs_volume_flush(vol);
+		vol->deferred = 0;
+		volume_release(vol);
+	}
+	volume_mutex_unlock(vol);
+	return ret;
+}
+
+
+int bmfs_volume_flush(BMFSVolume *vol)
+{
+	int ret = BMFS_OK;
+
+	volume_mutex_lock(vol);
+	volume_hold(vol, BMFS_EXCLUSIVE, 0);
+	if (vol->dirty)
+	{
+		if (vol->io->write(vol->ctx, vol->directory, 4096, vol->diroffset) != 0)
+			ret = BMFS_EIO;
+		else
+			vol->dirty = 0;
+	}
+	volume_leave(vol);
+	return ret;
+}
+
+
+/* EOF */
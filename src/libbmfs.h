@@ -0,0 +1,162 @@
+/* BareMetal File System Library */
+/* Volume handles for BMFS and BMFS-Lite disks */
+/* v1.0 (2026 10 15) */
+
+#ifndef LIBBMFS_H
+#define LIBBMFS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Directory entry, 64 bytes on disk */
+struct BMFSEntry
+{
+	char FileName[32];
+	uint64_t StartingBlock;
+	uint64_t ReservedBlocks;
+	uint64_t FileSize;
+	uint64_t Unused;
+};
+
+/* Disk usage returned by bmfs_volume_query */
+struct BMFSInfo
+{
+	uint64_t DiskSize;		// Bytes
+	uint64_t BlockSize;		// Bytes, 2MiB for BMFS and 1KiB for BMFS-Lite
+	uint64_t DataBlocks;		// Blocks that files can be stored in
+	uint64_t FreeBlocks;		// Data blocks not reserved by any file
+	uint64_t LargestFree;		// Longest run of free blocks, the largest file that can be created
+	int Files;
+	int FreeEntries;		// Directory entries left
+};
+
+/* Disk access for bmfs_volume_attach. read and write transfer exactly len
+ * bytes at an absolute byte offset and return 0 on success. They are called
+ * from several threads at once when the volume is shared, so they must not
+ * rely on a file position. close is optional and is called by
+ * bmfs_volume_close. lock is optional too: it takes or drops (BMFS_SHARED,
+ * BMFS_EXCLUSIVE or BMFS_UNLOCK) a lock on len bytes at offset that other
+ * processes using the disk respect, waiting until it is granted.
+ * bmfs_fd_lock does this for a file descriptor. */
+struct BMFSVolumeIO
+{
+	int (*read)(void *ctx, void *buf, size_t len, uint64_t offset);
+	int (*write)(void *ctx, const void *buf, size_t len, uint64_t offset);
+	uint64_t (*size)(void *ctx);
+	void (*close)(void *ctx);
+	int (*lock)(void *ctx, int type, uint64_t offset, uint64_t len);
+};
+
+typedef struct BMFSVolume BMFSVolume;
+
+/* bmfs_volume_open and bmfs_volume_attach flags */
+#define BMFS_READONLY	1	// Refuse changes, the disk is opened read only
+#define BMFS_LITE	2	// BMFS-Lite: 1KiB blocks, directory at the start of the disk
+#define BMFS_NOCHECK	4	// Accept a disk without the BMFS tag, e.g. to format it
+#define BMFS_MMAP	8	// Access the disk through a memory mapping (bmfs_volume_open)
+
+/* Error codes, every call returns 0 (BMFS_OK) or one of these */
+#define BMFS_OK		0
+#define BMFS_EIO	1	// Disk read or write failed
+#define BMFS_ENOTFOUND	2	// No file of that name
+#define BMFS_EEXIST	3	// A file of that name already exists
+#define BMFS_ENOSPC	4	// Not enough free or reserved blocks
+#define BMFS_EDIRFULL	5	// No free directory entries
+#define BMFS_ENAME	6	// File name empty, too long, or not usable as a local file name
+#define BMFS_EFORMAT	7	// Not a BMFS formatted disk
+#define BMFS_ERANGE	8	// Offset past the end of the file
+#define BMFS_ENOMEM	9
+#define BMFS_EREADONLY	10	// Volume opened with BMFS_READONLY
+#define BMFS_EINVAL	11	// Invalid argument
+
+/* Lock types */
+#define BMFS_UNLOCK	0
+#define BMFS_SHARED	1	// Readers
+#define BMFS_EXCLUSIVE	2	// A writer
+
+/* Opening and closing. A handle holds everything about one disk, so any
+ * number can be open at once. Calls on different handles never interfere,
+ * and on POSIX systems one handle can be shared between threads: directory
+ * changes are serialized by a lock held only for the update itself, and data
+ * transfers run in parallel. Returns NULL on failure with the reason in
+ * *error (if not NULL). */
+BMFSVolume *bmfs_volume_open(const char *path, int flags, int *error);
+BMFSVolume *bmfs_volume_attach(const struct BMFSVolumeIO *io, void *ctx, int flags, int *error);
+int bmfs_volume_close(BMFSVolume *vol);
+const char *bmfs_strerror(int error);
+
+/* Directory */
+int bmfs_name_valid(const char *name);
+int bmfs_volume_query(BMFSVolume *vol, struct BMFSInfo *info);
+int bmfs_volume_find(BMFSVolume *vol, const char *name, struct BMFSEntry *entry, int *slot);
+int bmfs_volume_list(BMFSVolume *vol, struct BMFSEntry *entries, int max, int *count);
+int bmfs_entry_cmp(const void *a, const void *b);	/* qsort entries into disk order, deleted ones last */
+int bmfs_volume_create(BMFSVolume *vol, const char *name, uint64_t blocks);
+int bmfs_volume_reserve(BMFSVolume *vol, const char *name, uint64_t blocks, struct BMFSEntry *entry, int *slot);
+int bmfs_volume_delete(BMFSVolume *vol, const char *name);
+int bmfs_volume_format(BMFSVolume *vol);
+
+/* File data. read copies up to len bytes from offset into the file, with the
+ * count in *done. write stores len bytes at offset, which may be at most the
+ * current size, and extends the file if they run past its end. The data
+ * must fit in the reserved blocks. setsize changes the size in place.
+ *
+ * Writers of different files do not wait for each other. The lock is only
+ * held to allocate (create, reserve) and to record a new size, and the data
+ * goes to the reserved blocks without it. To fill many files at once,
+ * reserve them all with the directory deferred, copy the data on as many
+ * threads as wanted (bmfs_volume_write, or straight to StartingBlock of the
+ * returned entry through the disk), then setsize each file and flush the
+ * directory once. */
+int bmfs_volume_read(BMFSVolume *vol, const char *name, uint64_t offset, void *buf, size_t len, size_t *done);
+int bmfs_volume_write(BMFSVolume *vol, const char *name, uint64_t offset, const void *buf, size_t len);
+int bmfs_volume_setsize(BMFSVolume *vol, const char *name, uint64_t size);
+
+/* Direct directory access for tools that place data themselves. The 4KiB
+ * directory is edited in memory, then bmfs_volume_commit writes one entry
+ * (slot) or the whole directory (slot -1). While deferred, changes are only
+ * noted and bmfs_volume_flush writes the directory once. Ending deferral
+ * flushes. lock and unlock guard direct edits against other threads and
+ * processes, and lock reloads the directory so the edit starts from what is
+ * on the disk. */
+char *bmfs_volume_directory(BMFSVolume *vol);
+int bmfs_volume_commit(BMFSVolume *vol, int slot);
+int bmfs_volume_defer(BMFSVolume *vol, int defer);
+int bmfs_volume_flush(BMFSVolume *vol);
+void bmfs_volume_lock(BMFSVolume *vol);
+void bmfs_volume_unlock(BMFSVolume *vol);
+
+/* Several processes can use one disk. The directory is read under a shared
+ * lock on its 4KiB and reloaded before every lookup, and each change holds
+ * an exclusive lock on it while the directory is reloaded, changed and
+ * written. A deferred volume holds the exclusive lock until deferral ends,
+ * so defer only around a group of directory changes, never while file data
+ * is copied or input is waited for. File data is locked per file:
+ * bmfs_volume_read and bmfs_volume_write lock the reserved blocks of the
+ * file, shared or exclusive, for the transfer, so writers of different files
+ * run side by side and blocks are not handed to a new file while they are
+ * still being read. lockfile finds a file and locks its blocks in one step,
+ * lockextent locks or unlocks (BMFS_UNLOCK) the blocks of an entry, for
+ * tools that move the data themselves. Blocks are locked before the
+ * directory: take these with the directory free, then the directory can be
+ * locked while holding blocks, e.g. to record a new size before letting
+ * others at the file. Locks are advisory and are not taken on systems
+ * without them. Block locks belong to the thread that took them and are
+ * released by it: other threads of the same handle wait for them just as
+ * other processes do, and a thread locking blocks it already holds changes
+ * its lock in place. */
+int bmfs_volume_lockfile(BMFSVolume *vol, const char *name, int type, struct BMFSEntry *entry);
+int bmfs_volume_lockextent(BMFSVolume *vol, const struct BMFSEntry *entry, int type);
+int bmfs_fd_lock(int fd, int type, uint64_t offset, uint64_t len);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
+
+/* EOF */